@@ -107,6 +107,13 @@ namespace Fuse {
 	 */
 	bool support_symlinks();
 
+	/**
+	 * FUSE File system implementation supports concurrent operations
+	 *
+	 * If false, at most one FUSE operation is executed at a time.
+	 */
+	bool support_concurrent_ops();
+
 	/* list of FUSE operations as of version 2.6 */
 	enum Fuse_operations {
 		FUSE_OP_GETATTR     =  0,
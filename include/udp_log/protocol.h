@@ -0,0 +1,139 @@
+/*
+ * \brief  Wire format of log streams sent by udp_log and received by log_udp
+ * \date   2026-10-19
+ */
+
+/*
+ * Copyright (C) 2026 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU General Public License version 2.
+ */
+
+#ifndef __INCLUDE__UDP_LOG__PROTOCOL_H_
+#define __INCLUDE__UDP_LOG__PROTOCOL_H_
+
+#include <base/fixed_stdint.h>
+#include <util/endian.h>
+
+namespace Udp_log {
+	namespace Protocol {
+		using Genode::uint8_t;
+		using Genode::uint16_t;
+		using Genode::uint32_t;
+
+		class Datagram_header;
+		class Line_header;
+		class Nack;
+	}
+}
+
+
+/**
+ * Header at the start of each datagram
+ *
+ * The sequence number is counted per destination and lets the receiver
+ * detect lost datagrams. A datagram with the 'NACK' flag travels in the
+ * opposite direction and requests the retransmission of datagrams.
+ */
+class Udp_log::Protocol::Datagram_header
+{
+	public:
+
+		enum { MAGIC_0 = 'G', MAGIC_1 = 'L', VERSION = 1 };
+
+		enum Flag { RETRANSMIT = 1, NACK = 2 };
+
+	private:
+
+		uint8_t  _magic[2];
+		uint8_t  _version;
+		uint8_t  _flags;
+		uint32_t _seq;
+
+	public:
+
+		void init(uint32_t seq, uint8_t flags)
+		{
+			_magic[0] = MAGIC_0;
+			_magic[1] = MAGIC_1;
+			_version  = VERSION;
+			_flags    = flags;
+			_seq      = host_to_big_endian(seq);
+		}
+
+		bool valid() const {
+			return _magic[0] == MAGIC_0 && _magic[1] == MAGIC_1
+			    && _version == VERSION; }
+
+		uint32_t seq()   const { return host_to_big_endian(_seq); }
+		uint8_t  flags() const { return _flags; }
+
+		void flags(uint8_t flags) { _flags = flags; }
+
+} __attribute__((packed));
+
+
+/**
+ * Header preceding each log line within a datagram
+ *
+ * The sequence number is counted per LOG session, the timestamp is the
+ * sender's monotonic time in milliseconds. The line text of 'length' bytes
+ * follows the header without a terminating '\0'.
+ */
+class Udp_log::Protocol::Line_header
+{
+	private:
+
+		uint16_t _session;
+		uint16_t _length;
+		uint32_t _seq;
+		uint32_t _time_ms;
+
+	public:
+
+		void init(uint16_t session, uint32_t seq, uint32_t time_ms, uint16_t length)
+		{
+			_session = host_to_big_endian(session);
+			_length  = host_to_big_endian(length);
+			_seq     = host_to_big_endian(seq);
+			_time_ms = host_to_big_endian(time_ms);
+		}
+
+		uint16_t session() const { return host_to_big_endian(_session); }
+		uint16_t length()  const { return host_to_big_endian(_length); }
+		uint32_t seq()     const { return host_to_big_endian(_seq); }
+		uint32_t time_ms() const { return host_to_big_endian(_time_ms); }
+
+		char const *text() const { return (char const *)(this + 1); }
+
+} __attribute__((packed));
+
+
+/**
+ * Request for retransmitting 'count' datagrams starting at 'header.seq()'
+ */
+class Udp_log::Protocol::Nack
+{
+	private:
+
+		Datagram_header _header;
+		uint16_t        _count;
+
+	public:
+
+		void init(uint32_t first, uint16_t count)
+		{
+			_header.init(first, Datagram_header::NACK);
+			_count = host_to_big_endian(count);
+		}
+
+		bool valid() const {
+			return _header.valid() && (_header.flags() & Datagram_header::NACK); }
+
+		uint32_t first() const { return _header.seq(); }
+		uint16_t count() const { return host_to_big_endian(_count); }
+
+} __attribute__((packed));
+
+#endif /* __INCLUDE__UDP_LOG__PROTOCOL_H_ */
@@ -2,6 +2,8 @@ LIBS   = libc libfuse
 
 SRC_CC = plugin.cc
 
+INC_DIR += $(REP_DIR)/src/lib/libc_fuse
+
 vpath %.cc $(REP_DIR)/src/lib/libc_fuse
 
 CC_CXX_WARN_STRICT =
@@ -19,9 +19,13 @@
 /* Genode includes */
 #include <block_session/connection.h>
 #include <timer_session/connection.h>
+#include <base/attached_rom_dataspace.h>
 #include <base/heap.h>
 #include <base/component.h>
+#include <base/semaphore.h>
+#include <base/thread.h>
 #include <base/sleep.h>
+#include <util/reconstructible.h>
 
 /* Jitterentropy includes */
 #include <jitterentropy.h>
@@ -36,18 +40,194 @@
 namespace Blk_shred {
 	using namespace Genode;
 	using namespace Block;
+	struct Noise_pool;
 	struct Main;
 
 	enum {
 		/* XXX: part_blk has a fixed backend buffer that limits our packet size */
-		PKT_SIZE = 1 << 20,
-		PKT_BUF_SIZE = PKT_SIZE*2 + (32<<10)
+		DEFAULT_PKT_SIZE    = 1 << 20,
+		DEFAULT_QUEUE_DEPTH = 2,
+		MAX_QUEUE_DEPTH     = 64,
+		PKT_BUF_SLACK       = 32 << 10,
 	};
 
 	uint64_t pcg_init[2] PCG32_INITIALIZER;
+
+	template <typename FN>
+	void generate_noise(pcg32_random_t const &, uint64_t, size_t, FN const &);
+}
+
+
+/**
+ * Pass 'n' words of the noise stream starting at 'pos' to 'fn'
+ *
+ * The noise is the output of a single PCG stream over the whole device,
+ * so any part of it can be produced independently by seeking a copy of
+ * the generator. The words are computed in interleaved lanes, each lane
+ * stepping the LCG by the number of lanes at once.
+ */
+template <typename FN>
+void Blk_shred::generate_noise(pcg32_random_t const &origin,
+                               uint64_t pos, size_t n, FN const &fn)
+{
+	typedef uint64_t lanes_t __attribute__((vector_size(4*sizeof(uint64_t))));
+	enum { LANES = sizeof(lanes_t) / sizeof(uint64_t) };
+
+	pcg32_random_t rng = origin;
+	pcg32_advance_r(&rng, pos);
+
+	/* LCG parameters of 'LANES' consecutive steps */
+	uint64_t mult = 1, plus = 0;
+	lanes_t state;
+	for (unsigned k = 0; k < LANES; k++) {
+		state[k] = mult*rng.state + plus;
+		plus = plus*PCG_DEFAULT_MULTIPLIER_64 + rng.inc;
+		mult = mult*PCG_DEFAULT_MULTIPLIER_64;
+	}
+
+	size_t i = 0;
+	for (; i + LANES <= n; i += LANES) {
+
+		/* XSH RR output function of 'pcg32_random_r' */
+		lanes_t const x   = (((state >> 18) ^ state) >> 27) & 0xffffffffu;
+		lanes_t const rot = state >> 59;
+		lanes_t const w   = ((x >> rot) | (x << ((32 - rot) & 31))) & 0xffffffffu;
+
+		for (unsigned k = 0; k < LANES; k++)
+			fn(i + k, (uint32_t)w[k]);
+
+		state = state*mult + plus;
+	}
+
+	rng.state = state[0];
+	for (; i < n; i++)
+		fn(i, pcg32_random_r(&rng));
 }
 
 
+/**
+ * Threads that fill or check packet buffers with noise in parallel
+ *
+ * The calling thread takes the first slice of each job.
+ */
+struct Blk_shred::Noise_pool
+{
+	enum { STACK_SIZE = 16*1024, MAX_WORKERS = 64 };
+
+	struct Worker : Thread
+	{
+		Noise_pool &_pool;
+		unsigned    _index;
+		Semaphore   _start { };
+
+		void entry() override
+		{
+			for (;;) {
+				_start.down();
+				_pool._work(_index);
+				_pool._done.up();
+			}
+		}
+
+		Worker(Env &env, Noise_pool &pool, unsigned index,
+		       Affinity::Location location)
+		:
+			Thread(env, Thread::Name("noise ", index), STACK_SIZE,
+			       location, Cpu_session::Weight(), env.cpu()),
+			_pool(pool), _index(index)
+		{ }
+
+		void work() { _start.up(); }
+	};
+
+	pcg32_random_t const &_origin;
+
+	Heap     &_heap;
+	unsigned  _num_workers;
+	Worker   *_workers[MAX_WORKERS] { };
+
+	Semaphore _done { };
+
+	/* job in progress */
+	uint32_t *_buffer   { nullptr };
+	uint64_t  _pos      { 0 };
+	size_t    _words    { 0 };
+	bool      _check    { false };
+	bool      _mismatch[MAX_WORKERS] { };
+
+	void _work(unsigned index)
+	{
+		/* slice boundaries are multiples of four words */
+		size_t const begin = (_words * index       / _num_workers) & ~(size_t)3;
+		size_t const end   = index + 1 == _num_workers ? _words
+		                   : (_words * (index + 1) / _num_workers) & ~(size_t)3;
+
+		uint32_t *buffer = _buffer + begin;
+
+		if (_check) {
+			bool mismatch = false;
+			generate_noise(_origin, _pos + begin, end - begin,
+				[&] (size_t i, uint32_t w) { mismatch |= buffer[i] != w; });
+			_mismatch[index] = mismatch;
+		} else {
+			generate_noise(_origin, _pos + begin, end - begin,
+				[&] (size_t i, uint32_t w) { buffer[i] = w; });
+		}
+	}
+
+	void _run()
+	{
+		for (unsigned i = 1; i < _num_workers; i++)
+			_workers[i]->work();
+
+		_work(0);
+
+		for (unsigned i = 1; i < _num_workers; i++)
+			_done.down();
+	}
+
+	Noise_pool(Env &env, Heap &heap, pcg32_random_t const &origin,
+	           unsigned num_workers)
+	:
+		_origin(origin), _heap(heap),
+		_num_workers(max(1U, min(num_workers, (unsigned)MAX_WORKERS)))
+	{
+		Affinity::Space const space = env.cpu().affinity_space();
+
+		for (unsigned i = 1; i < _num_workers; i++) {
+			_workers[i] = new (_heap)
+				Worker(env, *this, i, space.location_of_index(i % space.total()));
+			_workers[i]->start();
+		}
+	}
+
+	unsigned num_workers() const { return _num_workers; }
+
+	/**
+	 * Fill 'words' of 'buffer' with the noise at stream position 'pos'
+	 */
+	void fill(uint32_t *buffer, uint64_t pos, size_t words)
+	{
+		_buffer = buffer; _pos = pos; _words = words; _check = false;
+		_run();
+	}
+
+	/**
+	 * Return true if 'buffer' matches the noise at stream position 'pos'
+	 */
+	bool check(uint32_t *buffer, uint64_t pos, size_t words)
+	{
+		_buffer = buffer; _pos = pos; _words = words; _check = true;
+		_run();
+
+		for (unsigned i = 0; i < _num_workers; i++)
+			if (_mismatch[i])
+				return false;
+		return true;
+	}
+};
+
+
 struct Blk_shred::Main
 {
 	Main(Main const &);
@@ -59,10 +239,30 @@ struct Blk_shred::Main
 
 	Heap heap { env.pd(), env.rm() };
 
+	/* the configuration is optional, all attributes have defaults */
+	Constructible<Attached_rom_dataspace> config_rom { };
+
+	Xml_node config() const {
+		return config_rom.constructed() ? config_rom->xml() : Xml_node("<config/>"); }
+
+	bool const init_config = [&] () {
+		try { config_rom.construct(env, "config"); }
+		catch (Service_denied) { }
+		return true; } ();
+
+	size_t const pkt_size =
+		max((size_t)config().attribute_value("packet_size",
+		                                     Number_of_bytes(DEFAULT_PKT_SIZE)),
+		    (size_t)4096);
+
+	unsigned const queue_depth =
+		max(1U, min(config().attribute_value("queue_depth", (unsigned)DEFAULT_QUEUE_DEPTH),
+		            (unsigned)MAX_QUEUE_DEPTH));
+
 	Allocator_avl packet_alloc { &heap };
 
 	Block::Connection<> blk {
-		env, &packet_alloc, PKT_BUF_SIZE };
+		env, &packet_alloc, pkt_size*queue_depth + PKT_BUF_SLACK };
 
 	Block::Session::Tx::Source &pkt_source = *blk.tx();
 
@@ -71,6 +271,13 @@ struct Blk_shred::Main
 	rand_data *jent { nullptr };
 	pcg32_random_t pcg PCG32_INITIALIZER;
 
+	/* generator at the start of the device */
+	pcg32_random_t origin PCG32_INITIALIZER;
+
+	Noise_pool noise { env, heap, origin,
+		config().attribute_value("workers",
+		                         (unsigned)env.cpu().affinity_space().total()) };
+
 	template <typename... ARGS>
 	void die(ARGS &&... args)
 	{
@@ -104,6 +311,7 @@ struct Blk_shred::Main
 		pcg_init[1] |= 1;
 
 		pcg32_srandom_r(&pcg, pcg_init[0], pcg_init[1]);
+		origin = pcg;
 	}
 
 	Main(Genode::Env &env) : env(env)
@@ -134,73 +342,105 @@ struct Blk_shred::Main
 		jent_entropy_collector_free(jent);
 	}
 
+	uint32_t *content(Block::Packet_descriptor const &pkt) {
+		return (uint32_t*)pkt_source.packet_content(pkt); }
+
+	uint64_t stream_pos(Block::Packet_descriptor const &pkt) const {
+		return pkt.block_number()*(info.block_size / sizeof(uint32_t)); }
+
+	size_t words(Block::Packet_descriptor const &pkt) const {
+		return (pkt.block_count()*info.block_size) / sizeof(uint32_t); }
+
 	void submit_noise(Block::Packet_descriptor const &pkt)
 	{
-		uint32_t *buffer = (uint32_t*)pkt_source.packet_content(pkt);
-		for (size_t i = 0; i < ((pkt.block_count()*info.block_size) / sizeof(uint32_t)); ++i)
-			buffer[i] = pcg32_random_r(&pcg);
+		noise.fill(content(pkt), stream_pos(pkt), words(pkt));
 		pkt_source.submit_packet(pkt);
 	}
 
-	void shred()
+	/**
+	 * Pass the whole device through 'queue_depth' packets in flight
+	 *
+	 * The first packet aligns those that follow with the end of the
+	 * device. 'submit_fn' is called for each allocated packet and
+	 * 'ack_fn' for each acknowledged one.
+	 */
+	template <typename SUBMIT_FN, typename ACK_FN>
+	void stream_device(Block::Packet_descriptor::Opcode op,
+	                   SUBMIT_FN const &submit_fn, ACK_FN const &ack_fn)
 	{
-		float const mbytes = (float(info.block_count) * float(info.block_size)) / (1<<20);
-		log("shredding ", mbytes/(1<<10), " GiB...");
-		auto start_ms = timer.elapsed_ms();
+		size_t const blk_per_pkt = max(pkt_size / info.block_size, (size_t)1);
 
-		size_t const blk_per_pkt = PKT_SIZE / info.block_size;
-		size_t const bytes_per_pkt =  blk_per_pkt * info.block_size;
+		Block::sector_t blk_count = info.block_count % blk_per_pkt;
+		if (blk_count == 0)
+			blk_count = blk_per_pkt;
 
-		/*
-		 * send two packets in succession, the first write
-		 * aligns those that follow with end of the device
-		 */
-		Block::sector_t blk_offset = info.block_count % blk_per_pkt;
-		if (blk_offset == 0)
-			blk_offset = blk_per_pkt;
+		Block::sector_t blk_offset = 0;
+		unsigned in_flight = 0;
 
-		{
-			Block::Packet_descriptor pkt(
-				pkt_source.alloc_packet(bytes_per_pkt),
-				Block::Packet_descriptor::WRITE,
-				0, blk_offset);
-			submit_noise(pkt);
-		}
+		while (blk_offset < info.block_count || in_flight) {
 
-		{
-			Block::Packet_descriptor pkt(
-				pkt_source.alloc_packet(bytes_per_pkt),
-				Block::Packet_descriptor::WRITE,
-				blk_offset, blk_per_pkt);
-			submit_noise(pkt);
-			blk_offset += blk_per_pkt;
-		}
+			while (blk_offset < info.block_count && in_flight < queue_depth
+			    && pkt_source.ready_to_submit()) {
+
+				Block::Packet_descriptor const pkt(
+					pkt_source.alloc_packet(blk_count*info.block_size),
+					op, blk_offset, blk_count);
+
+				submit_fn(pkt);
+				blk_offset += blk_count;
+				blk_count   = blk_per_pkt;
+				in_flight++;
+			}
 
-		while (true) {
 			Block::Packet_descriptor const ack = pkt_source.get_acked_packet();
+			in_flight--;
+
 			if (!ack.succeeded())
 				error("ack indicates failure ", ack.block_number(),"/",info.block_count);
+			else
+				ack_fn(ack);
 
 			pkt_source.release_packet(ack);
-
-			if (blk_offset >= info.block_count) break;
-
-			/* reuse packet buffer region */
-			Block::Packet_descriptor const pkt(
-				ack, Block::Packet_descriptor::WRITE,
-				blk_offset, blk_per_pkt);
-			submit_noise(pkt);
-			blk_offset += blk_per_pkt;
 		}
+	}
+
+	void shred()
+	{
+		float const mbytes = (float(info.block_count) * float(info.block_size)) / (1<<20);
+		log("shredding ", mbytes/(1<<10), " GiB with ", queue_depth,
+		    " packets of ", pkt_size >> 10, " KiB in flight and ",
+		    noise.num_workers(), " noise threads...");
+		auto start_ms = timer.elapsed_ms();
 
-		Block::Packet_descriptor const ack = pkt_source.get_acked_packet();
-		if (!ack.succeeded())
-			error("ack indicates failure ", ack.block_number(),"/",info.block_count);
+		stream_device(Block::Packet_descriptor::WRITE,
+			[&] (Block::Packet_descriptor const &pkt) { submit_noise(pkt); },
+			[&] (Block::Packet_descriptor const &) { });
 
-		float seconds = (timer.elapsed_ms() - start_ms) / 1000;
+		float seconds = (timer.elapsed_ms() - start_ms) / 1000.0f;
 		log("shred complete, ", mbytes / seconds, " MiB/s");
 	}
 
+	/**
+	 * Read back the whole device and compare it with the noise
+	 */
+	void verify_full()
+	{
+		float const mbytes = (float(info.block_count) * float(info.block_size)) / (1<<20);
+		log("verifying ", mbytes/(1<<10), " GiB...");
+		auto start_ms = timer.elapsed_ms();
+
+		stream_device(Block::Packet_descriptor::READ,
+			[&] (Block::Packet_descriptor const &pkt) {
+				pkt_source.submit_packet(pkt); },
+			[&] (Block::Packet_descriptor const &ack) {
+				if (!noise.check(content(ack), stream_pos(ack), words(ack)))
+					die("blocks ", ack.block_number(), "..",
+					    ack.block_number() + ack.block_count() - 1, " are invalid"); });
+
+		float seconds = (timer.elapsed_ms() - start_ms) / 1000.0f;
+		log("full verification passed, ", mbytes / seconds, " MiB/s");
+	}
+
 	/**
 	 * Verify a block, PCG must first be seeked into position
 	 */
@@ -281,7 +521,14 @@ void Component::construct(Genode::Env &env)
 	Blk_shred::Main main(env);
 
 	main.shred();
-	main.verify();
+
+	typedef Genode::String<8> Mode;
+	Mode const mode = main.config().attribute_value("verify", Mode("spot"));
+
+	if (mode == "full")
+		main.verify_full();
+	else if (mode == "spot")
+		main.verify();
 
 	env.parent().exit(0);
 }
@@ -15,7 +15,9 @@
 #include <terminal_session/connection.h>
 #include <gui_session/connection.h>
 #include <framebuffer_session/connection.h>
+#include <timer_session/connection.h>
 #include <base/attached_dataspace.h>
+#include <base/attached_rom_dataspace.h>
 #include <base/heap.h>
 #include <base/log.h>
 #include <base/component.h>
@@ -35,20 +37,46 @@ struct Entropy_view::Main
 {
 	enum { WIDTH = 256, HEIGHT = 256 };
 
+	/* in batch mode, the histogram is plotted right of the pair scatter */
+	enum { HISTOGRAM_X = WIDTH, BATCH_WIDTH = 2*WIDTH };
+
 	Genode::Env &_env;
 
 	Heap _heap { _env.ram(), _env.rm() };
 
+	Attached_rom_dataspace _config { _env, "config" };
+
+	/*
+	 * Batch mode reads 'batch' bytes per sync, accumulates a byte
+	 * histogram and a scatter of consecutive byte pairs, and reports
+	 * the sustained throughput of the entropy source.
+	 */
+	bool const _batch_mode =
+		_config.xml().attribute_value("mode", String<8>()) == "batch";
+
+	size_t const _batch_size = max((size_t)2,
+		_config.xml().attribute_value("batch", (size_t)64*1024));
+
+	/* brightness increment of a scatter cell per byte pair */
+	unsigned const _gain = _config.xml().attribute_value("gain", 16U);
+
+	unsigned long const _report_ms =
+		_config.xml().attribute_value("report_interval_ms", 5000UL);
+
+	unsigned const _width = _batch_mode ? (unsigned)BATCH_WIDTH : (unsigned)WIDTH;
+
 	Gui::Connection _gui { _env };
 
 	Framebuffer::Session &_fb = *_gui.framebuffer();
 
 	Terminal::Connection _entropy { _env, "entropy" };
 
+	Timer::Connection _timer { _env };
+
 	Dataspace_capability _fb_ds_cap()
 	{
 		using Framebuffer::Mode;
-		Mode mode { .area = { WIDTH, HEIGHT } };
+		Mode mode { .area = { _width, HEIGHT } };
 		_gui.buffer(mode, false);
 		return _fb.dataspace();
 	}
@@ -76,13 +104,137 @@ struct Entropy_view::Main
 		_refresh();
 	}
 
+	/**
+	 * Accumulated statistics of batch mode
+	 */
+	struct Statistics
+	{
+		uint64_t histogram[256] { };
+		uint32_t pairs[256*256] { };
+		uint64_t total = 0;
+	};
+
+	Statistics *_stats = _batch_mode ? new (_heap) Statistics() : nullptr;
+	uint8_t    *_batch = _batch_mode ? (uint8_t *)_heap.alloc(_batch_size) : nullptr;
+
+	/* last byte of the previous batch, continues the pair sequence */
+	int _last_byte = -1;
+
+	uint64_t _report_bytes = 0;
+	uint64_t _report_start_ms = _timer.elapsed_ms();
+
+	size_t _read_batch()
+	{
+		/* a single read is limited by the I/O buffer of the session */
+		size_t n = 0;
+		while (n < _batch_size) {
+			size_t const r = _entropy.read(_batch + n, _batch_size - n);
+			if (r == 0)
+				break;
+			n += r;
+		}
+		return n;
+	}
+
+	void _plot_scatter(uint32_t *pixels, size_t n, Rect &dirty)
+	{
+		int x1 = WIDTH, y1 = HEIGHT, x2 = -1, y2 = -1;
+
+		auto plot = [&] (uint8_t x, uint8_t y)
+		{
+			uint32_t &count = _stats->pairs[y*WIDTH + x];
+			if (count*_gain >= 255)
+				return;
+
+			count++;
+			uint32_t const v = min(255U, count*_gain);
+			pixels[y*_width + x] = (v << 16) | (v << 8) | v;
+
+			x1 = min(x1, (int)x); x2 = max(x2, (int)x);
+			y1 = min(y1, (int)y); y2 = max(y2, (int)y);
+		};
+
+		size_t i = 0;
+		if (_last_byte >= 0 && n > 0)
+			plot((uint8_t)_last_byte, _batch[i]);
+
+		for (; i + 1 < n; ++i)
+			plot(_batch[i], _batch[i + 1]);
+
+		if (n > 0)
+			_last_byte = _batch[n - 1];
+
+		dirty = (x2 < 0) ? Rect()
+		                 : Rect(Point(x1, y1), Point(x2, y2));
+	}
+
+	void _plot_histogram(uint32_t *pixels)
+	{
+		/* bars are scaled such that the expected count is at half height */
+		uint64_t const mean = max<uint64_t>(1, _stats->total / 256);
+
+		for (unsigned b = 0; b < 256; ++b) {
+			unsigned const bar =
+				(unsigned)min<uint64_t>(HEIGHT, _stats->histogram[b]*(HEIGHT/2) / mean);
+
+			for (unsigned y = 0; y < HEIGHT; ++y)
+				pixels[y*_width + HISTOGRAM_X + b] =
+					(HEIGHT - y <= bar) ? 0x00ff00 : 0;
+		}
+	}
+
+	void _report(uint64_t now_ms)
+	{
+		uint64_t const elapsed_ms = now_ms - _report_start_ms;
+		if (!_report_ms || elapsed_ms < _report_ms)
+			return;
+
+		Genode::log("entropy: ", _report_bytes*1000/elapsed_ms, " bytes/s, ",
+		            _stats->total, " bytes total");
+
+		_report_bytes    = 0;
+		_report_start_ms = now_ms;
+	}
+
+	void _plot_batch()
+	{
+		uint32_t *pixels = _fb_ds.local_addr<uint32_t>();
+
+		size_t const n = _read_batch();
+		if (n != _batch_size)
+			Genode::error("read ", n, " of ", _batch_size, " bytes of entropy");
+
+		for (size_t i = 0; i < n; ++i)
+			_stats->histogram[_batch[i]]++;
+		_stats->total += n;
+		_report_bytes += n;
+
+		Rect dirty { };
+		_plot_scatter(pixels, n, dirty);
+		_plot_histogram(pixels);
+
+		if (dirty.valid())
+			_fb.refresh(dirty.x1(), dirty.y1(), dirty.w(), dirty.h());
+		_fb.refresh(HISTOGRAM_X, 0, WIDTH, HEIGHT);
+
+		_report(_timer.elapsed_ms());
+	}
+
+	void _handle_sync()
+	{
+		if (_batch_mode)
+			_plot_batch();
+		else
+			_plot();
+	}
+
 	Signal_handler<Main> _sync_handler {
-		_env.ep(), *this, &Main::_plot };
+		_env.ep(), *this, &Main::_handle_sync };
 
 	Main(Env &env) : _env(env)
 	{
 		_gui.enqueue<Gui::Session::Command::Geometry>(
-			_view, Rect(Point(0, 0), Area (WIDTH, HEIGHT)));
+			_view, Rect(Point(0, 0), Area (_width, HEIGHT)));
 
 		_gui.enqueue<Gui::Session::Command::To_front>(
 			_view, Gui::Session::View_handle());
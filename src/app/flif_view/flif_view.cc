@@ -35,6 +35,7 @@
 #include <libc/component.h>
 extern "C" {
 #include <dirent.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
@@ -43,13 +44,348 @@ extern "C" {
 
 namespace Flif_view {
 	using namespace Genode;
+	struct Page;
+	struct Prefetcher;
 	struct Main;
 
 	using Framebuffer::Mode;
 	typedef Gui::Session::Command Command;
+	typedef Pixel_rgb888 PT;
 }
 
 
+/**
+ * Page held in the cache of the prefetcher
+ *
+ * All members are protected by the mutex of the prefetcher. While a page is
+ * DECODING, 'pixels' may already hold a progressive preview.
+ */
+struct Flif_view::Page
+{
+	enum State { EMPTY, DECODING, DONE, FAILED };
+
+	State         state      = EMPTY;
+	int           index      = -1;
+	unsigned      generation = 0;
+	unsigned long last_used  = 0;
+
+	/* decoder owning all frames of the page */
+	FLIF_DECODER *decoder = nullptr;
+
+	/* texture of the first frame */
+	PT       *pixels = nullptr;
+	unsigned  width  = 0;
+	unsigned  height = 0;
+
+	/**
+	 * Release decoder and texture, must be called from the decoder thread
+	 */
+	void release()
+	{
+		if (decoder)
+			flif_destroy_decoder(decoder);
+		free(pixels);
+
+		decoder = nullptr;
+		pixels  = nullptr;
+		width   = height = 0;
+		index   = -1;
+		state   = EMPTY;
+	}
+};
+
+
+/**
+ * Background decoder of the current page and its neighbours
+ *
+ * The entrypoint updates the requested page and the decoder thread keeps the
+ * current, the next, and the previous page decoded in a small LRU cache. The
+ * entrypoint is notified of each finished decode and of each progressive
+ * pass of the current page.
+ */
+struct Flif_view::Prefetcher
+{
+	Prefetcher(Prefetcher const &);
+	Prefetcher &operator = (Prefetcher const &);
+
+	enum { CACHE_SIZE = 4, STACK_SIZE = 512*1024 };
+
+	Mutex     mutex  { };
+	Semaphore wakeup { };
+
+	Signal_transmitter update_transmitter;
+
+	Timer::Connection &timer;
+
+	Page pages[CACHE_SIZE];
+
+	/*
+	 * Request state written by the entrypoint
+	 *
+	 * The generation is incremented whenever the directory is rescanned and
+	 * invalidates all pages decoded before.
+	 */
+	struct dirent **namelist   = nullptr;
+	int             page_count = 0;
+	int             current    = 0;
+	int             direction  = 1;
+	unsigned        generation = 0;
+	Surface_base::Area fit     { };
+	bool            progressive = false;
+	bool            verbose     = false;
+
+	/* state of the decoder thread */
+	Page         *decoding    = nullptr;
+	bool          aborted     = false;
+	unsigned long use_counter = 0;
+	unsigned long last_ms     = 0;
+
+	pthread_t thread { };
+
+	int wrap(int index) const
+	{
+		if (page_count < 1) return 0;
+		index %= page_count;
+		return index < 0 ? index + page_count : index;
+	}
+
+	/**
+	 * Return true if page is current, next, or previous
+	 */
+	bool wanted(int index, unsigned gen) const
+	{
+		return gen == generation
+		    && (index == current
+		     || index == wrap(current + 1)
+		     || index == wrap(current - 1));
+	}
+
+	Page *lookup(int index)
+	{
+		for (Page &page : pages)
+			if (page.state != Page::EMPTY
+			 && page.index == index && page.generation == generation)
+				return &page;
+		return nullptr;
+	}
+
+	/**
+	 * Return next wanted page not present in the cache, or -1
+	 */
+	int _missing_page()
+	{
+		if (page_count < 1) return -1;
+
+		int const candidates[] = { current,
+		                           wrap(current + direction),
+		                           wrap(current - direction) };
+
+		for (int index : candidates)
+			if (!lookup(index))
+				return index;
+		return -1;
+	}
+
+	/**
+	 * Return empty page or least-recently used page that is not wanted
+	 */
+	Page &_victim()
+	{
+		Page *victim = nullptr;
+		for (Page &page : pages) {
+			if (page.state == Page::EMPTY)
+				return page;
+			if (wanted(page.index, page.generation))
+				continue;
+			if (!victim || page.last_used < victim->last_used)
+				victim = &page;
+		}
+
+		/* the cache is larger than the set of wanted pages */
+		return *victim;
+	}
+
+	/**
+	 * Convert image into a texture of the page
+	 *
+	 * The conversion happens outside the mutex, the entrypoint only ever
+	 * observes complete textures.
+	 */
+	void convert(Page &page, FLIF_IMAGE *img)
+	{
+		unsigned const w = flif_image_get_width(img);
+		unsigned const h = flif_image_get_height(img);
+
+		PT            *pixels = (PT *)malloc(w*h*sizeof(PT));
+		unsigned char *row    = (unsigned char *)malloc(w*4);
+
+		if (!pixels || !row) {
+			Genode::error("out of memory for ", w, "x", h, " texture");
+			free(pixels);
+			free(row);
+			return;
+		}
+
+		Texture<PT> texture(pixels, nullptr, Surface_base::Area(w, h));
+		for (unsigned y = 0; y < h; ++y) {
+			flif_image_read_row_RGBA8(img, y, row, w*4);
+			texture.rgba(row, w, y);
+		}
+		free(row);
+
+		Mutex::Guard guard(mutex);
+		free(page.pixels);
+		page.pixels = pixels;
+		page.width  = w;
+		page.height = h;
+	}
+
+	/**
+	 * Decode the next missing page
+	 *
+	 * \return false if all wanted pages are cached
+	 */
+	bool decode_next()
+	{
+		Page *page = nullptr;
+		char  filename[sizeof(dirent::d_name)] { };
+		Surface_base::Area area { };
+
+		{
+			Mutex::Guard guard(mutex);
+
+			int const index = _missing_page();
+			if (index < 0)
+				return false;
+
+			page = &_victim();
+			page->release();
+			page->state      = Page::DECODING;
+			page->index      = index;
+			page->generation = generation;
+			page->decoder    = flif_create_decoder();
+
+			copy_cstring(filename, namelist[index]->d_name, sizeof(filename));
+			area     = fit;
+			decoding = page;
+			aborted  = false;
+		}
+
+		flif_decoder_set_resize(page->decoder, area.w(), area.h());
+		flif_decoder_set_callback(page->decoder, &progressive_render, this);
+
+		if (verbose)
+			last_ms = timer.elapsed_ms();
+
+		bool const ok = flif_decoder_decode_file(page->decoder, filename);
+
+		FLIF_IMAGE *img = ok ? flif_decoder_get_image(page->decoder, 0) : nullptr;
+		if (img)
+			convert(*page, img);
+
+		{
+			Mutex::Guard guard(mutex);
+
+			decoding = nullptr;
+
+			if (aborted || !wanted(page->index, page->generation)) {
+				/* outdated by input meanwhile, decoded again on demand */
+				page->release();
+			} else
+			if (!img) {
+				Genode::error("decode '", (char const *)filename, "' failed");
+				int const index = page->index;
+				page->release();
+				page->index      = index;
+				page->generation = generation;
+				page->state      = Page::FAILED;
+			} else {
+				page->state     = Page::DONE;
+				page->last_used = ++use_counter;
+			}
+		}
+
+		update_transmitter.submit();
+		return true;
+	}
+
+	/**
+	 * Callback of the FLIF decoder, executed by the decoder thread
+	 */
+	static ::uint32_t progressive_render(::uint32_t quality, ::int64_t bytes_read,
+	                                     ::uint8_t /*decode_over*/,
+	                                     void *user_data, void *context)
+	{
+		Prefetcher &p    = *(Prefetcher *)user_data;
+		Page       &page = *p.decoding;
+
+		if (p.verbose) {
+			unsigned long const now_ms = p.timer.elapsed_ms();
+			double dur_s = double(now_ms - p.last_ms) / 1000.0;
+			p.last_ms = now_ms;
+			Genode::log((double(bytes_read) / (1 << 20)) / dur_s, " MiB/s");
+		}
+
+		bool cancel = false, preview = false;
+		{
+			Mutex::Guard guard(p.mutex);
+			cancel  = !p.wanted(page.index, page.generation);
+			preview = p.progressive && page.index == p.current;
+		}
+
+		/* abort decoding if input has moved the page out of reach */
+		if (cancel) {
+			p.aborted = true;
+			flif_abort_decoder(page.decoder);
+			return 0;
+		}
+
+		if (preview) {
+			flif_decoder_generate_preview(context);
+
+			FLIF_IMAGE *img = flif_decoder_get_image(page.decoder, 0);
+			if (img) {
+				p.convert(page, img);
+				p.update_transmitter.submit();
+			}
+		}
+
+		return ++quality;
+	}
+
+	void entry()
+	{
+		for (;;) {
+			wakeup.down();
+			while (decode_next()) { }
+		}
+	}
+
+	static void *_entry(void *arg)
+	{
+		((Prefetcher *)arg)->entry();
+		return nullptr;
+	}
+
+	/**
+	 * Constructor, must be called from libc context
+	 */
+	Prefetcher(Signal_context_capability sigh, Timer::Connection &timer)
+	:
+		update_transmitter(sigh), timer(timer)
+	{
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setstacksize(&attr, STACK_SIZE);
+
+		if (pthread_create(&thread, &attr, _entry, this))
+			Genode::error("failed to create decoder thread");
+
+		pthread_attr_destroy(&attr);
+	}
+};
+
+
 struct Flif_view::Main
 {
 	Main(Main const &);
@@ -113,8 +449,6 @@ struct Flif_view::Main
 
 	void handle_sync_signal()
 	{
-		typedef Pixel_rgb888 PT;
-
 		Texture<PT> texture(back_ds.local_addr<PT>(), nullptr, gui_mode.area);
 		Surface<PT> surface(nit_ds->local_addr<PT>(), gui_mode.area);
 
@@ -144,54 +478,44 @@ struct Flif_view::Main
 	Gui::Session::View_handle view_handle = gui.create_view();
 
 	void render(FLIF_IMAGE *img);
+	void render(Page const &page);
 
-	FLIF_DECODER *flif_dec = NULL;
+	Prefetcher prefetcher { app_handler, timer };
 
 	struct dirent **namelist = NULL;
 	int page_count = 0;
 
 	int cur_page_index = 0;
-	int pending_page_index = 0;
 	int cur_frame = 0;
 
-	unsigned long last_ms = 0;
+	/* page and generation currently on screen */
+	int      shown_page       = -1;
+	unsigned shown_generation = 0;
+	bool     shown_final      = false;
+
+	/* number of consecutive pages that failed to decode */
+	int failed_pages = 0;
 
 	bool progressive = false;
 	bool verbose = false;
 
-	bool render_page();
+	void show_page();
 
-	void next_page()
+	/**
+	 * Move to another page and let the prefetcher follow
+	 */
+	void request_page(int direction)
 	{
-		while (true) {
-			++cur_page_index;
-			if (cur_page_index > page_count-1)
-				cur_page_index = 0;
-			if (render_page())
-				break;
+		{
+			Mutex::Guard guard(prefetcher.mutex);
+			cur_page_index = prefetcher.wrap(cur_page_index + direction);
+			prefetcher.current   = cur_page_index;
+			prefetcher.direction = direction;
 		}
+		prefetcher.wakeup.up();
 	}
 
-	void prev_page()
-	{
-		while (true) {
-			--cur_page_index;
-			if (cur_page_index < 0)
-				cur_page_index = page_count-1;
-			if (render_page())
-				break;
-		}
-	}
-
-	void handle_app_signal()
-	{
-		if (cur_page_index < pending_page_index) {
-			Libc::with_libc([&] () { next_page(); });
-		} else
-		if (cur_page_index > pending_page_index) {
-			Libc::with_libc([&] () { prev_page(); });
-		}
-	}
+	void handle_app_signal() { show_page(); }
 
 	void handle_config()
 	{
@@ -200,18 +524,35 @@ struct Flif_view::Main
 		verbose = config_rom.xml().attribute_value(
 			"verbose", verbose);
 
-		while (page_count > 0) {
-			--page_count;
-			free(namelist[page_count]);
-		}
-		if (namelist != NULL) {
-			free(namelist);
-			namelist = NULL;
-		}
+		{
+			Mutex::Guard guard(prefetcher.mutex);
 
-		page_count = scandir(".", &namelist, NULL, alphasort);
+			while (page_count > 0) {
+				--page_count;
+				free(namelist[page_count]);
+			}
+			if (namelist != NULL) {
+				free(namelist);
+				namelist = NULL;
+			}
 
-		render_page();
+			page_count = scandir(".", &namelist, NULL, alphasort);
+			if (page_count < 0)
+				page_count = 0;
+
+			cur_page_index = 0;
+			failed_pages   = 0;
+
+			prefetcher.namelist    = namelist;
+			prefetcher.page_count  = page_count;
+			prefetcher.current     = cur_page_index;
+			prefetcher.direction   = 1;
+			prefetcher.fit         = gui_mode.area;
+			prefetcher.progressive = progressive;
+			prefetcher.verbose     = verbose;
+			prefetcher.generation++;
+		}
+		prefetcher.wakeup.up();
 	}
 
 	void handle_config_signal()
@@ -221,22 +562,28 @@ struct Flif_view::Main
 	}
 
 	/**
-	 * I/O handler for input. May interrupt rendering during I/O
-	 * dispatch because the application is not executed from
-	 * this signal handler.
+	 * I/O handler for input. Stale decodes are cancelled by the decoder
+	 * thread as soon as the requested page changes.
 	 */
 	void handle_input_signal()
 	{
+		bool changed = false;
+
 		input.for_each_event([&] (Input::Event const &ev) {
 			if (ev.key_press(Input::KEY_PAGEDOWN)) {
-				++pending_page_index;
-				app_transmitter.submit();
+				failed_pages = 0;
+				request_page(1);
+				changed = true;
 			} else
 			if (ev.key_press(Input::KEY_PAGEUP)) {
-				--pending_page_index;
-				app_transmitter.submit();
+				failed_pages = 0;
+				request_page(-1);
+				changed = true;
 			}
 		});
+
+		if (changed)
+			app_transmitter.submit();
 	}
 
 	Main(Libc::Env &env) : env(env)
@@ -249,39 +596,17 @@ struct Flif_view::Main
 };
 
 
-static ::uint32_t progressive_render(::uint32_t quality, ::int64_t bytes_read, ::uint8_t /*decode_over*/, void *user_data, void *context)
+void Flif_view::Main::render_animation(Genode::Duration)
 {
-	auto *main = (Flif_view::Main*)user_data;
-
-	if (main->verbose) {
-		unsigned long const now_ms = main->timer.elapsed_ms();
-		double dur_s = double(now_ms - main->last_ms) / 1000.0;
-		main->last_ms = now_ms;
-		Genode::log((double(bytes_read) / (1 << 20)) / dur_s, " MiB/s");
-	}
-
-	if (main->progressive) {
-		flif_decoder_generate_preview(context);
-
-		FLIF_IMAGE *img = flif_decoder_get_image(main->flif_dec, 0);
-		main->render(img);
-	}
-
-	/* abort decoding if input has moved the page index */
-	if (main->cur_page_index != main->pending_page_index) {
-		flif_abort_decoder(main->flif_dec);
-		return 0;
-	}
-
-	return ++quality;
-}
+	Mutex::Guard guard(prefetcher.mutex);
 
+	Page *page = prefetcher.lookup(cur_page_index);
+	if (!page || page->state != Page::DONE)
+		return;
 
-void Flif_view::Main::render_animation(Genode::Duration)
-{
-	cur_frame = (cur_frame+1) % flif_decoder_num_images(flif_dec);
+	cur_frame = (cur_frame+1) % flif_decoder_num_images(page->decoder);
 
-	FLIF_IMAGE *img = flif_decoder_get_image(flif_dec, cur_frame);
+	FLIF_IMAGE *img = flif_decoder_get_image(page->decoder, cur_frame);
 	render(img);
 	auto x = Microseconds(flif_image_get_frame_delay(img)*100);
 	render_timeout.schedule(x);
@@ -293,7 +618,6 @@ void Flif_view::Main::render(FLIF_IMAGE *img)
 	int const f_width  = flif_image_get_width(img);
 	int const f_height = flif_image_get_height(img);
 
-	typedef Pixel_rgb888 PT;
 	apply_to_texture<PT>(f_width, f_height, [&] (Texture<PT> &texture) {
 		/* fill texture with FLIF image data */
 		char row[f_width*4];
@@ -309,43 +633,87 @@ void Flif_view::Main::render(FLIF_IMAGE *img)
 }
 
 
-bool Flif_view::Main::render_page()
+void Flif_view::Main::render(Page const &page)
 {
-	pending_page_index = cur_page_index;
+	apply_to_texture<PT>(page.width, page.height, [&] (Texture<PT> &texture) {
+		PT *dst = const_cast<PT *>(texture.pixel());
+		for (unsigned y = 0; y < page.height; ++y)
+			memcpy(dst + y*texture.size().w(), page.pixels + y*page.width,
+			       page.width*sizeof(PT));
+	});
 
-	struct dirent *d = namelist[cur_page_index];
-	char const *filename = d->d_name;
+	/* flush to surface on next sync signal */
+	img_area = Surface_base::Area(page.width, page.height);
+	gui.framebuffer()->sync_sigh(sync_handler);
+}
 
-	if (flif_dec != NULL) {
-		flif_destroy_decoder(flif_dec);
-		flif_dec = NULL;
-	}
 
-	flif_dec = flif_create_decoder();
-	flif_decoder_set_resize(flif_dec, gui_mode.area.w(), gui_mode.area.h());
-	flif_decoder_set_callback(flif_dec, &(progressive_render), this);
+void Flif_view::Main::show_page()
+{
+	Mutex::Guard guard(prefetcher.mutex);
 
-	gui.enqueue<Gui::Session::Command::Title>(view_handle, filename);
+	Page *page = prefetcher.lookup(cur_page_index);
+	if (!page)
+		return;
 
-	if (verbose)
-		last_ms = timer.elapsed_ms();
+	bool const new_page = shown_page       != cur_page_index
+	                   || shown_generation != prefetcher.generation;
 
-	if (!flif_decoder_decode_file(flif_dec, filename)) {
-		Genode::error("decode '", filename, "' failed");
-		return false;
+	if (new_page) {
+		render_timeout.discard();
+		cur_frame = 0;
 	}
 
-	Genode::log(filename);
+	switch (page->state) {
 
-	FLIF_IMAGE *img = flif_decoder_get_image(flif_dec, 0);
-	render(img);
+	case Page::FAILED:
+
+		/* skip undecodable pages in the direction of navigation */
+		if (++failed_pages < page_count) {
+			cur_page_index = prefetcher.wrap(cur_page_index + prefetcher.direction);
+			prefetcher.current = cur_page_index;
+			prefetcher.wakeup.up();
+		}
+		return;
 
-	if (flif_decoder_num_images(flif_dec) > 1) {
-		render_timeout.schedule(
-			Microseconds(flif_image_get_frame_delay(img)));
+	case Page::DECODING:
+
+		/* progressive pass of the current page */
+		if (!page->pixels || !progressive)
+			return;
+		render(*page);
+		shown_final = false;
+		break;
+
+	case Page::DONE:
+
+		if (!new_page && shown_final)
+			return;
+
+		failed_pages    = 0;
+		page->last_used = ++prefetcher.use_counter;
+		render(*page);
+		shown_final = true;
+
+		Genode::log((char const *)namelist[cur_page_index]->d_name);
+
+		if (flif_decoder_num_images(page->decoder) > 1) {
+			FLIF_IMAGE *img = flif_decoder_get_image(page->decoder, 0);
+			render_timeout.schedule(
+				Microseconds(flif_image_get_frame_delay(img)));
+		}
+		break;
+
+	case Page::EMPTY:
+		return;
 	}
 
-	return true;
+	if (new_page)
+		gui.enqueue<Command::Title>(view_handle,
+		                            namelist[cur_page_index]->d_name);
+
+	shown_page       = cur_page_index;
+	shown_generation = prefetcher.generation;
 }
 
 
@@ -22,11 +22,18 @@
  *
  */
 
+#include <base/attached_rom_dataspace.h>
 #include <base/heap.h>
 #include <base/registry.h>
+#include <base/thread.h>
+#include <cpu_thread/client.h>
+#include <dataspace/client.h>
+#include <trace_session/connection.h>
+#include <util/list.h>
 #include <libc/component.h>
 #include <region_map/client.h>
 #include <rm_session/connection.h>
+#include <rom_session/connection.h>
 #include <util/retry.h>
 #include <base/debug.h>
 
@@ -146,6 +153,9 @@ extern "C" void backtrace();
 // global variables
 julong os::Bsd::_physical_memory = 0;
 
+/* used for querying the RAM quota and the CPU affinity space */
+static Genode::Env *genode_env = nullptr;
+
 #ifdef __APPLE__
 mach_timebase_info_data_t os::Bsd::_timebase_info = {0, 0};
 volatile uint64_t         os::Bsd::_max_abstime   = 0;
@@ -162,6 +172,293 @@ int clock_getres(clockid_t, struct timespec *res)
 	return 0;
 }
 
+
+/*************************
+ ** Per-thread CPU time **
+ *************************/
+
+namespace Genode { class Thread_cpu_time; }
+
+/**
+ * Execution times of the JVM's threads as accounted by core
+ *
+ * Core exposes the execution time of each thread as a trace subject. A trace
+ * subject carries no reference to the thread's capability, only the label of
+ * the thread's CPU session and the thread's name. Subjects of other sessions
+ * than the one of the JVM's threads are ignored.
+ *
+ * An attached thread is associated with the one unclaimed subject that
+ * carries its name. The pthreads created by 'os::create_thread' all have the
+ * same name. Such a thread is associated with the one subject that newly
+ * appeared while it was created. Whenever the association is ambiguous, for
+ * example, because more subjects exist than can be listed at once, the
+ * thread's CPU time is reported as unavailable.
+ */
+class Genode::Thread_cpu_time
+{
+	private:
+
+		enum { MAX_SUBJECTS = 256, MAX_THREADS = 128 };
+
+		struct Entry
+		{
+			pthread_t         pthread;
+			Trace::Subject_id subject;
+		};
+
+		Trace::Connection _trace;
+		Mutex             _mutex { };
+
+		/* label of the CPU session of the JVM's threads */
+		Session_label _label { };
+
+		Trace::Subject_id _known[MAX_SUBJECTS];
+		unsigned          _known_count = 0;
+
+		Entry    _threads[MAX_THREADS];
+		unsigned _thread_count = 0;
+
+		Trace::Subject_id _retired[MAX_THREADS];
+		unsigned          _retired_count = 0;
+
+		bool _known_subject(Trace::Subject_id id) const
+		{
+			for (unsigned i = 0; i < _known_count; i++)
+				if (_known[i] == id)
+					return true;
+			return false;
+		}
+
+		/**
+		 * Free subjects of exited threads, which core keeps until freed
+		 */
+		void _free_dead_subjects()
+		{
+			for (unsigned i = 0; i < _retired_count; ) {
+				Trace::Subject_id const id = _retired[i];
+
+				bool dead = false;
+				try {
+					dead = _trace.subject_info(id).state() == Trace::Subject_info::DEAD;
+				} catch (...) { }
+
+				if (!dead) { i++; continue; }
+
+				try { _trace.free(id); } catch (...) { }
+
+				_retired[i] = _retired[--_retired_count];
+				for (unsigned j = 0; j < _known_count; j++)
+					if (_known[j] == id)
+						_known[j] = _known[--_known_count];
+			}
+		}
+
+		bool _claimed(Trace::Subject_id id) const
+		{
+			for (unsigned i = 0; i < _thread_count; i++)
+				if (_threads[i].subject == id)
+					return true;
+			return false;
+		}
+
+		/**
+		 * Call 'fn' for each live subject of the JVM's CPU session
+		 *
+		 * \return false if the subjects could not be listed completely
+		 */
+		template <typename FN>
+		bool _for_each_own_subject(FN const &fn)
+		{
+			Trace::Subject_id ids[MAX_SUBJECTS];
+			size_t const count = _trace.subjects(ids, MAX_SUBJECTS);
+
+			for (size_t i = 0; i < count; i++) {
+				try {
+					Trace::Subject_info const info = _trace.subject_info(ids[i]);
+					if (info.session_label() == _label
+					 && info.state() != Trace::Subject_info::DEAD)
+						fn(ids[i], info);
+				} catch (...) { }
+			}
+			return count < MAX_SUBJECTS;
+		}
+
+		/**
+		 * Mark all current subjects as known
+		 *
+		 * \return  number of subjects that were not known before, the last
+		 *          of which is returned in 'fresh', or 0 if the subjects
+		 *          could not be listed completely
+		 */
+		unsigned _import(Trace::Subject_id &fresh)
+		{
+			_free_dead_subjects();
+
+			unsigned found = 0;
+			bool const complete = _for_each_own_subject(
+				[&] (Trace::Subject_id id, Trace::Subject_info const &) {
+
+					if (_known_subject(id))
+						return;
+
+					if (_known_count < MAX_SUBJECTS)
+						_known[_known_count++] = id;
+
+					fresh = id;
+					found++;
+				});
+
+			return complete ? found : 0;
+		}
+
+	public:
+
+		/**
+		 * Constructor
+		 *
+		 * The TRACE session covers the JVM's own threads, which share the
+		 * label of their CPU session. If the subjects do not agree on a
+		 * label, no thread is associated with a subject.
+		 */
+		Thread_cpu_time(Env &env)
+		: _trace(env, 128*1024, 4096, 0)
+		{
+			Trace::Subject_id ids[MAX_SUBJECTS];
+			size_t const count = _trace.subjects(ids, MAX_SUBJECTS);
+
+			bool unique = count > 0 && count < MAX_SUBJECTS;
+			for (size_t i = 0; i < count && unique; i++) {
+				try {
+					Session_label const label =
+						_trace.subject_info(ids[i]).session_label();
+
+					if (i == 0)
+						_label = label;
+					else if (!(label == _label))
+						unique = false;
+				} catch (...) { unique = false; }
+			}
+
+			if (!unique) {
+				_label = Session_label();
+				warning("thread CPU time not available, ambiguous trace subjects");
+			}
+
+			Trace::Subject_id unused;
+			_import(unused);
+		}
+
+		/**
+		 * Create or attach a thread and associate it with its subject
+		 *
+		 * The functor 'fn' returns true on success and stores the pthread
+		 * of the thread in its argument. Thread creations are serialized to
+		 * keep the association unambiguous.
+		 */
+		template <typename FN>
+		bool claim(FN const &fn)
+		{
+			Mutex::Guard guard(_mutex);
+
+			pthread_t pthread;
+			if (!fn(pthread))
+				return false;
+
+			Trace::Subject_id fresh;
+			if (_import(fresh) == 1 && _thread_count < MAX_THREADS)
+				_threads[_thread_count++] = Entry { pthread, fresh };
+
+			return true;
+		}
+
+		/**
+		 * Associate an existing thread with the subject of name 'name'
+		 */
+		void attach(pthread_t pthread, Trace::Thread_name const &name)
+		{
+			Mutex::Guard guard(_mutex);
+
+			/* keep the detection of fresh subjects of created threads exact */
+			Trace::Subject_id unused;
+			_import(unused);
+
+			Trace::Subject_id match;
+			unsigned matches = 0;
+			bool const complete = _for_each_own_subject(
+				[&] (Trace::Subject_id id, Trace::Subject_info const &info) {
+					if (info.thread_name() == name && !_claimed(id)) {
+						match = id;
+						matches++;
+					}
+				});
+
+			if (complete && matches == 1 && _thread_count < MAX_THREADS)
+				_threads[_thread_count++] = Entry { pthread, match };
+		}
+
+		void release(pthread_t pthread)
+		{
+			Mutex::Guard guard(_mutex);
+
+			for (unsigned i = 0; i < _thread_count; i++) {
+				if (_threads[i].pthread != pthread)
+					continue;
+
+				/* the subject is freed once the thread is gone */
+				if (_retired_count < MAX_THREADS)
+					_retired[_retired_count++] = _threads[i].subject;
+
+				_threads[i] = _threads[--_thread_count];
+				return;
+			}
+		}
+
+		/**
+		 * Return execution time of thread in nanoseconds, or -1 if unknown
+		 */
+		long long nanoseconds(pthread_t pthread)
+		{
+			Trace::Subject_id subject;
+			bool found = false;
+			{
+				Mutex::Guard guard(_mutex);
+
+				for (unsigned i = 0; i < _thread_count && !found; i++) {
+					if (_threads[i].pthread != pthread)
+						continue;
+
+					subject = _threads[i].subject;
+					found   = true;
+				}
+			}
+			if (!found)
+				return -1;
+
+			/* core reports the execution time in microseconds */
+			try {
+				return (long long)_trace.subject_info(subject)
+				                        .execution_time().thread_context * 1000;
+			} catch (...) { }
+
+			return -1;
+		}
+};
+
+static Genode::Constructible<Genode::Thread_cpu_time> cpu_times;
+
+/**
+ * Create or attach a thread via 'fn' and associate it with its CPU time
+ */
+template <typename FN>
+static bool claim_thread_cpu_time(FN const &fn)
+{
+	if (!cpu_times.constructed()) {
+		pthread_t pthread;
+		return fn(pthread);
+	}
+	return cpu_times->claim(fn);
+}
+
 static jlong initial_time_count=0;
 
 static int clock_tics_per_sec = 100;
@@ -189,9 +486,10 @@ julong os::available_memory() {
   return Bsd::available_memory();
 }
 
-// available here means free
+// available here means free, i.e., the unused part of the PD's RAM quota
 julong os::Bsd::available_memory() {
-  uint64_t available = physical_memory() >> 2;
+  uint64_t available = genode_env ? genode_env->pd().avail_ram().value
+                                  : physical_memory() >> 2;
 #ifdef __APPLE__
   mach_msg_type_number_t count = HOST_VM_INFO64_COUNT;
   vm_statistics64_data_t vmstat;
@@ -256,54 +554,18 @@ static char cpu_arch[] = "sparc";
 
 
 void os::Bsd::initialize_system_info() {
-  int mib[2];
-  size_t len;
-  int cpu_val;
-  julong mem_val = 0;
-
-
-  // get processors count via hw.ncpus sysctl
-  mib[0] = CTL_HW;
-  mib[1] = HW_NCPU;
-  len = sizeof(cpu_val);
-  if (sysctl(mib, 2, &cpu_val, &len, NULL, 0) != -1 && cpu_val >= 1) {
-    assert(len == sizeof(cpu_val), "unexpected data size");
-    set_processor_count(cpu_val);
-  } else {
-    set_processor_count(1);   // fallback
-  }
-
-  // get physical memory via hw.memsize sysctl (hw.memsize is used
-  // since it returns a 64 bit value)
-  mib[0] = CTL_HW;
-
-#if defined (HW_MEMSIZE) // Apple
-  mib[1] = HW_MEMSIZE;
-#elif defined(HW_PHYSMEM) // Most of BSD
-  mib[1] = HW_PHYSMEM;
-#elif defined(HW_REALMEM) // Old FreeBSD
-  mib[1] = HW_REALMEM;
-#else
-  #error No ways to get physmem
-#endif
 
-  len = sizeof(mem_val);
-  if (sysctl(mib, 2, &mem_val, &len, NULL, 0) != -1) {
-    assert(len == sizeof(mem_val), "unexpected data size");
-    _physical_memory = mem_val;
-  } else {
-    _physical_memory = 256 * 1024 * 1024;       // fallback (XXXBSD?)
-  }
+  /*
+   * The processors are the CPUs of the component's affinity space and the
+   * physical memory is the component's RAM quota. Both thereby follow the
+   * resources assigned by the parent instead of the whole machine.
+   */
+  Genode::Affinity::Space const space = genode_env->cpu().affinity_space();
+  set_processor_count(space.total() ? (int)space.total() : 1);
 
-#ifdef __OpenBSD__
-  {
-    // limit _physical_memory memory view on OpenBSD since
-    // datasize rlimit restricts us anyway.
-    struct rlimit limits;
-    getrlimit(RLIMIT_DATA, &limits);
-    _physical_memory = MIN2(_physical_memory, (julong)limits.rlim_cur);
-  }
-#endif
+  _physical_memory = genode_env->pd().ram_quota().value;
+  if (_physical_memory == 0)
+    _physical_memory = 256 * 1024 * 1024;       // fallback
 }
 
 #ifdef __APPLE__
@@ -793,7 +1055,12 @@ bool os::create_thread(Thread* thread, ThreadType thr_type,
 
   {
     pthread_t tid;
-    int ret = pthread_create(&tid, &attr, (void* (*)(void*)) thread_native_entry, thread);
+    int ret = 0;
+    claim_thread_cpu_time([&] (pthread_t &pthread) {
+      ret = pthread_create(&tid, &attr, (void* (*)(void*)) thread_native_entry, thread);
+      pthread = tid;
+      return ret == 0;
+    });
 
     char buf[64];
     if (ret == 0) {
@@ -871,6 +1138,9 @@ bool os::create_attached_thread(JavaThread* thread) {
 #endif
   osthread->set_pthread_id(::pthread_self());
 
+  if (cpu_times.constructed() && Genode::Thread::myself())
+    cpu_times->attach(::pthread_self(), Genode::Thread::myself()->name());
+
   // initialize floating point control register
   os::Bsd::init_thread_fpu_state();
 
@@ -910,6 +1180,9 @@ void os::free_thread(OSThread* osthread) {
   sigset_t sigmask = osthread->caller_sigmask();
   pthread_sigmask(SIG_SETMASK, &sigmask, NULL);
 
+  if (cpu_times.constructed())
+    cpu_times->release(osthread->pthread_id());
+
   delete osthread;
 }
 
@@ -2253,36 +2526,74 @@ bool os::Bsd::hugetlbfs_sanity_check(bool warn, size_t page_size) {
 }
 
 // Large page support
+//
+// Core maps a RAM dataspace with the largest page size that the physical
+// and the virtual alignment permit. A committed range that is aligned to
+// the large page size and spans whole large pages is thereby backed by
+// large pages. Large page memory can thus be committed on demand.
 
 static size_t _large_page_size = 0;
 
 void os::large_page_init() {
+  if (!UseLargePages) {
+    return;
+  }
+
+#if defined(AMD64)
+  _large_page_size = 2 * M;
+#elif defined(ARM)
+  _large_page_size = 1 * M;
+#endif
+
+  if (_large_page_size == 0) {
+    UseLargePages = false;
+    return;
+  }
+
+  if (!FLAG_IS_DEFAULT(LargePageSizeInBytes) &&
+      LargePageSizeInBytes != _large_page_size) {
+    warning("Setting LargePageSizeInBytes has no effect on this OS. Large page size is "
+            SIZE_FORMAT "%s.", byte_size_in_proper_unit(_large_page_size),
+            proper_unit_for_byte_size(_large_page_size));
+  }
+
+  // large page size first, default page size last
+  _page_sizes[0] = _large_page_size;
+  _page_sizes[1] = vm_page_size();
+  _page_sizes[2] = 0;
 }
 
 
 char* os::reserve_memory_special(size_t bytes, size_t alignment, char* req_addr, bool exec) {
-  NOT_IMPL;
-  return nullptr;
+  // reserve and commit at once, the memory stays committed until released
+  char *addr = req_addr
+             ? pd_attempt_reserve_memory_at(bytes, req_addr)
+             : pd_reserve_memory(bytes, NULL, MAX2(alignment, _large_page_size));
+  if (addr == NULL) {
+    return NULL;
+  }
+
+  if (!pd_commit_memory(addr, bytes, exec)) {
+    pd_release_memory(addr, bytes);
+    return NULL;
+  }
+  return addr;
 }
 
 bool os::release_memory_special(char* base, size_t bytes) {
-	NOT_IMPL;
-	return false;
+  return pd_release_memory(base, bytes);
 }
 
 size_t os::large_page_size() {
   return _large_page_size;
 }
 
-// HugeTLBFS allows application to commit large page memory on demand;
-// with SysV SHM the entire memory region must be allocated as shared
-// memory.
 bool os::can_commit_large_page_memory() {
-  return UseHugeTLBFS;
+  return UseLargePages && _large_page_size != 0;
 }
 
 bool os::can_execute_large_page_memory() {
-  return UseHugeTLBFS;
+  return UseLargePages && _large_page_size != 0;
 }
 
 
@@ -3328,13 +3639,21 @@ void os::set_native_thread_name(const char *name) {
 }
 
 bool os::distribute_processes(uint length, uint* distribution) {
-  // Not yet implemented.
-  return false;
+  // one thread per CPU of the affinity space, wrapping around
+  for (uint i = 0; i < length; i++)
+    distribution[i] = i % (uint)processor_count();
+  return true;
 }
 
 bool os::bind_to_processor(uint processor_id) {
-  // Not yet implemented.
-  return false;
+  Genode::Thread *myself = Genode::Thread::myself();
+  if (!myself || !genode_env)
+    return false;
+
+  Genode::Affinity::Space const space = genode_env->cpu().affinity_space();
+  Genode::Cpu_thread_client(myself->cap())
+    .affinity(space.location_of_index(processor_id % space.total()));
+  return true;
 }
 
 void os::SuspendedThreadTask::internal_do_task() {
@@ -3628,42 +3947,14 @@ int os::available(int fd, jlong *bytes) {
   return 1;
 }
 
-// Map a block of memory.
-char* os::pd_map_memory(int fd, const char* file_name, size_t file_offset,
-                        char *addr, size_t bytes, bool read_only,
-                        bool allow_exec) {
-  int prot;
-  int flags;
-
-  if (read_only) {
-    prot = PROT_READ;
-    flags = MAP_SHARED;
-  } else {
-    prot = PROT_READ | PROT_WRITE;
-    flags = MAP_PRIVATE;
-  }
-
-  if (allow_exec) {
-    prot |= PROT_EXEC;
-  }
-
-  if (addr != NULL) {
-    flags |= MAP_FIXED;
-  }
-
-  char* mapped_address = (char*)mmap(addr, (size_t)bytes, prot, flags,
-                                     fd, file_offset);
-  if (mapped_address == MAP_FAILED) {
-    return NULL;
-  }
-  return mapped_address;
-}
-
-
 // Remap a block of memory.
 char* os::pd_remap_memory(int fd, const char* file_name, size_t file_offset,
                           char *addr, size_t bytes, bool read_only,
                           bool allow_exec) {
+  // mappings within a reservation must be removed before mapping again
+  if (os::pd_unmap_memory(addr, bytes) == false) {
+    return NULL;
+  }
   // same as map_memory() on this OS
   return os::map_memory(fd, file_name, file_offset, addr, bytes, read_only,
                         allow_exec);
@@ -3678,30 +3969,15 @@ char* os::pd_remap_memory(int fd, const char* file_name, size_t file_offset,
 // the fast estimate available on the platform.
 
 jlong os::current_thread_cpu_time() {
-#ifdef __APPLE__
   return os::thread_cpu_time(Thread::current(), true /* user + sys */);
-#else
-  Unimplemented();
-  return 0;
-#endif
 }
 
 jlong os::thread_cpu_time(Thread* thread) {
-#ifdef __APPLE__
   return os::thread_cpu_time(thread, true /* user + sys */);
-#else
-  Unimplemented();
-  return 0;
-#endif
 }
 
 jlong os::current_thread_cpu_time(bool user_sys_cpu_time) {
-#ifdef __APPLE__
   return os::thread_cpu_time(Thread::current(), user_sys_cpu_time);
-#else
-  Unimplemented();
-  return 0;
-#endif
 }
 
 jlong os::thread_cpu_time(Thread *thread, bool user_sys_cpu_time) {
@@ -3726,8 +4002,11 @@ jlong os::thread_cpu_time(Thread *thread, bool user_sys_cpu_time) {
     return ((jlong)tinfo.user_time.seconds * 1000000000) + ((jlong)tinfo.user_time.microseconds * (jlong)1000);
   }
 #else
-  Unimplemented();
-  return 0;
+  // Genode accounts no system time to threads, so user time equals user+sys
+  if (!cpu_times.constructed() || thread->osthread() == NULL) {
+    return -1;
+  }
+  return cpu_times->nanoseconds(thread->osthread()->pthread_id());
 #endif
 }
 
@@ -3750,7 +4029,7 @@ bool os::is_thread_cpu_time_supported() {
 #ifdef __APPLE__
   return true;
 #else
-  return false;
+  return cpu_times.constructed();
 #endif
 }
 
@@ -4331,18 +4610,53 @@ class Genode::Vm_region_map
 	private:
 
 		enum { VM_SIZE = (sizeof(long) == 8 ? 1512ul : 512ul) * 1024 * 1024 };
+
+		/*
+		 * On 64-bit, the region is placed at HotSpot's default
+		 * 'SharedBaseAddress' (32 GiB). Thereby, a CDS archive is mapped at
+		 * the same address at which it was dumped by an earlier run.
+		 *
+		 * The code cache and the heap are reserved before the archive is
+		 * mapped. The first 'SHARED_SIZE' bytes of the region are therefore
+		 * kept out of anonymous reservations and handed out only to
+		 * reservations at a fixed address. The size covers the default
+		 * sizes of the shared spaces (about 24 MiB) with some headroom.
+		 */
+		enum { SHARED_SIZE = 64ul * 1024 * 1024 };
+
+		static addr_t _preferred_base() {
+			return sizeof(long) == 8 ? (addr_t)(0x8ull << 32) : 0; }
+
 		Env               &_env;
 		Rm_connection      _rm_connection { _env };
 		Region_map_client  _rm { _rm_connection.create(VM_SIZE) };
-		addr_t       const _base { _env.rm().attach(_rm.dataspace()) };
+		addr_t       const _base { _attach_region() };
+		size_t       const _shared_size {
+			_preferred_base() && _base == _preferred_base() ? SHARED_SIZE : 0 };
 		Allocator_avl      _range;
+		Allocator_avl      _shared_range;
+
+		addr_t _attach_region()
+		{
+			if (_preferred_base()) try {
+				return _env.rm().attach_at(_rm.dataspace(), _preferred_base());
+			} catch (...) { }
+
+			return _env.rm().attach(_rm.dataspace());
+		}
+
+		bool _shared(addr_t vaddr) const {
+			return vaddr >= _base && vaddr - _base < _shared_size; }
 
 	public:
 
 		Vm_region_map(Env &env, Allocator &md_alloc)
-		: _env(env), _range(&md_alloc)
+		: _env(env), _range(&md_alloc), _shared_range(&md_alloc)
 		{
-			_range.add_range(_base, VM_SIZE);
+			if (_shared_size)
+				_shared_range.add_range(_base, _shared_size);
+
+			_range.add_range(_base + _shared_size, VM_SIZE - _shared_size);
 		}
 
 		addr_t alloc_region(size_t size, int align)
@@ -4354,7 +4668,26 @@ class Genode::Vm_region_map
 					throw -1; });
 		}
 
-		void free_region(addr_t vaddr) { _range.free((void *)vaddr); }
+		/**
+		 * Allocate region at a fixed address
+		 *
+		 * \return false if the address range is in use or outside of the
+		 *         VM region
+		 */
+		bool alloc_region_at(size_t size, addr_t vaddr)
+		{
+			Allocator_avl &range = _shared(vaddr) ? _shared_range : _range;
+
+			return range.alloc_addr(size, vaddr).convert<bool>(
+				[&] (void *)                          { return true;  },
+				[&] (Range_allocator::Alloc_error) { return false; });
+		}
+
+		void free_region(addr_t vaddr)
+		{
+			Allocator_avl &range = _shared(vaddr) ? _shared_range : _range;
+			range.free((void *)vaddr);
+		}
 
 		Local_addr attach_at(Dataspace_capability ds, addr_t local_addr)
 		{
@@ -4374,6 +4707,34 @@ class Genode::Vm_region_map
 				[&] () { _env.upgrade(Parent::Env::pd(), "ram_quota=8K"); });
 		}
 
+		/**
+		 * Attach 'size' bytes of 'ds' starting at 'offset' writeable
+		 */
+		Local_addr attach_part(Dataspace_capability ds, addr_t local_addr,
+		                       off_t offset, size_t size, bool executable)
+		{
+			return retry<Genode::Out_of_ram>(
+				[&] () {
+					return _rm.attach(ds, size, offset, true, local_addr - _base,
+					                  executable, true);
+				},
+				[&] () { _env.upgrade(Parent::Env::pd(), "ram_quota=8K"); });
+		}
+
+		/**
+		 * Attach 'size' bytes of 'ds' starting at 'offset' read-only
+		 */
+		Local_addr attach_read_only(Dataspace_capability ds, addr_t local_addr,
+		                            off_t offset, size_t size, bool executable)
+		{
+			return retry<Genode::Out_of_ram>(
+				[&] () {
+					return _rm.attach(ds, size, offset, true, local_addr - _base,
+					                  executable, false);
+				},
+				[&] () { _env.upgrade(Parent::Env::pd(), "ram_quota=8K"); });
+		}
+
 		void detach(Local_addr local_addr) { _rm.detach((addr_t)local_addr - _base); }
 };
 
@@ -4381,26 +4742,180 @@ class Genode::Vm_area
 {
 	private:
 
-		struct Vm_area_ds
+		/*
+		 * Committed range backed by the part of dataspace 'ds' that starts
+		 * at 'offset'
+		 *
+		 * After a partial uncommit, several ranges may share a dataspace.
+		 * The dataspace is freed with the last of them.
+		 */
+		struct Vm_area_ds : List<Vm_area_ds>::Element
 		{
 				addr_t                   base;
 				size_t                   size;
 				Ram_dataspace_capability ds;
+				off_t                    offset;
+				size_t                   ds_size;
+				bool                     executable;
+
+				Vm_area_ds(addr_t base, size_t size, Ram_dataspace_capability ds,
+				           off_t offset, size_t ds_size, bool executable)
+				:
+					base(base), size(size), ds(ds), offset(offset),
+					ds_size(ds_size), executable(executable)
+				{ }
+		};
 
-				Vm_area_ds(addr_t base, size_t size, Ram_dataspace_capability ds)
-				: base(base), size(size), ds(ds) { }
+		/*
+		 * File content mapped read-only from a ROM module, e.g., the regions
+		 * of a CDS archive
+		 */
+		struct Vm_area_rom : List<Vm_area_rom>::Element
+		{
+				addr_t         base;
+				size_t         size;
+				Rom_connection rom;
 
-				virtual ~Vm_area_ds() { };
+				Vm_area_rom(Env &env, char const *label, addr_t base, size_t size)
+				: base(base), size(size), rom(env, label) { }
 		};
 
-		typedef Registered<Vm_area_ds> Vm_handle;
+		/*
+		 * Uncommitted dataspaces are kept up to this amount for being reused
+		 * by later commits of the same size, e.g., of G1 regions
+		 */
+		enum { POOL_MAX_BYTES = 8*1024*1024 };
 
 		Env                &_env;
 		Heap               &_heap;
 		Vm_region_map      &_rm;
-		size_t        const _base;
-		addr_t        const _size;
-		Registry<Vm_handle> _ds;
+		addr_t        const _base;
+		size_t        const _size;
+		size_t              _reserved { _size };
+		List<Vm_area_ds>    _ds       { };
+		List<Vm_area_ds>    _pool     { };
+		size_t              _pool_bytes { 0 };
+		List<Vm_area_rom>   _roms     { };
+
+		/**
+		 * Get dataspace from pool or allocate a new one
+		 *
+		 * \param pooled  set if the dataspace comes from the pool and thereby
+		 *                has stale content
+		 */
+		Ram_dataspace_capability _alloc(size_t size, bool &pooled)
+		{
+			for (Vm_area_ds *p = _pool.first(); p; p = p->next()) {
+				if (p->size != size) continue;
+
+				Ram_dataspace_capability ds = p->ds;
+				_pool.remove(p);
+				_pool_bytes -= size;
+				destroy(_heap, p);
+				pooled = true;
+				return ds;
+			}
+
+			pooled = false;
+			return _env.ram().alloc(size);
+		}
+
+		void _free(Ram_dataspace_capability ds, size_t size)
+		{
+			if (_pool_bytes + size > POOL_MAX_BYTES) {
+				_env.ram().free(ds);
+				return;
+			}
+
+			_pool.insert(new (_heap) Vm_area_ds(0, size, ds, 0, size, false));
+			_pool_bytes += size;
+		}
+
+		bool _attach(Vm_area_ds const &vm)
+		{
+			try {
+				_rm.attach_part(vm.ds, vm.base, vm.offset, vm.size, vm.executable);
+			} catch (...) { return false; }
+
+			return true;
+		}
+
+		bool _in_use(Ram_dataspace_capability ds)
+		{
+			for (Vm_area_ds *vm = _ds.first(); vm; vm = vm->next())
+				if (vm->ds == ds)
+					return true;
+			return false;
+		}
+
+		/**
+		 * Remove committed range and free its dataspace if no longer used
+		 */
+		void _drop(Vm_area_ds *vm)
+		{
+			_ds.remove(vm);
+			if (!_in_use(vm->ds))
+				_free(vm->ds, vm->ds_size);
+			destroy(_heap, vm);
+		}
+
+		/**
+		 * Uncommit the part of 'vm' within 'base' ... 'end'
+		 *
+		 * Dataspaces cannot be detached partially. The parts that stay
+		 * committed are attached again from the same dataspace at their
+		 * offsets, so their content stays in place. The memory of the
+		 * dataspace is freed once all of its parts are uncommitted. If a
+		 * part cannot be attached, the former mapping is restored.
+		 */
+		bool _uncommit(Vm_area_ds *vm, addr_t base, addr_t end)
+		{
+			addr_t const vm_end = vm->base + vm->size;
+
+			if (base <= vm->base && end >= vm_end) {
+				_rm.detach(vm->base);
+				_drop(vm);
+				return true;
+			}
+
+			Vm_area_ds *head = nullptr, *tail = nullptr;
+			try {
+				if (vm->base < base)
+					head = new (_heap)
+						Vm_area_ds(vm->base, base - vm->base, vm->ds, vm->offset,
+						           vm->ds_size, vm->executable);
+				if (vm_end > end)
+					tail = new (_heap)
+						Vm_area_ds(end, vm_end - end, vm->ds,
+						           vm->offset + (end - vm->base),
+						           vm->ds_size, vm->executable);
+			} catch (...) {
+				if (head) destroy(_heap, head);
+				return false;
+			}
+
+			_rm.detach(vm->base);
+
+			bool const head_ok = !head || _attach(*head);
+			bool const tail_ok = head_ok && (!tail || _attach(*tail));
+
+			if (!head_ok || !tail_ok) {
+				if (head && head_ok)
+					_rm.detach(head->base);
+
+				if (!_attach(*vm))
+					error(__func__, " failed to restore mapping at ", Hex(vm->base));
+
+				if (head) destroy(_heap, head);
+				if (tail) destroy(_heap, tail);
+				return false;
+			}
+
+			if (head) _ds.insert(head);
+			if (tail) _ds.insert(tail);
+			_drop(vm);
+			return true;
+		}
 
 	public:
 
@@ -4419,31 +4934,118 @@ class Genode::Vm_area
 			if (!inside(base, size))
 				return false;
 
-			Ram_dataspace_capability ds = _env.ram().alloc(size);
+			bool pooled = false;
+			Vm_area_ds *vm = new (_heap)
+				Vm_area_ds(base, size, _alloc(size, pooled), 0, size, executable);
 
-			try {
-				if (executable)
-					_rm.attach_executable(ds, base);
-				else
-					_rm.attach_at(ds, base);
-			} catch (...) {
-				_env.ram().free(ds);
+			if (!_attach(*vm)) {
+				_env.ram().free(vm->ds);
+				destroy(_heap, vm);
 				return false;
 			}
 
-			new (_heap) Vm_handle(_ds, base, size, ds);
+			/* committed memory is expected to be zeroed */
+			if (pooled)
+				memset((void *)base, 0, size);
 
+			_ds.insert(vm);
 			return true;
 		}
 
+		/**
+		 * Map 'size' bytes of ROM module 'label' starting at 'offset' to 'base'
+		 */
+		bool map_rom(addr_t base, size_t size, char const *label, size_t offset,
+		             bool executable)
+		{
+			if (!inside(base, size))
+				return false;
+
+			Vm_area_rom *vm = nullptr;
+			try { vm = new (_heap) Vm_area_rom(_env, label, base, size); }
+			catch (...) { return false; }
+
+			Dataspace_capability const ds = vm->rom.dataspace();
+			bool attached = false;
+			if (offset + size <= Dataspace_client(ds).size()) try {
+				_rm.attach_read_only(ds, base, offset, size, executable);
+				attached = true;
+			} catch (...) { }
+
+			if (!attached) {
+				destroy(_heap, vm);
+				return false;
+			}
+
+			_roms.insert(vm);
+			return true;
+		}
+
+		bool uncommit(addr_t base, size_t size)
+		{
+			if (!inside(base, size))
+				return false;
+
+			addr_t const end = base + size;
+
+			/* ROM mappings are always dropped as a whole */
+			for (Vm_area_rom *rom = _roms.first(), *next = nullptr; rom; rom = next) {
+				next = rom->next();
+
+				if (rom->base + rom->size <= base || rom->base >= end)
+					continue;
+
+				_rm.detach(rom->base);
+				_roms.remove(rom);
+				destroy(_heap, rom);
+			}
+
+			for (Vm_area_ds *vm = _ds.first(), *next = nullptr; vm; vm = next) {
+				next = vm->next();
+
+				if (vm->base + vm->size <= base || vm->base >= end)
+					continue;
+
+				if (!_uncommit(vm, base, end))
+					return false;
+			}
+
+			return true;
+		}
+
+		/**
+		 * Release part of the reservation
+		 *
+		 * \return true if the whole area is released
+		 */
+		bool release(addr_t base, size_t size)
+		{
+			uncommit(base, size);
+			_reserved = size < _reserved ? _reserved - size : 0;
+			return _reserved == 0;
+		}
+
 		virtual ~Vm_area()
 		{
-			_ds.for_each([&] (Vm_handle &vm) {
+			while (Vm_area_ds *vm = _ds.first()) {
+				_rm.detach(vm->base);
+				_ds.remove(vm);
+				if (!_in_use(vm->ds))
+					_env.ram().free(vm->ds);
+				destroy(_heap, vm);
+			}
 
-				_rm.detach(vm.base);
-				_env.ram().free(vm.ds);
-				destroy(_heap, &vm);
-			});
+			while (Vm_area_ds *vm = _pool.first()) {
+				_env.ram().free(vm->ds);
+				_pool.remove(vm);
+				destroy(_heap, vm);
+			}
+
+			while (Vm_area_rom *rom = _roms.first()) {
+				_rm.detach(rom->base);
+				_roms.remove(rom);
+				destroy(_heap, rom);
+			}
 		}
 };
 
@@ -4467,11 +5069,14 @@ class Genode::Vm_area_registry
 		addr_t reserve(size_t size, addr_t base, int align)
 		{
 			if (base) {
-				Genode::warning("vm_start set");
-				return 0;
-			}
-			base = _rm.alloc_region(size, align);
-			Vm_area *vm = new (&_heap) Vm_area_handle(_registry, _env, _heap, _rm, base, size);
+				/* the caller falls back to another address if this fails */
+				if (!_rm.alloc_region_at(size, base))
+					return 0;
+			} else
+				base = _rm.alloc_region(size, align);
+
+			/* the area registers itself at '_registry' */
+			new (&_heap) Vm_area_handle(_registry, _env, _heap, _rm, base, size);
 			return base;
 		}
 
@@ -4487,6 +5092,43 @@ class Genode::Vm_area_registry
 			return success;
 		}
 
+		bool reserved(addr_t base, size_t size)
+		{
+			bool found = false;
+
+			_registry.for_each([&] (Vm_area_handle &vm) {
+				found = found || vm.inside(base, size); });
+
+			return found;
+		}
+
+		bool map_rom(addr_t base, size_t size, char const *label, size_t offset,
+		             bool executable)
+		{
+			bool success = false;
+
+			_registry.for_each([&] (Vm_area_handle &vm) {
+				if (success || !vm.inside(base, size)) return;
+				success = vm.map_rom(base, size, label, offset, executable);
+			});
+
+			return success;
+		}
+
+		bool uncommit(addr_t base, size_t size)
+		{
+			bool success = false;
+
+			_registry.for_each([&] (Vm_area_handle &vm) {
+				if (success || !vm.inside(base, size)) return;
+				success = vm.uncommit(base, size);
+			});
+
+			if (!success) error(__func__, " failed");
+
+			return success;
+		}
+
 		bool release(addr_t base, size_t size)
 		{
 			bool success = false;
@@ -4494,14 +5136,11 @@ class Genode::Vm_area_registry
 			_registry.for_each([&] (Vm_area_handle &vm) {
 				if (success || !vm.inside(base, size)) return;
 
-				if (base != vm.base() || size != vm.size()) {
-					error(__func__, " sub region release ", " addr: ", Hex(base), " vm addr: ", Hex(vm.base()),
-					      " size: ", Hex(size), " vm size: ", Hex(vm.size()));
-					while (1);
+				/* the virtual region is freed once all of it is released */
+				if (vm.release(base, size)) {
+					_rm.free_region(vm.base());
+					destroy(_heap, &vm);
 				}
-
-				_rm.free_region(vm.base());
-				destroy(_heap, &vm);
 				success = true;
 			});
 
@@ -4544,7 +5183,11 @@ bool os::pd_release_memory(char* addr, size_t size) {
 
 
 bool os::pd_unmap_memory(char* addr, size_t bytes) {
-  return vm_reg->release((Genode::addr_t)addr, bytes);
+	/* file mappings into a reservation leave the reservation intact */
+	if (vm_reg->reserved((Genode::addr_t)addr, bytes))
+		return vm_reg->uncommit((Genode::addr_t)addr, bytes);
+
+	return ::munmap(addr, bytes) == 0;
 }
 
 
@@ -4559,10 +5202,38 @@ bool os::pd_commit_memory(char* addr, size_t size, bool exec) {
 }
 
 
+// Core backs a committed range with large pages only where the range is
+// aligned to the large page size. If the hint asks for large pages, the
+// aligned middle of the range is committed as a dataspace of its own, so
+// that it gets large pages even if the range boundaries are not aligned.
 bool os::pd_commit_memory(char* addr, size_t size, size_t alignment_hint,
                           bool exec) {
-  // alignment_hint is ignored on this OS
-  return pd_commit_memory(addr, size, exec);
+  if (!can_commit_large_page_memory() || alignment_hint < _large_page_size) {
+    return pd_commit_memory(addr, size, exec);
+  }
+
+  char* const end          = addr + size;
+  char* const middle_start = (char*)align_size_up((intptr_t)addr, alignment_hint);
+  char* const middle_end   = (char*)align_size_down((intptr_t)end, alignment_hint);
+
+  if (middle_start >= middle_end ||
+      (middle_start == addr && middle_end == end)) {
+    return pd_commit_memory(addr, size, exec);
+  }
+
+  char* const parts[] = { addr, middle_start, middle_end, end };
+  for (int i = 0; i < 3; i++) {
+    if (parts[i] == parts[i + 1]) {
+      continue;
+    }
+    if (!pd_commit_memory(parts[i], parts[i + 1] - parts[i], exec)) {
+      if (parts[i] > addr) {
+        pd_uncommit_memory(addr, parts[i] - addr);
+      }
+      return false;
+    }
+  }
+  return true;
 }
 
 
@@ -4580,27 +5251,144 @@ void os::pd_commit_memory_or_exit(char* addr, size_t size, bool exec,
 void os::pd_commit_memory_or_exit(char* addr, size_t size,
                                   size_t alignment_hint, bool exec,
                                   const char* mesg) {
-  // alignment_hint is ignored on this OS
-  pd_commit_memory_or_exit(addr, size, exec, mesg);
+  assert(mesg != NULL, "mesg must be specified");
+  if (!pd_commit_memory(addr, size, alignment_hint, exec)) {
+    // add extra info in product mode for vm_exit_out_of_memory():
+    PRODUCT_ONLY(warn_fail_commit_memory(addr, size, exec, errno);)
+    vm_exit_out_of_memory(size, OOM_MMAP_ERROR, "%s", mesg);
+  }
 }
 
 
 void os::pd_realign_memory(char *addr, size_t bytes, size_t alignment_hint) {
-	NOT_IMPL;
+	/*
+	 * Whether memory is backed by large pages is decided when it is
+	 * committed, see the pd_commit_memory variant taking an alignment hint.
+	 * Committed memory cannot be remapped with other pages without copying
+	 * its content, so there is nothing to do here.
+	 */
 }
 
 
 bool os::pd_uncommit_memory(char* addr, size_t size) {
-  Genode::error(__PRETTY_FUNCTION__, "addr: ", (void *)addr, " size: ", (void *)size);
-  while (1);
-#ifdef __OpenBSD__
-  // XXX: Work-around mmap/MAP_FIXED bug temporarily on OpenBSD
-  return ::mprotect(addr, size, PROT_NONE) == 0;
-#else
-  uintptr_t res = (uintptr_t) ::mmap(addr, size, PROT_NONE,
-                                     MAP_PRIVATE|MAP_FIXED|MAP_ANONYMOUS, -1, 0);
-  return res  != (uintptr_t) MAP_FAILED;
-#endif
+	return vm_reg->uncommit((Genode::addr_t)addr, size);
+}
+
+
+/*
+ * Check if the file content to be mapped equals the ROM module of the same name
+ *
+ * The VFS presents a ROM module as file of the module's size. A ROM module
+ * of equal size is taken for the file only if the whole range of the file
+ * to be mapped matches the module's content.
+ */
+static bool file_is_rom(int fd, char const *label, size_t offset, size_t bytes)
+{
+	struct stat st;
+	if (::fstat(fd, &st) != 0 || st.st_size <= 0 || offset > (size_t)st.st_size)
+		return false;
+
+	try {
+		Genode::Attached_rom_dataspace rom(*genode_env, label);
+
+		if ((size_t)st.st_size != rom.size())
+			return false;
+
+		/* the part of the range beyond the end of the file is not read */
+		size_t const end = MIN2(offset + bytes, (size_t)st.st_size);
+
+		char buf[4096];
+		for (size_t pos = offset; pos < end; ) {
+			size_t const len = MIN2(end - pos, sizeof(buf));
+
+			if (::pread(fd, buf, len, pos) != (ssize_t)len
+			 || ::memcmp(buf, rom.local_addr<char const>() + pos, len) != 0)
+				return false;
+
+			pos += len;
+		}
+		return true;
+	} catch (...) { }
+
+	return false;
+}
+
+
+/*
+ * Map file content to a fixed address within a reservation
+ *
+ * Read-only content of a ROM module is attached directly from the module's
+ * dataspace and thereby shared by all JVMs using it, e.g., a CDS archive.
+ * Otherwise, the content is copied into committed memory.
+ */
+static char *map_file_at(int fd, char const *file_name, size_t file_offset,
+                         char *addr, size_t bytes, bool read_only, bool exec)
+{
+	Genode::addr_t const base = (Genode::addr_t)addr;
+
+	char const *label = file_name ? strrchr(file_name, '/') : NULL;
+	label = label ? label + 1 : file_name;
+
+	if (read_only && label && file_is_rom(fd, label, file_offset, bytes)
+	 && vm_reg->map_rom(base, bytes, label, file_offset, exec))
+		return addr;
+
+	if (!vm_reg->commit(base, bytes, exec))
+		return NULL;
+
+	for (size_t done = 0; done < bytes; ) {
+		ssize_t const n = ::pread(fd, addr + done, bytes - done, file_offset + done);
+
+		/* committed memory is zeroed, which covers the part beyond the file */
+		if (n == 0)
+			break;
+
+		if (n < 0) {
+			vm_reg->uncommit(base, bytes);
+			return NULL;
+		}
+		done += n;
+	}
+
+	return addr;
+}
+
+
+// Map a block of memory.
+char* os::pd_map_memory(int fd, const char* file_name, size_t file_offset,
+                        char *addr, size_t bytes, bool read_only,
+                        bool allow_exec) {
+  // mappings at a fixed address go to a reservation of the VM region
+  if (addr != NULL && vm_reg->reserved((Genode::addr_t)addr, bytes)) {
+    return map_file_at(fd, file_name, file_offset, addr, bytes, read_only,
+                       allow_exec);
+  }
+
+  int prot;
+  int flags;
+
+  if (read_only) {
+    prot = PROT_READ;
+    flags = MAP_SHARED;
+  } else {
+    prot = PROT_READ | PROT_WRITE;
+    flags = MAP_PRIVATE;
+  }
+
+  if (allow_exec) {
+    prot |= PROT_EXEC;
+  }
+
+  if (addr != NULL) {
+    flags |= MAP_FIXED;
+  }
+
+  char* mapped_address = (char*)mmap(addr, (size_t)bytes, prot, flags,
+                                     fd, file_offset);
+  if (mapped_address == MAP_FAILED) {
+    return NULL;
+  }
+  return mapped_address;
 }
 
 
@@ -4708,8 +5496,13 @@ static void construct_component(Libc::Env &env)
 
 void Libc::Component::construct(Libc::Env &env)
 {
+	genode_env = &env;
 	vm_reg.construct(env);
 
+	/* per-thread CPU time is available only if a TRACE session is granted */
+	try { cpu_times.construct(env); }
+	catch (...) { Genode::warning("no TRACE session, thread CPU time not supported"); }
+
 	Libc::with_libc([&] () { construct_component(env); });
 }
 
@@ -38,10 +38,12 @@
 #include <base/log.h>
 #include <os/pixel_rgb888.h>
 #include <base/attached_dataspace.h>
+#include <base/attached_rom_dataspace.h>
+#include <base/heap.h>
+#include <base/thread.h>
 #include <timer_session/connection.h>
 #include <gui_session/connection.h>
 #include <libc/component.h>
-#include <complex> // STL
 
 struct Painter_T {
   virtual ~Painter_T() = default;
@@ -111,7 +113,14 @@ public:
 
 class julia : public Painter_T {
   using flt_t = double;
-  using cmplx = std::complex<flt_t>;
+
+  /** Number of pixels computed per iteration of the inner loop **/
+  enum { LANES = 4 };
+
+  /** GCC vector extensions, lowered to the SIMD unit of the target **/
+  typedef flt_t     vflt_t __attribute__((vector_size(LANES*sizeof(flt_t))));
+  typedef decltype(vflt_t{} < vflt_t{}) vint_t;
+
 public:
 
   /** Changed using direct assignment **/
@@ -121,32 +130,226 @@ public:
   virtual ~julia() = default;
   julia(flt_t c, unsigned n) :  C{c}, N{n} {}
 
+  /**
+   * Draw the rows [y0, y1) of a calculated set in the buffer.
+   *
+   * Pixels are mirrored at both axes like in the original serial loop.
+   */
+  void paint_rows(Genode::Pixel_rgb888* buf, unsigned w, unsigned h,
+                  unsigned y0, unsigned y1) const
+  {
+    const flt_t _w = w > 1 ? w - 1 : 1;
+    const flt_t _h = h > 1 ? h - 1 : 1;
+
+    const vflt_t four  = vflt_t{} + 4.0;
+    const vflt_t c     = vflt_t{} + C;
+
+    for (unsigned y = y0; y < y1; ++y) {
+      const vflt_t zi0 = vflt_t{} + ((_h - y)*2.0/_h - 1);
+      Genode::Pixel_rgb888 *row = buf + Genode::size_t(y)*w;
+
+      for (unsigned x = 0; x < w; x += LANES) {
+        vflt_t zr = { }, zi = zi0;
+        for (unsigned l = 0; l < LANES; ++l)
+          zr[l] = (_w - flt_t(x + l))*3.5/_w - 1.75;
+
+        /* lanes still iterating and their iteration counts */
+        vint_t active = vint_t{} - 1;
+        vint_t count  = { };
+
+        for (unsigned i = 0; i < N; ++i) {
+          const vflt_t zr2 = zr*zr;
+          const vflt_t zi2 = zi*zi;
+
+          active &= (zr2 + zi2) < four;
+
+          bool any = false;
+          for (unsigned l = 0; l < LANES; ++l)
+            any |= active[l] != 0;
+          if (!any)
+            break;
+
+          count -= active;
+          zi = 2.0*zr*zi;
+          zr = zr2 - zi2 + c;
+        }
+
+        const unsigned n = Genode::min(unsigned(LANES), w - x);
+        for (unsigned l = 0; l < n; ++l)
+          _shade(row[x + l], unsigned(count[l]));
+      }
+    }
+  }
+
   /**
    * Draw a calculated set in the buffer. 
    */
+  void paint(Genode::Pixel_rgb888* buf, unsigned w, unsigned h) override {
+    paint_rows(buf, w, h, 0, h); }
+
+private:
+
+  void _shade(Genode::Pixel_rgb888 &px, unsigned i) const
+  {
+    unsigned c = ((i)*255) / N;
+    if (i < N) {
+      double quotient = ((double) i) / N;
+      if (quotient > 0.5)
+        px.rgba(255, c, c);
+      else
+        px.rgba(c, 0, 0);
+    } else px.rgba(0, 0, 0);
+  }
+};
+
+/**
+ * Renders a julia set in horizontal tiles on worker threads
+ *
+ * Each worker is pinned to its own CPU of the affinity space and picks
+ * tiles until the frame is complete. The timing of each worker is
+ * accumulated for the periodic benchmark report.
+ */
+class tile_renderer : public Painter_T {
+
+  class worker : public Genode::Thread {
+    tile_renderer&     _renderer;
+    Genode::Semaphore  _start{};
+
+    void entry() override {
+      for (;;) {
+        _start.down();
+        Genode::uint64_t const t0 = _renderer._timer.elapsed_us();
+        tiles    += _renderer._render_tiles();
+        busy_us  += _renderer._timer.elapsed_us() - t0;
+        _renderer._done.up();
+      }
+    }
+
+  public:
+    Genode::Affinity::Location const location;
+    Genode::uint64_t                 busy_us{0};
+    unsigned                         tiles{0};
+
+    worker(Genode::Env& env, tile_renderer& renderer, unsigned index,
+           Genode::Affinity::Location loc)
+      : Genode::Thread{env, Genode::Thread::Name{"julia ", index},
+                       STACK_SIZE, loc, Genode::Cpu_session::Weight(), env.cpu()},
+        _renderer{renderer}, location{loc} { }
+
+    void render() { _start.up(); }
+  };
+
+  enum { STACK_SIZE = 16*1024, MAX_WORKERS = 64 };
+
+  julia&               _julia;
+  Timer::Connection&   _timer;
+  unsigned const       _tile_rows;
+  unsigned const       _report_ms;
+  Genode::Heap         _heap;
+  worker*              _workers[MAX_WORKERS]{};
+  unsigned             _num_workers{0};
+  Genode::Semaphore    _done{};
+
+  /* state of the frame in progress, tiles are claimed under the mutex */
+  Genode::Mutex          _mutex{};
+  Genode::Pixel_rgb888*  _buf{nullptr};
+  unsigned               _w{0}, _h{0};
+  unsigned               _next_row{0};
+
+  /* benchmark statistics since the last report */
+  unsigned               _frames{0};
+  Genode::uint64_t       _frame_us{0};
+  Genode::uint64_t       _last_report_ms{0};
+
+  bool _claim(unsigned& y0, unsigned& y1) {
+    Genode::Mutex::Guard guard{_mutex};
+    if (_next_row >= _h) return false;
+    y0 = _next_row;
+    y1 = _next_row = Genode::min(_h, _next_row + _tile_rows);
+    return true;
+  }
+
+  unsigned _render_tiles() {
+    unsigned tiles = 0, y0 = 0, y1 = 0;
+    for (; _claim(y0, y1); ++tiles)
+      _julia.paint_rows(_buf, _w, _h, y0, y1);
+    return tiles;
+  }
+
+  void _report(Genode::uint64_t now_ms) {
+    Genode::uint64_t const period_ms = now_ms - _last_report_ms;
+    if (!_frames || !period_ms) return;
+
+    Genode::log("julia: ", _w, "x", _h, " ", _num_workers, " workers ",
+                (double)_frames*1000/period_ms, " fps ",
+                _frame_us/_frames, " us/frame");
+
+    for (unsigned i = 0; i < _num_workers; ++i) {
+      worker& wk = *_workers[i];
+      Genode::log("julia:   worker ", i, " at ", wk.location.xpos(), ",",
+                  wk.location.ypos(), ": ", wk.busy_us/_frames, " us/frame ",
+                  wk.tiles, " tiles");
+      wk.busy_us = 0;
+      wk.tiles   = 0;
+    }
+
+    _frames   = 0;
+    _frame_us = 0;
+    _last_report_ms = now_ms;
+  }
+
+public:
+
+  virtual ~tile_renderer() = default;
+
+  /**
+   * \param threads    number of workers, 0 renders on the entrypoint
+   * \param tile_rows  height of a tile in pixels
+   * \param report_ms  interval of benchmark reports, 0 disables reporting
+   */
+  tile_renderer(Genode::Env& env, julia& j, Timer::Connection& timer,
+                unsigned threads, unsigned tile_rows, unsigned report_ms)
+    : _julia{j}, _timer{timer},
+      _tile_rows{Genode::max(1U, tile_rows)}, _report_ms{report_ms},
+      _heap{env.ram(), env.rm()}
+  {
+    Genode::Affinity::Space const space = env.cpu().affinity_space();
+
+    _num_workers = Genode::min(threads, unsigned(MAX_WORKERS));
+    for (unsigned i = 0; i < _num_workers; ++i) {
+      _workers[i] = new (_heap)
+        worker{env, *this, i, space.location_of_index(i % space.total())};
+      _workers[i]->start();
+    }
+
+    Genode::log("julia: ", _num_workers, " workers on ", space.total(),
+                " CPUs, ", _tile_rows, " rows per tile");
+
+    _last_report_ms = _timer.elapsed_ms();
+  }
+
   void paint(Genode::Pixel_rgb888* buf, unsigned w, unsigned h) override
   {
-    --w, --h;
-    const auto _w = w;
-    const auto _h = h;
-    Genode::size_t idx{0};
-    do do {
-	/// Scale pixels
-	cmplx    Z {w*3.5/_w - 1.75, h*2.0/_h - 1};
-	unsigned i {0};
-	for (; i < N && (Z.real()*Z.real() + Z.imag()*Z.imag()) < 4.0; ++i)
-	  Z = Z*Z + C;
-
-	unsigned c = ((i)*255) / N;
-	if (i < N) {
-	  double quotient = ((double) i) / N;
-	  if (quotient > 0.5)
-	    buf[idx++].rgba(255, c, c);
-	  else 
-	    buf[idx++].rgba(c, 0, 0);
-	} else buf[idx++].rgba(0, 0, 0);
-
-    } while (w-- > 0); while (w = _w, h-- > 0);
+    Genode::uint64_t const t0 = _timer.elapsed_us();
+
+    _buf = buf, _w = w, _h = h, _next_row = 0;
+
+    if (_num_workers) {
+      for (unsigned i = 0; i < _num_workers; ++i)
+        _workers[i]->render();
+      for (unsigned i = 0; i < _num_workers; ++i)
+        _done.down();
+    } else
+      _render_tiles();
+
+    _frame_us += _timer.elapsed_us() - t0;
+    ++_frames;
+
+    if (_report_ms) {
+      Genode::uint64_t const now_ms = _timer.elapsed_ms();
+      if (now_ms - _last_report_ms >= _report_ms)
+        _report(now_ms);
+    }
   }
 };
 
@@ -174,8 +377,20 @@ public:
 
 
 void Libc::Component::construct(Libc::Env& env) {
-  static julia painter{-.75, 20};
-  static window win{env, painter, "julia", Gui::Area{256, 256}};
+  static Genode::Attached_rom_dataspace config{env, "config"};
+  static Timer::Connection              timer{env};
+
+  Genode::Xml_node const node = config.xml();
+
+  static julia painter{-.75, node.attribute_value("iterations", 20U)};
+  static tile_renderer renderer{
+    env, painter, timer,
+    node.attribute_value("threads", env.cpu().affinity_space().total()),
+    node.attribute_value("tile_rows", 16U),
+    node.attribute_value("report_interval_ms", 0U)};
+  static window win{env, renderer, "julia", Gui::Area{
+    node.attribute_value("width",  256U),
+    node.attribute_value("height", 256U)}};
 
   auto update_win = [&] {
     painter.C -= 0.003;
@@ -184,6 +399,6 @@ void Libc::Component::construct(Libc::Env& env) {
 
   /* Update the window's contents on a static interval. */
   static Timer_callback<decltype(update_win)>
-    window_update_timer{env, 15000, update_win};
+    window_update_timer{env, node.attribute_value("interval_us", 15000U), update_win};
   Genode::log("constructed");
 }
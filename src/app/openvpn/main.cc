@@ -18,12 +18,16 @@
 #include <nic/component.h>
 #include <root/component.h>
 #include <libc/component.h>
+#include <net/ethernet.h>
+#include <net/arp.h>
+#include <net/ipv4.h>
 
 /* libc includes */
 #include <unistd.h>
 
 /* local includes */
 #include "tuntap.h"
+#include "packet_queue.h"
 
 
 /* external symbols provided by Genode's startup code */
@@ -82,50 +86,218 @@ class Openvpn_component : public Tuntap_device,
 
 		Nic::Mac_address _mac_addr;
 
-		char const *_packet;
+		/*
+		 * In TUN mode, OpenVPN exchanges plain IP packets. The Ethernet
+		 * framing towards the Nic client is added and removed here and the
+		 * client's ARP requests are answered with '_gateway_mac'.
+		 */
+		bool             _tun = false;
+		Nic::Mac_address _gateway_mac;
 
 		enum { READ = 0, WRITE = 1 };
 
 		int _pipefd[2];
 		Genode::Semaphore _startup_lock;
-		Genode::Semaphore _tx_lock;
 
-	protected:
+		/*
+		 * Tx packets are handed to OpenVPN through '_pending' and returned
+		 * through '_done' for acknowledgement by the entrypoint. Both queues
+		 * have the same capacity, hence '_done' can never overflow.
+		 */
+		enum { QUEUE_SIZE = 64 };
+
+		Packet_queue<Genode::Packet_descriptor, QUEUE_SIZE> _pending { };
+		Packet_queue<Genode::Packet_descriptor, QUEUE_SIZE> _done    { };
+
+		/* number of packets taken from the tx sink but not yet acknowledged */
+		unsigned _outstanding = 0;
+
+		/*
+		 * The pipe holds one byte as long as '_pending' is not empty, which
+		 * keeps the pipe fd readable for OpenVPN's select() loop. The flag
+		 * is set by whoever writes that byte.
+		 */
+		int _pipe_signalled = 0;
 
-		bool _send()
+		Genode::Signal_handler<Openvpn_component> _done_handler;
+
+		void _signal_pipe()
 		{
-			using namespace Genode;
+			/*
+			 * Order the preceding push before the flag test, pairs with
+			 * the fence in '_complete'
+			 */
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
 
-			if (!_tx.sink()->ready_to_ack())
-				return false;
+			int expected = 0;
+			if (__atomic_compare_exchange_n(&_pipe_signalled, &expected, 1, false,
+			                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+				::write(_pipefd[WRITE], "1", 1);
+		}
+
+		void _ack_done()
+		{
+			Genode::Packet_descriptor packet;
+			while (_tx.sink()->ready_to_ack() && _done.peek(packet)) {
+				_done.pop();
+				_tx.sink()->acknowledge_packet(packet);
+				--_outstanding;
+			}
+		}
+
+		/**
+		 * Return handled tx packet to the entrypoint
+		 */
+		void _complete(Genode::Packet_descriptor const &packet)
+		{
+			_pending.pop();
+			_done.push(packet);
 
-			if (!_tx.sink()->packet_avail())
-				return false;
+			if (!_pending.empty())
+				return;
 
-			Packet_descriptor packet = _tx.sink()->get_packet();
-			if (!packet.size()) {
-				Genode::warning("invalid tx packet");
-				return true;
+			/* consume the pipe byte of this batch */
+			char tmp[1];
+			::read(_pipefd[READ], tmp, sizeof (tmp));
+			__atomic_store_n(&_pipe_signalled, 0, __ATOMIC_SEQ_CST);
+
+			/*
+			 * Packets queued meanwhile may have missed the signal. The
+			 * fence orders the flag reset before the recheck, so either
+			 * we see the new packet or the entrypoint sees the reset flag.
+			 */
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (!_pending.empty())
+				_signal_pipe();
+
+			/* let the entrypoint acknowledge the whole batch */
+			Genode::Signal_transmitter(_done_handler).submit();
+		}
+
+		int _read_frame(Genode::Packet_descriptor const &packet,
+		                char *buf, Genode::size_t len)
+		{
+			/* copy straight from the packet-stream buffer */
+			len = Genode::min(len, packet.size());
+			Genode::memcpy(buf, _tx.sink()->packet_content(packet), len);
+			return len;
+		}
+
+		int _read_ip(Genode::Packet_descriptor const &packet,
+		             char *buf, Genode::size_t len)
+		{
+			using namespace Net;
+
+			try {
+				Size_guard guard(packet.size());
+				Ethernet_frame &eth =
+					Ethernet_frame::cast_from(_tx.sink()->packet_content(packet), guard);
+
+				switch (eth.type()) {
+				case Ethernet_frame::Type::IPV4:
+					{
+						Ipv4_packet &ip = eth.data<Ipv4_packet>(guard);
+
+						/* strip the padding of minimum-sized Ethernet frames */
+						Genode::size_t const ip_size =
+							Genode::min(packet.size() - sizeof(Ethernet_frame),
+							            (Genode::size_t)ip.total_length());
+
+						len = Genode::min(len, ip_size);
+						Genode::memcpy(buf, &ip, len);
+						return len;
+					}
+				case Ethernet_frame::Type::ARP:
+					_answer_arp(eth.data<Arp_packet>(guard));
+					return -1;
+				default:
+					return -1;
+				}
+			} catch (Size_guard::Exceeded) {
+				Genode::warning("dropping truncated tx packet");
 			}
+			return -1;
+		}
 
-			_packet = _tx.sink()->packet_content(packet);
+		/**
+		 * Answer ARP request of the client for any address but its own
+		 */
+		void _answer_arp(Net::Arp_packet const &request)
+		{
+			using namespace Net;
 
-			/* notify openvpn */
-			::write(_pipefd[WRITE], "1", 1);
+			if (!request.ethernet_ipv4()
+			 || request.opcode() != Arp_packet::REQUEST
+			 || request.src_ip() == request.dst_ip())
+				return;
 
-			/* block while openvpn handles the packet */
-			_tx_lock.down();
-			_tx.sink()->acknowledge_packet(packet);
+			_release_acked_rx();
 
-			return true;
+			if (!_rx.source()->ready_to_submit())
+				return;
+
+			Genode::size_t const size = sizeof(Ethernet_frame) + sizeof(Arp_packet);
+
+			try {
+				Genode::Packet_descriptor packet = _rx.source()->alloc_packet(size);
+
+				Size_guard guard(size);
+				Ethernet_frame &eth = Ethernet_frame::construct_at(
+					_rx.source()->packet_content(packet), guard);
+				eth.src(_gateway_mac);
+				eth.dst(request.src_mac());
+				eth.type(Ethernet_frame::Type::ARP);
+
+				Arp_packet &arp = eth.construct_at_data<Arp_packet>(guard);
+				arp.hardware_address_type(Arp_packet::ETHERNET);
+				arp.protocol_address_type(Arp_packet::IPV4);
+				arp.hardware_address_size(sizeof(Mac_address));
+				arp.protocol_address_size(sizeof(Ipv4_address));
+				arp.opcode(Arp_packet::REPLY);
+				arp.src_mac(_gateway_mac);
+				arp.src_ip(request.dst_ip());
+				arp.dst_mac(request.src_mac());
+				arp.dst_ip(request.src_ip());
+
+				_rx.source()->submit_packet(packet);
+			} catch (...) { }
 		}
 
-		void _handle_packet_stream() override
+		void _release_acked_rx()
 		{
 			while (_rx.source()->ack_avail())
 				_rx.source()->release_packet(_rx.source()->get_acked_packet());
+		}
+
+	protected:
+
+		void _handle_packet_stream() override
+		{
+			using namespace Genode;
+
+			/* the rx direction is handled by the OpenVPN thread in 'write' */
+
+			_ack_done();
+
+			bool queued = false;
+			while (_outstanding < QUEUE_SIZE && _tx.sink()->packet_avail()) {
+
+				Packet_descriptor packet = _tx.sink()->get_packet();
+				if (!packet.size()) {
+					Genode::warning("invalid tx packet");
+					if (_tx.sink()->ready_to_ack())
+						_tx.sink()->acknowledge_packet(packet);
+					continue;
+				}
+
+				_pending.push(packet);
+				++_outstanding;
+				queued = true;
+			}
 
-			while (_send()) ;
+			/* notify openvpn once per batch */
+			if (queued)
+				_signal_pipe();
 		}
 
 	public:
@@ -135,10 +307,14 @@ class Openvpn_component : public Tuntap_device,
 		                  Genode::Allocator   &rx_block_md_alloc,
 		                  Genode::Env         &env)
 		: Session_component(tx_buf_size, rx_buf_size, Genode::CACHED,
-		                    rx_block_md_alloc, env)
+		                    rx_block_md_alloc, env),
+		  _done_handler(env.ep(), *this, &Openvpn_component::_handle_packet_stream)
 		{
 			char buf[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
 			_mac_addr = Nic::Mac_address((void*)buf);
+
+			char gw_buf[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x02 };
+			_gateway_mac = Nic::Mac_address((void*)gw_buf);
 			if (pipe(_pipefd)) {
 				Genode::error("could not create pipe");
 				throw Genode::Exception();
@@ -166,32 +342,54 @@ class Openvpn_component : public Tuntap_device,
 		/* tx */
 		int read(char *buf, Genode::size_t len)
 		{
-			Genode::memcpy(buf, _packet, len);
-			_packet = 0;
+			Genode::Packet_descriptor packet;
+			while (_pending.peek(packet)) {
 
-			/* unblock nic client */
-			_tx_lock.up();
+				int const n = _tun ? _read_ip(packet, buf, len)
+				                   : _read_frame(packet, buf, len);
+				_complete(packet);
 
-			return len;
+				/* ARP and non-IP frames are consumed without data for OpenVPN */
+				if (n >= 0)
+					return n;
+			}
+			return 0;
 		}
 
 		/* rx */
 		int write(char const *buf, Genode::size_t len)
 		{
-			_handle_packet_stream();
+			using Net::Ethernet_frame;
+
+			_release_acked_rx();
 
 			if (!_rx.source()->ready_to_submit())
 				return 0;
 
+			Genode::size_t const header = _tun ? sizeof(Ethernet_frame) : 0;
+
 			try {
-				Genode::Packet_descriptor packet = _rx.source()->alloc_packet(len);
-				Genode::memcpy(_rx.source()->packet_content(packet), buf, len);
+				Genode::Packet_descriptor packet =
+					_rx.source()->alloc_packet(header + len);
+				char *content = _rx.source()->packet_content(packet);
+
+				if (_tun) {
+					Net::Size_guard guard(header + len);
+					Ethernet_frame &eth = Ethernet_frame::construct_at(content, guard);
+					eth.src(_gateway_mac);
+					eth.dst(_mac_addr);
+					eth.type(Ethernet_frame::Type::IPV4);
+				}
+
+				Genode::memcpy(content + header, buf, len);
 				_rx.source()->submit_packet(packet);
 			} catch (...) { return 0; }
 
 			return len;
 		}
 
+		void tun_mode(bool enabled) { _tun = enabled; }
+
 		void up() { _startup_lock.up(); }
 
 		void down() { _startup_lock.down(); }
@@ -0,0 +1,89 @@
+/*
+ * \brief  Lock-free queue of packet descriptors
+ * \date   2026-10-19
+ */
+
+/*
+ * Copyright (C) 2026 Genode Labs GmbH
+ *
+ * This file is distributed under the terms of the GNU General Public License
+ * version 2.
+ */
+
+#ifndef _PACKET_QUEUE_H_
+#define _PACKET_QUEUE_H_
+
+
+/**
+ * Single-producer single-consumer ring
+ *
+ * The producer only writes '_head' and the consumer only writes '_tail',
+ * so the two threads synchronize solely through acquire/release accesses
+ * of these counters.
+ */
+template <typename T, unsigned CAPACITY>
+class Packet_queue
+{
+	private:
+
+		static_assert(CAPACITY && !(CAPACITY & (CAPACITY - 1)),
+		              "capacity must be a power of two");
+
+		T        _items[CAPACITY] { };
+		unsigned _head = 0;
+		unsigned _tail = 0;
+
+	public:
+
+		bool empty() const
+		{
+			return __atomic_load_n(&_head, __ATOMIC_ACQUIRE)
+			    == __atomic_load_n(&_tail, __ATOMIC_ACQUIRE);
+		}
+
+		/**
+		 * Append item, called by the producer
+		 *
+		 * \return false if the queue is full
+		 */
+		bool push(T const &item)
+		{
+			unsigned const head = __atomic_load_n(&_head, __ATOMIC_RELAXED);
+			unsigned const tail = __atomic_load_n(&_tail, __ATOMIC_ACQUIRE);
+
+			if (head - tail == CAPACITY)
+				return false;
+
+			_items[head % CAPACITY] = item;
+			__atomic_store_n(&_head, head + 1, __ATOMIC_RELEASE);
+			return true;
+		}
+
+		/**
+		 * Look at the oldest item, called by the consumer
+		 *
+		 * \return false if the queue is empty
+		 */
+		bool peek(T &item) const
+		{
+			unsigned const tail = __atomic_load_n(&_tail, __ATOMIC_RELAXED);
+			unsigned const head = __atomic_load_n(&_head, __ATOMIC_ACQUIRE);
+
+			if (head == tail)
+				return false;
+
+			item = _items[tail % CAPACITY];
+			return true;
+		}
+
+		/**
+		 * Remove the oldest item, called by the consumer after 'peek'
+		 */
+		void pop()
+		{
+			unsigned const tail = __atomic_load_n(&_tail, __ATOMIC_RELAXED);
+			__atomic_store_n(&_tail, tail + 1, __ATOMIC_RELEASE);
+		}
+};
+
+#endif /* _PACKET_QUEUE_H_ */
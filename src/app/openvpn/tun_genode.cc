@@ -57,6 +57,8 @@ extern "C" void open_tun(char const *dev, char const *dev_type,
 	Genode::snprintf(name, sizeof (name), "/dev/%s", dev);
 
 	tt->actual_name = string_alloc(name, NULL);
+
+	tuntap_dev()->tun_mode(tt->type == DEV_TYPE_TUN);
 	tt->fd = tuntap_dev()->fd();
 }
 
@@ -75,10 +77,8 @@ extern "C" int write_tun(struct tuntap *tt, uint8_t *buf, int len)
 
 	switch (tt->type) {
 	case DEV_TYPE_TAP:
-		return tuntap_dev()->write(reinterpret_cast<char const*>(buf), len);
-		break;
 	case DEV_TYPE_TUN:
-		break;
+		return tuntap_dev()->write(reinterpret_cast<char const*>(buf), len);
 	}
 
 	return -1;
@@ -90,18 +90,11 @@ extern "C" int read_tun(struct tuntap *tt, uint8_t *buf, int len)
 	if (len <= 0)
 		return -1;
 
-	{
-		/* read from fd to prevent select() from triggering more than once */
-		char tmp[1];
-		::read(tt->fd, tmp, sizeof (tmp));
-	}
-
+	/* the device consumes the notification byte once its queue is empty */
 	switch (tt->type) {
 	case DEV_TYPE_TAP:
-		return tuntap_dev()->read(reinterpret_cast<char*>(buf), len);
-		break;
 	case DEV_TYPE_TUN:
-		break;
+		return tuntap_dev()->read(reinterpret_cast<char*>(buf), len);
 	}
 
 	return -1;
@@ -36,9 +36,16 @@ struct Tuntap_device
 
 	/**
 	 * Get file descriptor used to notify OpenVPN about incoming packets
+	 *
+	 * The descriptor stays readable as long as packets are pending.
 	 */
 	virtual int fd() = 0;
 
+	/**
+	 * Exchange IP packets instead of Ethernet frames with OpenVPN
+	 */
+	virtual void tun_mode(bool enabled) = 0;
+
 	/**
 	 * Start-up lock up
 	 */
@@ -64,3 +64,10 @@ bool Fuse::support_symlinks(void)
 {
 	return false;
 }
+
+
+bool Fuse::support_concurrent_ops(void)
+{
+	/* the exFAT library keeps no locks of its own */
+	return false;
+}
@@ -102,3 +102,10 @@ bool Fuse::support_symlinks(void)
 {
 	return true;
 }
+
+
+bool Fuse::support_concurrent_ops(void)
+{
+	/* libext2fs is not thread safe */
+	return false;
+}
@@ -0,0 +1,437 @@
+/*
+ * \brief  Per-file page cache of the libc libfuse plugin
+ * \date   2026-10-19
+ */
+
+/*
+ * Copyright (C) 2026 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU Affero General Public License version 3.
+ */
+
+#ifndef _LIBC_FUSE__PAGE_CACHE_H_
+#define _LIBC_FUSE__PAGE_CACHE_H_
+
+/* Genode includes */
+#include <base/allocator.h>
+#include <util/string.h>
+
+/* libc includes */
+#include <errno.h>
+#include <sys/types.h>
+
+namespace Libc_fuse { class Page_cache; }
+
+
+/**
+ * Cache of file content in units of the file-system cluster size
+ *
+ * Small reads are served from pages filled by cluster-aligned FUSE reads.
+ * Sequential reads fetch several pages at once. Writes are collected in
+ * dirty pages, which are written back as a whole cluster-aligned chunk when
+ * evicted or flushed. Requests that span more than a few pages bypass the
+ * cache. Page buffers are allocated on first use.
+ */
+class Libc_fuse::Page_cache
+{
+	public:
+
+		/**
+		 * Interface to the FUSE operations of the cached file
+		 *
+		 * Both functions return the number of bytes transferred or -errno.
+		 */
+		struct Backend
+		{
+			virtual int backend_read(char *, ::size_t, ::off_t) = 0;
+			virtual int backend_write(char const *, ::size_t, ::off_t) = 0;
+
+			virtual ~Backend() { }
+		};
+
+		enum {
+			NUM_PAGES      = 16,
+			READ_AHEAD     = 4,
+			MIN_PAGE_SIZE  = 4096,
+			MAX_PAGE_SIZE  = 64*1024,
+			BYPASS_PAGES   = 2,
+		};
+
+	private:
+
+		/*
+		 * Noncopyable
+		 */
+		Page_cache(Page_cache const &);
+		Page_cache &operator = (Page_cache const &);
+
+		struct Page
+		{
+			bool          used        = false;
+			::off_t       offset      = 0;
+			char         *data        = nullptr;
+			::size_t      dirty_start = 0;
+			::size_t      dirty_end   = 0;
+			unsigned long last_use    = 0;
+
+			bool dirty() const { return dirty_end > dirty_start; }
+		};
+
+		Genode::Allocator &_alloc;
+		Backend           &_backend;
+		::size_t const     _page_size;
+		::off_t            _size;          /* file size including dirty data */
+		::off_t            _next_read = 0; /* detection of sequential reads */
+		unsigned long      _use_count = 0;
+		Page               _pages[NUM_PAGES];
+		char              *_read_ahead_buf = nullptr;
+
+		static ::size_t _page_size_for(::size_t block_size)
+		{
+			::size_t size = MIN_PAGE_SIZE;
+			while (size < block_size && size < MAX_PAGE_SIZE)
+				size <<= 1;
+			return size;
+		}
+
+		::off_t _page_base(::off_t offset) const {
+			return offset & ~(::off_t)(_page_size - 1); }
+
+		Page *_lookup(::off_t base)
+		{
+			for (Page &page : _pages)
+				if (page.used && page.offset == base) {
+					page.last_use = ++_use_count;
+					return &page;
+				}
+			return nullptr;
+		}
+
+		/**
+		 * Write dirty range of page back
+		 *
+		 * \return 0 on success or -errno
+		 */
+		int _write_back(Page &page)
+		{
+			if (!page.dirty())
+				return 0;
+
+			::size_t const length = page.dirty_end - page.dirty_start;
+
+			int const res = _backend.backend_write(page.data + page.dirty_start,
+			                                       length,
+			                                       page.offset + page.dirty_start);
+			if (res < 0)
+				return res;
+			if ((::size_t)res != length)
+				return -EIO;
+
+			page.dirty_start = page.dirty_end = 0;
+			return 0;
+		}
+
+		/**
+		 * Obtain unused page, evicting the least-recently used one if needed
+		 *
+		 * Unused pages that already own a buffer are preferred.
+		 */
+		Page *_alloc_page(int &err)
+		{
+			Page *victim = nullptr;
+			for (Page &page : _pages) {
+				if (!page.used && page.data) { victim = &page; break; }
+				if (!page.used) {
+					if (!victim || victim->used) victim = &page;
+					continue;
+				}
+				if (!victim || (victim->used && page.last_use < victim->last_use))
+					victim = &page;
+			}
+
+			err = _write_back(*victim);
+			if (err)
+				return nullptr;
+
+			if (!victim->data) {
+				try { victim->data = (char *)_alloc.alloc(_page_size); }
+				catch (...) {
+					err = -ENOMEM;
+					return nullptr;
+				}
+			}
+
+			victim->used     = false;
+			victim->last_use = ++_use_count;
+			return victim;
+		}
+
+		/**
+		 * Fill 'count' consecutive pages starting at 'base' with one FUSE read
+		 *
+		 * \return page at 'base' or nullptr on error
+		 */
+		Page *_fill(::off_t base, unsigned count, int &err)
+		{
+			::size_t const length = count*_page_size;
+
+			if (!_read_ahead_buf) {
+				try { _read_ahead_buf = (char *)_alloc.alloc(READ_AHEAD*_page_size); }
+				catch (...) {
+					err = -ENOMEM;
+					return nullptr;
+				}
+			}
+
+			int const res = _backend.backend_read(_read_ahead_buf, length, base);
+			if (res < 0) {
+				err = res;
+				return nullptr;
+			}
+
+			/* bytes beyond the end of the backend file are holes */
+			Genode::memset(_read_ahead_buf + res, 0, length - res);
+
+			Page *first = nullptr;
+			for (unsigned i = 0; i < count; i++) {
+
+				::off_t const offset = base + i*_page_size;
+
+				/* do not fetch pages beyond the end of the file in advance */
+				if (i && offset >= _size)
+					break;
+
+				Page *page = _alloc_page(err);
+				if (!page)
+					return nullptr;
+
+				Genode::memcpy(page->data, _read_ahead_buf + i*_page_size, _page_size);
+				page->offset = offset;
+				page->used   = true;
+
+				if (!first)
+					first = page;
+			}
+			return first;
+		}
+
+		Page *_page(::off_t base, bool sequential, int &err)
+		{
+			if (Page *page = _lookup(base))
+				return page;
+
+			/* read ahead as long as the following pages are not cached */
+			unsigned count = 1;
+			if (sequential)
+				while (count < READ_AHEAD && !_lookup(base + count*_page_size))
+					count++;
+
+			return _fill(base, count, err);
+		}
+
+		/**
+		 * Write back and drop pages in the range of a bypassing request
+		 */
+		int _evict(::off_t offset, ::size_t count)
+		{
+			for (Page &page : _pages) {
+				if (!page.used)
+					continue;
+				if (page.offset + (::off_t)_page_size <= offset
+				 || page.offset >= offset + (::off_t)count)
+					continue;
+
+				int const err = _write_back(page);
+				if (err)
+					return err;
+				page.used = false;
+			}
+			return 0;
+		}
+
+	public:
+
+		/**
+		 * Constructor
+		 *
+		 * \param block_size  cluster size reported by the file system
+		 * \param size        current size of the file
+		 */
+		Page_cache(Genode::Allocator &alloc, Backend &backend,
+		           ::size_t block_size, ::off_t size)
+		:
+			_alloc(alloc), _backend(backend),
+			_page_size(_page_size_for(block_size)), _size(size)
+		{ }
+
+		/**
+		 * Destructor
+		 *
+		 * Dirty pages must have been flushed before.
+		 */
+		~Page_cache()
+		{
+			for (Page &page : _pages)
+				if (page.data)
+					_alloc.free(page.data, _page_size);
+
+			if (_read_ahead_buf)
+				_alloc.free(_read_ahead_buf, READ_AHEAD*_page_size);
+		}
+
+		::off_t size() const { return _size; }
+
+		/**
+		 * Read from file
+		 *
+		 * \return number of bytes read or -errno
+		 */
+		int read(char *dst, ::size_t count, ::off_t offset)
+		{
+			bool const sequential = (offset == _next_read);
+
+			if (offset >= _size)
+				return 0;
+
+			if ((::off_t)count > _size - offset)
+				count = _size - offset;
+
+			if (count > BYPASS_PAGES*_page_size) {
+				int const err = _evict(offset, count);
+				if (err)
+					return err;
+
+				int const res = _backend.backend_read(dst, count, offset);
+				if (res > 0)
+					_next_read = offset + res;
+				return res;
+			}
+
+			::size_t done = 0;
+			while (done < count) {
+
+				::off_t const pos  = offset + done;
+				::off_t const base = _page_base(pos);
+
+				int err = 0;
+				Page *page = _page(base, sequential, err);
+				if (!page)
+					return done ? (int)done : err;
+
+				::size_t const in_page = pos - base;
+				::size_t const n = Genode::min(count - done, _page_size - in_page);
+
+				Genode::memcpy(dst + done, page->data + in_page, n);
+				done += n;
+			}
+
+			_next_read = offset + done;
+			return done;
+		}
+
+		/**
+		 * Write to file
+		 *
+		 * \return number of bytes written or -errno
+		 */
+		int write(char const *src, ::size_t count, ::off_t offset)
+		{
+			if (count > BYPASS_PAGES*_page_size) {
+				int const err = _evict(offset, count);
+				if (err)
+					return err;
+
+				int const res = _backend.backend_write(src, count, offset);
+				if (res > 0 && offset + res > _size)
+					_size = offset + res;
+				return res;
+			}
+
+			::size_t done = 0;
+			while (done < count) {
+
+				::off_t const pos  = offset + done;
+				::off_t const base = _page_base(pos);
+
+				::size_t const in_page = pos - base;
+				::size_t const n = Genode::min(count - done, _page_size - in_page);
+
+				int err = 0;
+				Page *page = _lookup(base);
+
+				/* a page overwritten entirely or beyond the file end needs no fill */
+				if (!page && (n == _page_size || base >= _size)) {
+					page = _alloc_page(err);
+					if (page) {
+						Genode::memset(page->data, 0, _page_size);
+						page->offset = base;
+						page->used   = true;
+					}
+				} else if (!page) {
+					page = _page(base, false, err);
+				}
+
+				if (!page)
+					return done ? (int)done : err;
+
+				Genode::memcpy(page->data + in_page, src + done, n);
+
+				/*
+				 * Write back the page as a whole, or up to the file end for
+				 * the last page of the file. The content before 'in_page' is
+				 * valid because the page was filled or lies beyond the end.
+				 */
+				::size_t end = in_page + n;
+				if (base < _size)
+					end = Genode::max(end, (::size_t)Genode::min((::off_t)_page_size,
+					                                             _size - base));
+
+				page->dirty_start = 0;
+				page->dirty_end   = Genode::max(page->dirty_end, end);
+
+				done += n;
+				if (pos + (::off_t)n > _size)
+					_size = pos + n;
+			}
+			return done;
+		}
+
+		/**
+		 * Write back all dirty pages
+		 *
+		 * \return 0 on success or -errno
+		 */
+		int flush()
+		{
+			/* write back in ascending file order */
+			for (;;) {
+				Page *next = nullptr;
+				for (Page &page : _pages)
+					if (page.used && page.dirty()
+					 && (!next || page.offset < next->offset))
+						next = &page;
+
+				if (!next)
+					return 0;
+
+				int const err = _write_back(*next);
+				if (err)
+					return err;
+			}
+		}
+
+		/**
+		 * Drop all pages after the file was changed by other means
+		 */
+		void invalidate(::off_t size)
+		{
+			for (Page &page : _pages)
+				page.used = false;
+
+			_size      = size;
+			_next_read = 0;
+		}
+};
+
+#endif /* _LIBC_FUSE__PAGE_CACHE_H_ */
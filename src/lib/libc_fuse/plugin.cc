@@ -25,6 +25,9 @@
 /* fuse */
 #include <fuse_private.h>
 
+/* local includes */
+#include <page_cache.h>
+
 /* libc includes */
 #include <sys/statvfs.h>
 #include <sys/dirent.h>
@@ -79,7 +82,10 @@ extern "C" int link(const char *oldpath, const char *newpath)
 
 namespace {
 
-	struct Plugin_context : Libc::Plugin_context
+	struct Cached_file;
+
+	struct Plugin_context : Libc::Plugin_context,
+	                        List<Plugin_context>::Element
 	{
 		String<4096>          path;
 		int                   flags;
@@ -88,16 +94,83 @@ namespace {
 
 		::off_t               offset;
 
+		/* only present for regular files */
+		Cached_file          *cached;
+
 		Plugin_context(const char *p, int f)
 		:
-			path(p), flags(f), offset(0)
+			path(p), flags(f), offset(0), cached(0)
 		{
 			Genode::memset(&file_info, 0, sizeof (struct fuse_file_info));
 		}
 
-		~Plugin_context() { }
+		bool writeable() const { return (flags & O_ACCMODE) != O_RDONLY; }
+
+		int backend_read(char *buf, ::size_t count, ::off_t off)
+		{
+			return Fuse::fuse()->op.read(path.string(), buf, count, off,
+			                             &file_info);
+		}
+
+		int backend_write(char const *buf, ::size_t count, ::off_t off)
+		{
+			return Fuse::fuse()->op.write(path.string(), buf, count, off,
+			                              &file_info);
+		}
+
+		/**
+		 * Write back cached data
+		 *
+		 * \return 0 on success or -errno
+		 */
+		inline int flush();
 	};
 
+
+	/**
+	 * Page cache shared by all file descriptors of a regular file
+	 *
+	 * The FUSE operations issued by the cache use the file info of one of
+	 * the descriptors, a writeable one for writing back dirty pages.
+	 */
+	struct Cached_file : List<Cached_file>::Element,
+	                     Libc_fuse::Page_cache::Backend
+	{
+		String<4096>          path;
+		List<Plugin_context>  users { };
+		Libc_fuse::Page_cache cache;
+
+		/**
+		 * Constructor
+		 *
+		 * The pages have the size of a file-system cluster, so that the
+		 * FUSE file system sees cluster-aligned requests only.
+		 */
+		Cached_file(char const *path, ::size_t block_size, ::off_t size)
+		:
+			path(path), cache(*env()->heap(), *this, block_size, size)
+		{ }
+
+		Plugin_context &_user(bool write)
+		{
+			if (write)
+				for (Plugin_context *c = users.first(); c; c = c->next())
+					if (c->writeable())
+						return *c;
+
+			return *users.first();
+		}
+
+		int backend_read(char *buf, ::size_t count, ::off_t off) override {
+			return _user(false).backend_read(buf, count, off); }
+
+		int backend_write(char const *buf, ::size_t count, ::off_t off) override {
+			return _user(true).backend_write(buf, count, off); }
+	};
+
+
+	int Plugin_context::flush() { return cached ? cached->cache.flush() : 0; }
+
 	static inline Plugin_context *context(Libc::File_descriptor *fd)
 	{
 		return static_cast<Plugin_context *>(fd->context);
@@ -109,6 +182,73 @@ namespace {
 
 			enum { PLUGIN_PRIORITY = 1 };
 
+			List<Cached_file> _cached_files { };
+
+			Cached_file *_cached_file(char const *path)
+			{
+				for (Cached_file *f = _cached_files.first(); f; f = f->next())
+					if (f->path == path)
+						return f;
+				return nullptr;
+			}
+
+			/**
+			 * Write back cached data of file before accessing it by path
+			 */
+			int _flush(char const *path)
+			{
+				Cached_file *f = _cached_file(path);
+				return f ? f->cache.flush() : 0;
+			}
+
+			/**
+			 * Attach regular file to the page cache of its path
+			 */
+			void _attach_cache(Plugin_context &ctx)
+			{
+				Cached_file *f = _cached_file(ctx.path.string());
+
+				if (!f) {
+					struct stat st;
+					Genode::memset(&st, 0, sizeof (st));
+					if (Fuse::fuse()->op.getattr(ctx.path.string(), &st) != 0
+					 || !S_ISREG(st.st_mode))
+						return;
+
+					struct statvfs vfs;
+					Genode::memset(&vfs, 0, sizeof (vfs));
+					Fuse::fuse()->op.statfs(ctx.path.string(), &vfs);
+
+					try {
+						f = new (env()->heap())
+							Cached_file(ctx.path.string(), vfs.f_bsize, st.st_size);
+					} catch (...) {
+						warning("no page cache for '", ctx.path.string(), "'");
+						return;
+					}
+					_cached_files.insert(f);
+				}
+
+				f->users.insert(&ctx);
+				ctx.cached = f;
+			}
+
+			void _detach_cache(Plugin_context &ctx)
+			{
+				Cached_file *f = ctx.cached;
+				if (!f)
+					return;
+
+				f->users.remove(&ctx);
+				ctx.cached = nullptr;
+
+				if (f->users.first())
+					return;
+
+				_cached_files.remove(f);
+				destroy(env()->heap(), f);
+			}
+
 		public:
 
 			/**
@@ -189,12 +329,15 @@ namespace {
 			{
 				Plugin_context *ctx = context(fd);
 
+				int res = ctx->flush();
+
 				Fuse::fuse()->op.release(ctx->path.string(), &ctx->file_info);
 
+				_detach_cache(*ctx);
 				destroy(env()->heap(), ctx);
 				Libc::file_descriptor_allocator()->free(fd);
 
-				return 0;
+				return check_result(res);
 			}
 
 			int fcntl(Libc::File_descriptor *fd, int cmd, long arg)
@@ -229,9 +372,28 @@ namespace {
 					return -1;
 				}
 
+				/* account for cached data not yet written back */
+				if (ctx->cached && ctx->cached->cache.size() > buf->st_size)
+					buf->st_size = ctx->cached->cache.size();
+
 				return 0;
 			}
 
+			int fsync(Libc::File_descriptor *fd)
+			{
+				Plugin_context *ctx = context(fd);
+
+				int res = ctx->flush();
+				if (res == 0)
+					res = Fuse::fuse()->op.fsync(ctx->path.string(), 0,
+					                             &ctx->file_info);
+
+				/* write back file-system wide state, e.g., the ext2 block cache */
+				Fuse::sync_fs();
+
+				return check_result(res);
+			}
+
 			int fstatfs(Libc::File_descriptor *fd, struct statfs *buf)
 			{
 				Plugin_context *ctx = context(fd);
@@ -263,13 +425,18 @@ namespace {
 			{
 				Plugin_context *ctx = context(fd);
 
-				int res = Fuse::fuse()->op.ftruncate(ctx->path.string(), length,
-				                                     &ctx->file_info);
+				int res = ctx->flush();
+				if (res == 0)
+					res = Fuse::fuse()->op.ftruncate(ctx->path.string(), length,
+					                                 &ctx->file_info);
 				if (res != 0) {
 					errno = -res;
 					return -1;
 				}
 
+				if (ctx->cached)
+					ctx->cached->cache.invalidate(length);
+
 				return 0;
 			}
 
@@ -427,6 +594,12 @@ namespace {
 
 				context->file_info.flags = flags;
 
+				_attach_cache(*context);
+
+				/* drop content cached by other descriptors of the file */
+				if ((flags & O_TRUNC) && context->cached)
+					context->cached->cache.invalidate(0);
+
 				return Libc::file_descriptor_allocator()->alloc(this, context);
 			}
 
@@ -434,9 +607,11 @@ namespace {
 			{
 				Plugin_context *ctx = context(fd);
 
-				int res = Fuse::fuse()->op.read(ctx->path.string(),
-				                                reinterpret_cast<char*>(buf),
-				                                count, ctx->offset, &ctx->file_info);
+				char *dst = reinterpret_cast<char*>(buf);
+
+				int res = ctx->cached
+				        ? ctx->cached->cache.read(dst, count, ctx->offset)
+				        : ctx->backend_read(dst, count, ctx->offset);
 
 				if (check_result(res))
 					return -1;
@@ -464,9 +639,25 @@ namespace {
 
 			int rename(const char *oldpath, const char *newpath)
 			{
-				int res = Fuse::fuse()->op.rename(oldpath, newpath);
+				int res = _flush(oldpath);
+				if (res == 0)
+					res = _flush(newpath);
+				if (res == 0)
+					res = Fuse::fuse()->op.rename(oldpath, newpath);
+				if (res != 0)
+					return check_result(res);
+
+				/* open descriptors of a replaced file keep their cache privately */
+				if (Cached_file *replaced = _cached_file(newpath))
+					_cached_files.remove(replaced);
+
+				if (Cached_file *f = _cached_file(oldpath)) {
+					f->path = newpath;
+					for (Plugin_context *c = f->users.first(); c; c = c->next())
+						c->path = newpath;
+				}
 
-				return check_result(res);
+				return 0;
 			}
 
 			int rmdir(const char *path)
@@ -481,8 +672,15 @@ namespace {
 				Genode::memset(buf, 0, sizeof (buf));
 
 				int res = Fuse::fuse()->op.getattr(path, buf);
+				if (res != 0)
+					return check_result(res);
 
-				return check_result(res);
+				/* account for cached data not yet written back */
+				Cached_file *f = _cached_file(path);
+				if (f && f->cache.size() > buf->st_size)
+					buf->st_size = f->cache.size();
+
+				return 0;
 			}
 
 			int symlink(const char *oldpath, const char *newpath)
@@ -494,18 +692,29 @@ namespace {
 
 			int unlink(const char *path)
 			{
-				int res = Fuse::fuse()->op.unlink(path);
+				int res = _flush(path);
+				if (res == 0)
+					res = Fuse::fuse()->op.unlink(path);
 
-				return check_result(res);
+				if (res != 0)
+					return check_result(res);
+
+				/* open descriptors of the unlinked file keep their cache privately */
+				if (Cached_file *unlinked = _cached_file(path))
+					_cached_files.remove(unlinked);
+
+				return 0;
 			}
 
 			ssize_t write(Libc::File_descriptor *fd, const void *buf, ::size_t count)
 			{
 				Plugin_context *ctx = context(fd);
 
-				int res = Fuse::fuse()->op.write(ctx->path.string(),
-				                                 reinterpret_cast<const char*>(buf),
-				                                 count, ctx->offset, &ctx->file_info);
+				char const *src = reinterpret_cast<const char*>(buf);
+
+				int res = ctx->cached
+				        ? ctx->cached->cache.write(src, count, ctx->offset)
+				        : ctx->backend_write(src, count, ctx->offset);
 
 				if (check_result(res))
 					return -1;
@@ -45,11 +45,18 @@ struct Blockdev
 	struct ext4_blockdev_iface ext4_blockdev_iface;
 	unsigned char              ext4_block_buffer[4096];
 
+	enum {
+		TX_BUF_SIZE  = 512*1024,
+
+		/* largest request, leaves room for allocator alignment */
+		MAX_REQUEST  = TX_BUF_SIZE / 2,
+	};
+
 	Genode::Env           &_env;
 	Genode::Allocator     &_alloc;
 	Genode::Allocator_avl  _tx_alloc { &_alloc };
 
-	Block::Connection<>        _block { _env, &_tx_alloc, 512*1024 };
+	Block::Connection<>        _block { _env, &_tx_alloc, TX_BUF_SIZE };
 	Block::Session::Info const _info  { _block.info() };
 
 	Blockdev(Genode::Env &env, Genode::Allocator &alloc)
@@ -59,6 +66,15 @@ struct Blockdev
 	Block::sector_t       block_count() const { return _info.block_count; }
 	Genode::size_t        block_size()  const { return _info.block_size;  }
 	bool                  writeable()   const { return _info.writeable;   }
+
+	/**
+	 * Maximum number of blocks per request
+	 */
+	uint32_t max_count() const
+	{
+		Genode::size_t const count = MAX_REQUEST / block_size();
+		return count ? count : 1;
+	}
 };
 
 
@@ -66,12 +82,9 @@ static int blockdev_open(struct ext4_blockdev *bdev)  { return EOK; }
 static int blockdev_close(struct ext4_blockdev *bdev) { return EOK; }
 
 
-static int blockdev_bread(struct ext4_blockdev *bdev,
-                          void                 *dest,
-                          uint64_t              lba,
-                          uint32_t              count)
+static int blockdev_bread_request(Blockdev &bd, void *dest,
+                                  uint64_t lba, uint32_t count)
 {
-	Blockdev            &bd = *reinterpret_cast<Blockdev*>(bdev);
 	Block::Connection<> &b  = bd.block();
 
 	Genode::size_t const size = bd.block_size() * count;
@@ -96,14 +109,9 @@ static int blockdev_bread(struct ext4_blockdev *bdev,
 }
 
 
-static int blockdev_bwrite(struct ext4_blockdev *bdev,
-                           void const           *src,
-                           uint64_t              lba,
-                           uint32_t              count)
+static int blockdev_bwrite_request(Blockdev &bd, void const *src,
+                                   uint64_t lba, uint32_t count)
 {
-	Blockdev &bd = *reinterpret_cast<Blockdev*>(bdev);
-	if (!bd.writeable()) { return EIO; }
-
 	Block::Connection<>    &b = bd.block();
 	Genode::size_t const size = bd.block_size() * count;
 
@@ -129,6 +137,57 @@ static int blockdev_bwrite(struct ext4_blockdev *bdev,
 	return result;
 }
 
+
+/*
+ * Requests of contiguous blocks may exceed the packet-stream buffer, e.g.,
+ * when whole extents are read directly. They are split into the largest
+ * requests that fit.
+ */
+
+static int blockdev_bread(struct ext4_blockdev *bdev,
+                          void                 *dest,
+                          uint64_t              lba,
+                          uint32_t              count)
+{
+	Blockdev &bd = *reinterpret_cast<Blockdev*>(bdev);
+
+	char *dst = reinterpret_cast<char*>(dest);
+	while (count) {
+		uint32_t const n = Genode::min(count, bd.max_count());
+
+		int const err = blockdev_bread_request(bd, dst, lba, n);
+		if (err) { return err; }
+
+		dst   += n * bd.block_size();
+		lba   += n;
+		count -= n;
+	}
+	return EOK;
+}
+
+
+static int blockdev_bwrite(struct ext4_blockdev *bdev,
+                           void const           *src,
+                           uint64_t              lba,
+                           uint32_t              count)
+{
+	Blockdev &bd = *reinterpret_cast<Blockdev*>(bdev);
+	if (!bd.writeable()) { return EIO; }
+
+	char const *s = reinterpret_cast<char const*>(src);
+	while (count) {
+		uint32_t const n = Genode::min(count, bd.max_count());
+
+		int const err = blockdev_bwrite_request(bd, s, lba, n);
+		if (err) { return err; }
+
+		s     += n * bd.block_size();
+		lba   += n;
+		count -= n;
+	}
+	return EOK;
+}
+
 /*
  * Genode enviroment
  */
@@ -110,3 +110,10 @@ bool Fuse::support_symlinks(void)
 {
 	return true;
 }
+
+
+bool Fuse::support_concurrent_ops(void)
+{
+	/* ntfs-3g expects FUSE to serialize the operations */
+	return false;
+}
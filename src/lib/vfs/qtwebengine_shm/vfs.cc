@@ -1,7 +1,7 @@
 /*
  * \brief  Process-local shared memory file system for qtwebengine:
  *         qtwebengine creates files in a single directory (the root
- *         directory of this plugin), allocates space once with
+ *         directory of this plugin), allocates space with
  *         'ftruncate()' and then maps the file contents with 'mmap()'
  *         as shared memory from different threads.
  * \author Christian Prochaska
@@ -20,6 +20,7 @@
 #include <vfs/file_system_factory.h>
 #include <base/ram_allocator.h>
 #include <dataspace/client.h>
+#include <util/avl_tree.h>
 #include <util/list.h>
 #include <util/string.h>
 
@@ -31,9 +32,156 @@ class Dataspace_file_system : public Vfs::File_system
 
 		enum { MAX_NAME_LEN = 128 };
 
+		/*
+		 * Freed dataspaces are kept up to this amount by default
+		 */
+		enum { DEFAULT_POOL_SIZE = 16*1024*1024 };
+
 	private:
 
-		class Dataspace_vfs_file : public Genode::List<Dataspace_vfs_file>::Element
+		/**
+		 * Pool of freed dataspaces for reuse by files of the same size
+		 *
+		 * Renderer processes create and delete buffers of equal sizes over
+		 * and over, which saves the round trip to the RAM allocator.
+		 *
+		 * A freed dataspace that is still mapped by a client is retired
+		 * first. It enters the pool only after its last mapping has been
+		 * released, so it cannot be handed out to another file while the
+		 * client still accesses it.
+		 */
+		class Dataspace_pool
+		{
+			private:
+
+				struct Entry : Genode::List<Entry>::Element
+				{
+					Genode::Ram_dataspace_capability const ds;
+					Genode::size_t                   const size;
+
+					Entry(Genode::Ram_dataspace_capability ds, Genode::size_t size)
+					: ds(ds), size(size) { }
+				};
+
+				struct Retired : Genode::List<Retired>::Element
+				{
+					Genode::Ram_dataspace_capability const ds;
+					Genode::size_t                   const size;
+					unsigned                               mapped;
+
+					Retired(Genode::Ram_dataspace_capability ds,
+					        Genode::size_t size, unsigned mapped)
+					: ds(ds), size(size), mapped(mapped) { }
+				};
+
+				Genode::Env          &_env;
+				Genode::Allocator    &_alloc;
+				Genode::size_t const  _max_bytes;
+				Genode::size_t        _bytes { 0 };
+				Genode::List<Entry>   _entries { };
+				Genode::List<Retired> _retired { };
+
+				static Genode::size_t _page_aligned(Genode::size_t size) {
+					return Genode::align_addr(size, 12); }
+
+				void _insert(Genode::Ram_dataspace_capability ds, Genode::size_t size)
+				{
+					if (_bytes + size > _max_bytes) {
+						_env.ram().free(ds);
+						return;
+					}
+
+					try {
+						_entries.insert(new (_alloc) Entry(ds, size));
+						_bytes += size;
+					} catch (...) { _env.ram().free(ds); }
+				}
+
+			public:
+
+				Dataspace_pool(Genode::Env &env, Genode::Allocator &alloc,
+				               Genode::size_t max_bytes)
+				: _env(env), _alloc(alloc), _max_bytes(max_bytes) { }
+
+				~Dataspace_pool()
+				{
+					while (Entry *e = _entries.first()) {
+						_entries.remove(e);
+						_env.ram().free(e->ds);
+						destroy(_alloc, e);
+					}
+
+					while (Retired *r = _retired.first()) {
+						_retired.remove(r);
+						_env.ram().free(r->ds);
+						destroy(_alloc, r);
+					}
+				}
+
+				/**
+				 * Allocate zeroed dataspace
+				 */
+				Genode::Ram_dataspace_capability alloc(Genode::size_t size)
+				{
+					size = _page_aligned(size);
+
+					for (Entry *e = _entries.first(); e; e = e->next()) {
+						if (e->size != size)
+							continue;
+
+						Genode::Ram_dataspace_capability const ds = e->ds;
+						_entries.remove(e);
+						_bytes -= size;
+						destroy(_alloc, e);
+
+						void *local = _env.rm().attach(ds);
+						Genode::memset(local, 0, size);
+						_env.rm().detach(local);
+
+						return ds;
+					}
+
+					return _env.ram().alloc(size);
+				}
+
+				/**
+				 * Free dataspace that is currently mapped 'mapped' times
+				 */
+				void free(Genode::Ram_dataspace_capability ds, Genode::size_t size,
+				          unsigned mapped)
+				{
+					size = _page_aligned(size);
+
+					if (mapped == 0) {
+						_insert(ds, size);
+						return;
+					}
+
+					try {
+						_retired.insert(new (_alloc) Retired(ds, size, mapped));
+					} catch (...) { _env.ram().free(ds); }
+				}
+
+				/**
+				 * Account the release of a mapping of a retired dataspace
+				 */
+				void release(Genode::Dataspace_capability ds)
+				{
+					for (Retired *r = _retired.first(); r; r = r->next()) {
+						if (!(ds == r->ds))
+							continue;
+
+						if (--r->mapped == 0) {
+							_retired.remove(r);
+							_insert(r->ds, r->size);
+							destroy(_alloc, r);
+						}
+						return;
+					}
+				}
+		};
+
+		class Dataspace_vfs_file : public Genode::Avl_node<Dataspace_vfs_file>
 		{
 			private:
 
@@ -41,46 +189,120 @@ class Dataspace_file_system : public Vfs::File_system
 				Filename               _filename { };
 
 				Genode::Allocator     &_alloc;
-				Genode::Ram_allocator &_ram;
+				Genode::Env           &_env;
+				Dataspace_pool        &_pool;
 
 				Vfs::file_size         _length { 0 };
+				unsigned               _mapped { 0 };
+
+				/**
+				 * Copy the content of 'from' to 'to'
+				 */
+				void _copy(Genode::Ram_dataspace_capability from,
+				           Genode::Ram_dataspace_capability to, Genode::size_t size)
+				{
+					char const *src = _env.rm().attach(from);
+					char       *dst = _env.rm().attach(to);
+
+					Genode::memcpy(dst, src, size);
+
+					_env.rm().detach(dst);
+					_env.rm().detach(src);
+				}
 
 			public:
 
 				unsigned int open_count   { 0 };
 				bool unlink_on_last_close { false };
 
-				bool matches(const char *path)
-				{
-					return (Genode::strlen(path) == (Genode::strlen(_filename.string()))) &&
-					       (Genode::strcmp(path, _filename.string()) == 0);
-				}
-
 				Genode::Ram_dataspace_capability ds_cap { };
 
-				Dataspace_vfs_file(char const *name, Genode::Allocator &alloc, Genode::Ram_allocator &ram)
-				: _filename(name), _alloc(alloc), _ram(ram) { }
+				Dataspace_vfs_file(char const *name, Genode::Allocator &alloc,
+				                   Genode::Env &env, Dataspace_pool &pool)
+				: _filename(name), _alloc(alloc), _env(env), _pool(pool) { }
 
 				~Dataspace_vfs_file()
 				{
 					if (_length > 0)
-						_ram.free(ds_cap);
+						_pool.free(ds_cap, (Genode::size_t)_length, _mapped);
+				}
+
+				/**
+				 * Avl_node interface
+				 */
+				bool higher(Dataspace_vfs_file *other)
+				{
+					return Genode::strcmp(other->_filename.string(),
+					                      _filename.string()) > 0;
+				}
+
+				Dataspace_vfs_file *find_by_name(char const *name)
+				{
+					int const cmp = Genode::strcmp(name, _filename.string());
+					if (cmp == 0)
+						return this;
+
+					Dataspace_vfs_file *file = child(cmp > 0);
+					return file ? file->find_by_name(name) : nullptr;
 				}
 
 				Genode::Allocator &alloc() { return _alloc; }
 
 				Vfs::file_size length() { return _length; }
 
+				/**
+				 * Hand out the dataspace for being mapped by a client
+				 */
+				Genode::Ram_dataspace_capability map()
+				{
+					if (ds_cap.valid())
+						_mapped++;
+
+					return ds_cap;
+				}
+
+				/**
+				 * Release mapping of the current dataspace
+				 *
+				 * \return false if 'ds' is not the current dataspace
+				 */
+				bool unmap(Genode::Dataspace_capability ds)
+				{
+					if (!ds_cap.valid() || !(ds == ds_cap))
+						return false;
+
+					if (_mapped) _mapped--;
+					return true;
+				}
+
+				/**
+				 * Resize the file
+				 *
+				 * The content is copied to a dataspace of the new size. Existing
+				 * mappings keep referring to the former dataspace, which enters
+				 * the pool once they are released.
+				 */
 				Ftruncate_result truncate(Vfs::file_size size)
 				{
-					if (_length > 0) {
-						Genode::error(__PRETTY_FUNCTION__, ": resizing not supported yet");
-						return FTRUNCATE_ERR_NO_PERM;
+					if (size == _length)
+						return FTRUNCATE_OK;
+
+					Genode::Ram_dataspace_capability new_ds { };
+
+					if (size > 0) {
+						new_ds = _pool.alloc((Genode::size_t)size);
+
+						if (_length > 0)
+							_copy(ds_cap, new_ds,
+							      (Genode::size_t)Genode::min(size, _length));
 					}
 
-					_length = size;
+					if (_length > 0)
+						_pool.free(ds_cap, (Genode::size_t)_length, _mapped);
 
-					ds_cap = _ram.alloc(size);
+					ds_cap  = new_ds;
+					_length = size;
+					_mapped = 0;
 
 					return FTRUNCATE_OK;
 				}
@@ -175,8 +397,9 @@ class Dataspace_file_system : public Vfs::File_system
 		};
 
 		Vfs::Env &_env;
-		Genode::List<Dataspace_vfs_file> _files { };
-		Genode::size_t             _num_dirent { 0 };
+		Dataspace_pool                       _pool;
+		Genode::Avl_tree<Dataspace_vfs_file> _files { };
+		Genode::size_t                       _num_dirent { 0 };
 
 		bool _root(const char *path)
 		{
@@ -185,16 +408,19 @@ class Dataspace_file_system : public Vfs::File_system
 
 		Dataspace_vfs_file *_lookup(char const *path)
 		{
-			for (Dataspace_vfs_file *file = _files.first(); file; file = file->next()) {
-				if (file->matches(path))
-					return file;
-			}
-			return nullptr;
+			Dataspace_vfs_file *root = _files.first();
+			return root ? root->find_by_name(path) : nullptr;
 		}
 
 	public:
 
-		Dataspace_file_system(Vfs::Env &env, Genode::Xml_node) : _env(env) { }
+		Dataspace_file_system(Vfs::Env &env, Genode::Xml_node config)
+		:
+			_env(env),
+			_pool(env.env(), env.alloc(),
+			      config.attribute_value("pool_size",
+			                             Genode::Number_of_bytes(DEFAULT_POOL_SIZE)))
+		{ }
 
 		~Dataspace_file_system() { }
 
@@ -211,12 +437,20 @@ class Dataspace_file_system : public Vfs::File_system
 			if (!file)
 				return ds_cap;
 
-			return file->ds_cap;
+			return file->map();
 		}
 
-		void release(char const *, Dataspace_capability) override
+		void release(char const *path, Dataspace_capability ds_cap) override
 		{
-			/* the dataspace gets freed when the file is deleted */
+			/*
+			 * Dataspaces replaced by resizing or of deleted files are
+			 * retired in the pool until their last mapping is released
+			 */
+			Dataspace_vfs_file *file = _lookup(path);
+			if (file && file->unmap(ds_cap))
+				return;
+
+			_pool.release(ds_cap);
 		}
 
 		Stat_result stat(char const *path, Stat &out) override
@@ -227,10 +461,11 @@ class Dataspace_file_system : public Vfs::File_system
 			if (_root(path)) {
 				out.type = Node_type::DIRECTORY;
 
-			} else if (_lookup(path)) {
+			} else if (Dataspace_vfs_file *file = _lookup(path)) {
 				out.type  = Node_type::CONTINUOUS_FILE;
 				out.rwx   = Node_rwx::rw();
-				out.inode = (unsigned long)_lookup(path);
+				out.inode = (unsigned long)file;
+				out.size  = file->length();
 			} else {
 				return STAT_ERR_NO_ENTRY;
 			}
@@ -293,7 +528,7 @@ class Dataspace_file_system : public Vfs::File_system
 				if (strlen(path) >= MAX_NAME_LEN)
 					return OPEN_ERR_NAME_TOO_LONG;
 
-				try { file = new (alloc) Dataspace_vfs_file(path, alloc, _env.env().ram()); }
+				try { file = new (alloc) Dataspace_vfs_file(path, alloc, _env.env(), _pool); }
 				catch (Allocator::Out_of_memory) { return OPEN_ERR_NO_SPACE; }
 
 				_files.insert(file);
@@ -382,10 +617,10 @@ class Dataspace_file_system : public Vfs::File_system
 			if (!handle)
 				return FTRUNCATE_ERR_NO_PERM;
 
-			try { handle->truncate(len); }
+			try { return handle->truncate(len); }
 			catch (Allocator::Out_of_memory) { return FTRUNCATE_ERR_NO_SPACE; }
-
-			return FTRUNCATE_OK;
+			catch (Genode::Out_of_ram)       { return FTRUNCATE_ERR_NO_SPACE; }
+			catch (Genode::Out_of_caps)      { return FTRUNCATE_ERR_NO_SPACE; }
 		}
 
 		/***************************
@@ -19,6 +19,8 @@
 
 #include <nic/packet_allocator.h>
 #include <nic_session/connection.h>
+#include <timer_session/connection.h>
+#include <udp_log/protocol.h>
 
 using namespace Net;
 
@@ -28,8 +30,132 @@ namespace Log_udp {
 	using Nic::Packet_stream_sink;
 	using Nic::Packet_stream_source;
 	using Nic::Packet_descriptor;
+	using Genode::uint16_t;
+	using Genode::uint32_t;
+	using Genode::uint64_t;
 
-	class Receiver;
+	struct Peer;
+	struct Stream;
+	class  Receiver;
+};
+
+
+/**
+ * Sender of datagrams, identified by its IP address and port
+ */
+struct Log_udp::Peer
+{
+	enum { WINDOW = 64 };
+
+	Ipv4_address ip   { };
+	Port         port { 0 };
+	unsigned     age  { 0 };
+	bool         used { false };
+
+	/* next expected datagram and reception bitmap of the preceding ones */
+	uint32_t next     { 0 };
+	uint64_t received { 0 };
+
+	uint64_t datagrams { 0 };
+	uint64_t lost      { 0 };
+	uint64_t recovered { 0 };
+	uint64_t restarts  { 0 };
+
+	enum Result { IN_ORDER, GAP, LATE, DUPLICATE };
+
+	/**
+	 * Account datagram 'seq'
+	 *
+	 * \param retransmit  datagram was sent on request
+	 * \param missing     number of datagrams skipped by a gap
+	 */
+	Result account(uint32_t seq, bool retransmit, uint32_t &missing)
+	{
+		datagrams++;
+
+		Genode::int32_t const d = (Genode::int32_t)(seq - next);
+
+		if (d >= 0 || -d > 4*WINDOW || (seq == 0 && !retransmit)) {
+
+			/* backward jump, the sender was restarted */
+			if (d < 0) {
+				restarts++;
+				received = 0;
+				missing  = 0;
+			} else {
+				missing = (uint32_t)d;
+			}
+
+			received = (missing + 1 >= WINDOW ? 0 : received << (missing + 1)) | 1;
+			next     = seq + 1;
+			lost    += missing;
+			return missing ? GAP : IN_ORDER;
+		}
+
+		/* datagram preceding 'next', possibly a retransmission */
+		unsigned const bit = (unsigned)(-d - 1);
+		if (bit < WINDOW) {
+			if (received & (1ULL << bit))
+				return DUPLICATE;
+			received |= 1ULL << bit;
+		}
+		if (lost) lost--;
+		recovered++;
+		return LATE;
+	}
+};
+
+
+/**
+ * Log lines of one LOG session at a peer
+ */
+struct Log_udp::Stream
+{
+	Ipv4_address ip      { };
+	uint16_t     session { 0 };
+	unsigned     age     { 0 };
+	bool         used    { false };
+
+	uint32_t next     { 0 };
+	uint64_t received { 0 };
+	uint64_t lost     { 0 };
+	uint64_t late     { 0 };
+	uint64_t restarts { 0 };
+
+	/* counters at the time of the last report */
+	uint64_t reported_received { 0 };
+	uint64_t reported_lost     { 0 };
+
+	/**
+	 * Account line 'seq'
+	 *
+	 * \param late_datagram  line is part of a datagram that arrived late
+	 *
+	 * \return true if the line arrived after its successors
+	 */
+	bool account(uint32_t seq, bool late_datagram)
+	{
+		received++;
+
+		Genode::int32_t const d = (Genode::int32_t)(seq - next);
+
+		if (d >= 0) {
+			lost += (uint32_t)d;
+			next  = seq + 1;
+			return false;
+		}
+
+		/* a restarted session starts from zero again */
+		if ((seq == 0 && !late_datagram) || -d > (1 << 16)) {
+			restarts++;
+			next = seq + 1;
+			return false;
+		}
+
+		if (lost) lost--;
+		late++;
+		return true;
+	}
 };
 
 class Log_udp::Receiver
@@ -50,6 +176,18 @@ class Log_udp::Receiver
 		Port const   _port;
 		bool         _verbose { false };
 
+		/* request retransmission of lost datagrams */
+		bool const   _nack;
+
+		enum { MAX_PEERS = 8, MAX_STREAMS = 64 };
+
+		Peer     _peers[MAX_PEERS];
+		Stream   _streams[MAX_STREAMS];
+		unsigned _age { 0 };
+
+		Timer::Connection _timer;
+
+		Genode::Signal_handler<Receiver> _report_handler;
 		Genode::Signal_handler<Receiver> _sink_ack;
 		Genode::Signal_handler<Receiver> _sink_submit;
 		Genode::Signal_handler<Receiver> _source_ack;
@@ -92,6 +230,73 @@ class Log_udp::Receiver
 		Packet_stream_source< ::Nic::Session::Policy> * source() {
 			return _nic.tx(); }
 
+		/**
+		 * Return table entry accepted by 'match'
+		 *
+		 * If there is none, the least recently used entry is replaced by a
+		 * new one set up by 'init'.
+		 */
+		template <typename T, unsigned N, typename MATCH, typename INIT>
+		T &_lookup(T (&table)[N], MATCH const &match, INIT const &init)
+		{
+			T *victim = &table[0];
+			for (T &e : table) {
+				if (e.used && match(e)) {
+					e.age = ++_age;
+					return e;
+				}
+				if (!e.used || (victim->used && e.age < victim->age))
+					victim = &e;
+			}
+
+			*victim = T();
+			victim->used = true;
+			victim->age  = ++_age;
+			init(*victim);
+			return *victim;
+		}
+
+		/**
+		 * Log loss statistics of streams that changed since the last report
+		 */
+		void _report()
+		{
+			for (Stream &s : _streams) {
+				if (!s.used || (s.received == s.reported_received
+				             && s.lost     == s.reported_lost))
+					continue;
+
+				Genode::log("[log_udp] ", s.ip, " session ", s.session, ": ",
+				            s.received - s.reported_received, " lines, ",
+				            s.lost - s.reported_lost, " lost (total ",
+				            s.received, " received, ", s.lost, " lost, ",
+				            s.late, " late, ", s.restarts, " restarts)");
+
+				s.reported_received = s.received;
+				s.reported_lost     = s.lost;
+			}
+
+			for (Peer const &p : _peers) {
+				if (!p.used || !(p.lost || p.recovered || p.restarts))
+					continue;
+
+				Genode::log("[log_udp] ", p.ip, ":", p.port.value, ": ",
+				            p.datagrams, " datagrams, ", p.lost, " lost, ",
+				            p.recovered, " recovered, ", p.restarts, " restarts");
+			}
+		}
+
+		/**
+		 * Ask sender to retransmit 'count' datagrams starting at 'first'
+		 */
+		void _send_nack(Ethernet_frame const &eth, Ipv4_packet const &ip,
+		                Udp_packet const &udp, uint32_t first, uint32_t count);
+
+		void _handle_stream(Ethernet_frame &eth, Ipv4_packet &ip,
+		                    Udp_packet &udp, char const *payload, size_t size);
+
+		void _handle_plain(char const *payload, size_t size);
+
 	public:
 		Receiver(Genode::Env &env, Genode::Allocator &alloc, Xml_node config)
 			:
@@ -100,6 +305,9 @@ class Log_udp::Receiver
 			 _ip     (config.attribute_value("ip",   _default_ip)),
 			 _port   (config.attribute_value("port", _default_port)),
 			 _verbose(config.attribute_value("verbose", _verbose)),
+			 _nack   (config.attribute_value("nack", false)),
+			 _timer(env),
+			 _report_handler(env.ep(), *this, &Receiver::_report),
 			 _sink_ack     (env.ep(), *this, &Receiver::_ack_avail),
 			 _sink_submit  (env.ep(), *this, &Receiver::_ready_to_submit),
 			 _source_ack   (env.ep(), *this, &Receiver::_ready_to_ack),
@@ -109,6 +317,13 @@ class Log_udp::Receiver
 			_nic.rx_channel()->sigh_packet_avail(_sink_submit);
 			_nic.tx_channel()->sigh_ack_avail(_source_ack);
 			_nic.tx_channel()->sigh_ready_to_submit(_source_submit);
+
+			Genode::uint64_t const report_ms =
+				config.attribute_value("report_ms", (Genode::uint64_t)10000);
+			if (report_ms) {
+				_timer.sigh(_report_handler);
+				_timer.trigger_periodic(report_ms * 1000);
+			}
 		}
 
 		/**
@@ -140,11 +355,15 @@ class Log_udp::Receiver
 		/*
 		 * Handle a LOG message packet
 		 *
+		 * \param eth   ethernet frame containing the IP packet.
+		 * \param ip    IP packet containing the UDP packet.
 		 * \param udp   UDP packet containing the LOG message.
 		 * \param size  size guard
 		 */
-		void handle_message(Udp_packet &udp,
-		                    Size_guard &size_guard);
+		void handle_message(Ethernet_frame &eth,
+		                    Ipv4_packet    &ip,
+		                    Udp_packet     &udp,
+		                    Size_guard     &size_guard);
 
 		/**
 		 * Send ethernet frame
@@ -235,25 +454,170 @@ void Log_udp::Receiver::handle_ip(Ethernet_frame &eth,
 	if (ip.protocol() == Ipv4_packet::Protocol::UDP) {
 
 		Udp_packet &udp = ip.data<Udp_packet>(size_guard);
-		if (udp.dst_port() == Port(9))
-			handle_message(udp, size_guard);
+		if (udp.dst_port() == _port)
+			handle_message(eth, ip, udp, size_guard);
 	}
 }
 
-void Log_udp::Receiver::handle_message(Udp_packet &udp,
-                                       Size_guard &size_guard)
+void Log_udp::Receiver::handle_message(Ethernet_frame &eth,
+                                       Ipv4_packet    &ip,
+                                       Udp_packet     &udp,
+                                       Size_guard     &size_guard)
 {
+	/* accessing the data consumes its first byte */
 	char *msg = &udp.data<char>(size_guard);
 
-	/* consume until '\0' */
-	size_t len = 0;
-	for (char* s=msg; s && *s; s++, len++) {
+	size_t const size = Genode::min(size_guard.unconsumed() + 1,
+	                                (size_t)udp.length() - sizeof(Udp_packet));
+
+	Udp_log::Protocol::Datagram_header const &header =
+		*(Udp_log::Protocol::Datagram_header const *)msg;
+
+	if (size >= sizeof(header) && header.valid())
+		_handle_stream(eth, ip, udp, msg, size);
+	else
+		_handle_plain(msg, size);
+}
+
+void Log_udp::Receiver::_handle_plain(char const *msg, size_t size)
+{
+	/* a datagram carries one or more lines, each terminated by '\0' */
+	for (size_t pos = 0; pos < size; ) {
+		size_t len = 0;
+		while (pos + len < size && msg[pos + len])
+			len++;
+
+		/* strip the trailing newline */
 		if (len)
-			size_guard.consume_head(1);
+			Genode::log(Genode::Cstring(&msg[pos],
+			                            msg[pos + len - 1] == '\n' ? len - 1 : len));
+
+		pos += len + 1;
 	}
+}
+
+void Log_udp::Receiver::_handle_stream(Ethernet_frame &eth, Ipv4_packet &ip,
+                                       Udp_packet &udp, char const *msg,
+                                       size_t size)
+{
+	using namespace Udp_log::Protocol;
+
+	Datagram_header const &header = *(Datagram_header const *)msg;
+
+	/* retransmission requests are meant for the sender */
+	if (header.flags() & Datagram_header::NACK)
+		return;
+
+	Ipv4_address const src_ip   = ip.src();
+	Port         const src_port = udp.src_port();
 
-	if (len)
-		Genode::log(Genode::Cstring(msg, len-1));
+	Peer &peer = _lookup(_peers,
+		[&] (Peer const &p) { return p.ip == src_ip && p.port == src_port; },
+		[&] (Peer &p) { p.ip = src_ip; p.port = src_port; p.next = header.seq(); });
+
+	bool const retransmit = header.flags() & Datagram_header::RETRANSMIT;
+
+	uint32_t missing = 0;
+	Peer::Result const result = peer.account(header.seq(), retransmit, missing);
+
+	switch (result) {
+	case Peer::DUPLICATE:
+		return;
+	case Peer::GAP:
+		if (_nack)
+			_send_nack(eth, ip, udp, header.seq() - missing, missing);
+		break;
+	default:
+		break;
+	}
+
+	for (size_t pos = sizeof(Datagram_header);
+	     pos + sizeof(Line_header) <= size; ) {
+
+		Line_header const &line = *(Line_header const *)&msg[pos];
+		size_t const len = Genode::min((size_t)line.length(),
+		                               size - pos - sizeof(Line_header));
+		pos += sizeof(Line_header) + len;
+
+		uint16_t const session = line.session();
+		Stream &stream = _lookup(_streams,
+			[&] (Stream const &s) { return s.ip == src_ip && s.session == session; },
+			[&] (Stream &s) { s.ip = src_ip; s.session = session; s.next = line.seq(); });
+
+		bool const late = stream.account(line.seq(), result == Peer::LATE);
+
+		/* strip the trailing newline */
+		size_t const n = (len && line.text()[len - 1] == '\n') ? len - 1 : len;
+
+		if (_verbose)
+			Genode::log(late ? "(late) " : "", "#", line.seq(), " ",
+			            line.time_ms(), "ms ", Genode::Cstring(line.text(), n));
+		else if (late)
+			Genode::log("(late) ", Genode::Cstring(line.text(), n));
+		else
+			Genode::log(Genode::Cstring(line.text(), n));
+	}
+}
+
+void Log_udp::Receiver::_send_nack(Ethernet_frame const &eth,
+                                   Ipv4_packet const &ip,
+                                   Udp_packet const &udp,
+                                   uint32_t first, uint32_t count)
+{
+	using Udp_log::Protocol::Nack;
+
+	enum {
+		HDR_SZ      = sizeof(Ethernet_frame) + sizeof(Ipv4_packet) + sizeof(Udp_packet),
+		PACKET_SIZE = HDR_SZ + sizeof(Nack) < Ethernet_frame::MIN_SIZE
+		            ? Ethernet_frame::MIN_SIZE : HDR_SZ + sizeof(Nack),
+	};
+
+	/* datagrams older than the sender's window cannot be recovered anyway */
+	if (count > Peer::WINDOW) {
+		first += count - Peer::WINDOW;
+		count  = Peer::WINDOW;
+	}
+
+	if (!source()->ready_to_submit())
+		return;
+
+	try {
+		Packet_descriptor packet = source()->alloc_packet(PACKET_SIZE);
+		void             *base   = source()->packet_content(packet);
+		Genode::memset(base, 0, PACKET_SIZE);
+		Size_guard size_guard(PACKET_SIZE);
+
+		Ethernet_frame &reply_eth = Ethernet_frame::construct_at(base, size_guard);
+		reply_eth.dst(eth.src());
+		reply_eth.src(_mac);
+		reply_eth.type(Ethernet_frame::Type::IPV4);
+
+		enum { IPV4_TIME_TO_LIVE = 64 };
+		size_t const ip_off = size_guard.head_size();
+		Ipv4_packet &reply_ip = reply_eth.construct_at_data<Ipv4_packet>(size_guard);
+		reply_ip.header_length(sizeof(Ipv4_packet) / 4);
+		reply_ip.version(4);
+		reply_ip.time_to_live(IPV4_TIME_TO_LIVE);
+		reply_ip.protocol(Ipv4_packet::Protocol::UDP);
+		reply_ip.src(_ip);
+		reply_ip.dst(ip.src());
+
+		size_t const udp_off = size_guard.head_size();
+		Udp_packet &reply_udp = reply_ip.construct_at_data<Udp_packet>(size_guard);
+		reply_udp.src_port(_port);
+		reply_udp.dst_port(udp.src_port());
+
+		reply_udp.data<Nack>(size_guard).init(first, (uint16_t)count);
+
+		reply_udp.length(size_guard.head_size() - udp_off);
+		reply_udp.update_checksum(reply_ip.src(), reply_ip.dst());
+		reply_ip.total_length(size_guard.head_size() - ip_off);
+		reply_ip.update_checksum();
+
+		source()->submit_packet(packet);
+	} catch(Packet_stream_source< ::Nic::Session::Policy>::Packet_alloc_failed) {
+		Genode::warning("NACK dropped");
+	}
 }
 
 void Log_udp::Receiver::send(Ethernet_frame *eth, Genode::size_t size)
@@ -23,127 +23,614 @@
 #include <base/heap.h>
 #include <base/service.h>
 #include <base/session_label.h>
+#include <dataspace/client.h>
+#include <rm_session/connection.h>
+#include <region_map/client.h>
 #include <libc/component.h>
 #include <base/log.h>
+#include <util/arg_string.h>
+#include <util/list.h>
+#include <util/reconstructible.h>
 
 namespace Rom_hash {
 	using namespace Genode;
 
+	struct Cache_entry;
+	struct Cache;
+	struct Merkle_rom;
+	struct Verified_rom;
 	struct Session;
 	struct Main;
 
 	typedef Session_state::Args Args;
+
+	typedef String<32>  Algorithm;
+	typedef String<160> Digest;
+
+	/* amount of data passed to the hash function at once */
+	enum { HASH_CHUNK_SIZE = 1 << 20 };
+
+	/*
+	 * Quota forwarded to the parent for the ROM session of a Merkle-verified
+	 * ROM, the remainder of the client's donation pays the region metadata
+	 */
+	enum { MERKLE_ROM_SESSION_RAM = 6*1024 };
+
+	/* estimated RM-session metadata per attached chunk */
+	enum { RM_RAM_PER_CHUNK = 256 };
+
+	static std::string decode_hex(char const *hex, size_t len)
+	{
+		using namespace CryptoPP;
+
+		std::string bin;
+		HexDecoder decoder;
+
+		decoder.Put((byte*)hex, len);
+		decoder.MessageEnd();
+
+		bin.resize(decoder.MaxRetrievable());
+		decoder.Get((byte*)bin.data(), bin.size());
+		return bin;
+	}
 }
 
 
-struct Rom_hash::Session :
-	Genode::Parent::Server,
-	Genode::Connection<Rom_session>
+/**
+ * Result of a successful verification
+ *
+ * Entries are keyed by the verified dataspace. Holding its capability
+ * keeps the capability from being reused for another dataspace while the
+ * entry exists.
+ */
+struct Rom_hash::Cache_entry : List<Cache_entry>::Element
 {
-	Parent::Client parent_client;
-
-	Id_space<Parent::Client>::Element client_id;
-	Id_space<Parent::Server>::Element server_id;
+	Dataspace_capability const ds;
+	Algorithm            const algorithm;
+	Digest               const digest;
 
-	void verify(Session_label const &label,
-	            CryptoPP::HashTransformation &hash,
-	            Genode::Xml_attribute &attr);
+	Cache_entry(Dataspace_capability ds, Algorithm const &algorithm,
+	            Digest const &digest)
+	: ds(ds), algorithm(algorithm), digest(digest) { }
 
-	Session(Id_space<Parent::Client> &client_space,
-	        Id_space<Parent::Server> &server_space,
-	        Parent::Server::Id server_id,
-	        Genode::Env &env,
-	        Session_label  const &label,
-	        Session_policy const &policy,
-	        Args           const &args);
+	bool matches(Dataspace_capability d, Algorithm const &a,
+	             Digest const &h) const
+	{
+		return ds == d && algorithm == a && digest == h;
+	}
 };
 
 
-void Rom_hash::Session::verify(Session_label const &label,
-                               CryptoPP::HashTransformation &hash,
-                               Genode::Xml_attribute &attr)
+struct Rom_hash::Cache
 {
-	using namespace CryptoPP;
+	enum { MAX_ENTRIES = 16 };
+
+	Allocator &alloc;
+
+	List<Cache_entry> entries { };
+	unsigned          count   { 0 };
 
-	std::string const hex_target(attr.value_base(), attr.value_size());
-	std::string bin_target;
+	Cache(Allocator &alloc) : alloc(alloc) { }
+
+	~Cache()
 	{
-		HexDecoder decoder;
+		while (Cache_entry *e = entries.first())
+			_remove(*e);
+	}
 
-		decoder.Put((byte*)hex_target.data(), hex_target.size());
-		decoder.MessageEnd();
+	void _remove(Cache_entry &e)
+	{
+		entries.remove(&e);
+		destroy(alloc, &e);
+		count--;
+	}
+
+	bool verified(Dataspace_capability ds, Algorithm const &algorithm,
+	              Digest const &digest)
+	{
+		for (Cache_entry *e = entries.first(); e; e = e->next())
+			if (e->matches(ds, algorithm, digest))
+				return true;
+		return false;
+	}
+
+	/**
+	 * Add entry, replacing the oldest entry beyond 'MAX_ENTRIES'
+	 */
+	void insert(Dataspace_capability ds, Algorithm const &algorithm,
+	            Digest const &digest)
+	{
+		if (count >= MAX_ENTRIES) {
+			Cache_entry *last = entries.first();
+			while (last->next())
+				last = last->next();
+			_remove(*last);
+		}
+
+		entries.insert(new (alloc) Cache_entry(ds, algorithm, digest));
+		count++;
+	}
+
+	/**
+	 * Drop all entries of a dataspace whose ROM has changed
+	 */
+	void invalidate(Dataspace_capability ds)
+	{
+		for (Cache_entry *e = entries.first(); e; ) {
+			Cache_entry *next = e->next();
+			if (e->ds == ds)
+				_remove(*e);
+			e = next;
+		}
+	}
+};
+
+
+/**
+ * ROM whose content is verified lazily in chunks against a Merkle tree
+ *
+ * The policy carries the root of a binary SHA-256 tree over the ROM
+ * content, zero-padded to a multiple of the chunk size. A leaf is the hash
+ * of 0x00 followed by a chunk, an inner node is the hash of 0x01 followed
+ * by its two children. The last node of a level with an odd number of
+ * nodes is promoted unchanged. The leaves are read from a companion ROM
+ * and checked against the root when the session is created.
+ *
+ * The client gets a managed dataspace that is initially empty. On the
+ * first access to a chunk, the chunk is hashed and, if it matches its leaf,
+ * the corresponding part of the original ROM dataspace is attached. An
+ * access to a chunk that does not match stays unresolved.
+ *
+ * Verified chunks are attached as executable so that the ROM may contain
+ * program text. Whether the client can execute it is still decided by the
+ * client's own attachment of the managed dataspace.
+ *
+ * The RM session is upgraded by the metadata needed for all chunks up
+ * front. The upgrade is paid from the part of the client's donation that
+ * is not forwarded to the parent. A donation too small to cover it, like
+ * the one of a child's binary ROM, is complemented by rom_verify.
+ */
+struct Rom_hash::Merkle_rom : Rpc_object<Rom_session>
+{
+	typedef CryptoPP::SHA256 Hash;
+
+	enum { DIGEST_SIZE = Hash::DIGESTSIZE };
+
+	Env &_env;
+
+	Session_label const _label;
+
+	Dataspace_capability const _rom_ds;
+	size_t               const _rom_size;
+	Attached_dataspace         _rom { _env.rm(), _rom_ds };
 
-		bin_target.resize(decoder.MaxRetrievable());
-		decoder.Get((byte*)bin_target.data(), bin_target.size());
+	size_t const _chunk_size;
+	size_t const _chunks = (_rom_size + _chunk_size - 1) / _chunk_size;
+
+	Attached_rom_dataspace _leaves;
+
+	Rm_connection     _rm { _env };
+	Region_map_client _map { _rm.create(_chunks*_chunk_size) };
+
+	Signal_handler<Merkle_rom> _fault_handler {
+		_env.ep(), *this, &Merkle_rom::_handle_fault };
+
+	Heap   _heap { _env.ram(), _env.rm() };
+	bool  *_verified { new (_heap) bool[_chunks] { } };
+
+	size_t _verified_chunks = 0;
+
+	uint8_t const *_leaf(size_t i) const {
+		return _leaves.local_addr<uint8_t const>() + i*DIGEST_SIZE; }
+
+	bool _verify_chunk(size_t i)
+	{
+		static uint8_t const zeros[4096] { };
+		static uint8_t const leaf_prefix = 0;
+
+		size_t const off = i*_chunk_size;
+		size_t const len = min(_chunk_size, _rom_size - off);
+
+		uint8_t digest[DIGEST_SIZE];
+		Hash hash;
+		hash.Update(&leaf_prefix, 1);
+		hash.Update(_rom.local_addr<uint8_t const>() + off, len);
+		for (size_t pad = _chunk_size - len; pad; ) {
+			size_t const n = min(pad, sizeof(zeros));
+			hash.Update(zeros, n);
+			pad -= n;
+		}
+		hash.Final(digest);
+
+		return memcmp(digest, _leaf(i), DIGEST_SIZE) == 0;
 	}
-	log(label, " ", hex_target.c_str());
 
-	unsigned const digest_size = hash.DigestSize();
-	uint8_t digest[digest_size];
+	void _handle_fault()
+	{
+		Region_map::State const state = _map.state();
+		if (state.type == Region_map::State::READY)
+			return;
+
+		size_t const i = state.addr / _chunk_size;
 
-	/* read the connection dataspace */
-	Rom_session_client rom(cap());
-	Attached_dataspace ds(_env.rm(), rom.dataspace());
+		/* instruction fetches are resolved like reads, ROMs are never written */
+		bool const read = state.type == Region_map::State::READ_FAULT
+		               || state.type == Region_map::State::EXEC_FAULT;
 
-	Genode::log("'", ds.local_addr<const char>(), "'");
+		/* accesses beyond the end of the ROM hit verified chunks */
+		if (!read || i >= _chunks || _verified[i]) {
+			error(_label, ": invalid access at ", Hex(state.addr));
+			return;
+		}
 
-	hash.CalculateDigest(digest, ds.local_addr<const byte>(), ds.size());
+		if (!_verify_chunk(i)) {
+			error(_label, ": chunk ", i, " does not match its Merkle leaf");
+			return;
+		}
 
-	for (unsigned i = 0; i < bin_target.size(); ++i) {
-		if ((uint8_t)digest[i] != (uint8_t)bin_target[i]) {
-			Genode::log("mismatch at index ", i);
-			std::string encoded;
-			HexEncoder encoder;
-			encoder.Put((byte*)digest, digest_size);
-			encoded.resize(encoder.MaxRetrievable());
-			encoder.Get((byte*)encoded.data(), encoded.size());
+		/*
+		 * The RM session is sized for all chunks at construction, the
+		 * upgrades are merely a safety net against a low estimate
+		 */
+		size_t const off = i*_chunk_size;
+		try {
+			retry<Out_of_ram>(
+				[&] () {
+					retry<Out_of_caps>(
+						[&] () {
+							_map.attach_executable(_rom_ds, off,
+							                       min(_chunk_size, _rom_size - off), off); },
+						[&] () { _rm.upgrade_caps(2); });
+				},
+				[&] () { _rm.upgrade_ram(RM_RAM_PER_CHUNK*16); });
+		} catch (...) {
+			error(_label, ": could not attach chunk ", i);
+			return;
+		}
+		_verified[i] = true;
+
+		if (++_verified_chunks == _chunks)
+			log(_label, ": all ", _chunks, " chunks verified");
+	}
 
-			error(label, " ", encoded.c_str());
+	/**
+	 * Check the leaves against the root
+	 */
+	bool _verify_tree(std::string const &root)
+	{
+		if (root.size() != DIGEST_SIZE
+		 || _leaves.size() < _chunks*DIGEST_SIZE)
+			return false;
+
+		static uint8_t const node_prefix = 1;
+
+		/* compute the tree level by level in place */
+		uint8_t *level = (uint8_t *)_heap.alloc(_chunks*DIGEST_SIZE);
+		memcpy(level, _leaf(0), _chunks*DIGEST_SIZE);
+
+		for (size_t n = _chunks; n > 1; n = (n + 1) / 2) {
+			for (size_t i = 0; i < n / 2; i++) {
+				Hash hash;
+				hash.Update(&node_prefix, 1);
+				hash.Update(level + 2*i*DIGEST_SIZE, 2*DIGEST_SIZE);
+				hash.Final(level + i*DIGEST_SIZE);
+			}
+			if (n & 1)
+				memmove(level + (n/2)*DIGEST_SIZE, level + (n - 1)*DIGEST_SIZE,
+				        DIGEST_SIZE);
+		}
+
+		bool const match = memcmp(level, root.data(), DIGEST_SIZE) == 0;
+		_heap.free(level, _chunks*DIGEST_SIZE);
+		return match;
+	}
+
+	/**
+	 * Constructor
+	 *
+	 * \param rm_ram  part of the client's donation available for the
+	 *                region metadata
+	 */
+	Merkle_rom(Env &env, Session_label const &label,
+	           Dataspace_capability rom_ds, Xml_attribute &root_attr,
+	           Session_policy const &policy, size_t rm_ram)
+	:
+		_env(env), _label(label), _rom_ds(rom_ds),
+		_rom_size(Dataspace_client(rom_ds).size()),
+		_chunk_size(align_addr(max(policy.attribute_value("chunk_size", 0x10000UL),
+		                           0x1000UL), 12)),
+		_leaves(env, policy.attribute_value("merkle_rom",
+		                                    Session_label(label.last_element(),
+		                                                  ".merkle")).string())
+	{
+		if (!_rom_size || !_verify_tree(decode_hex(root_attr.value_base(),
+		                                           root_attr.value_size()))) {
+			error(label, ": Merkle tree does not match its root");
 			throw Service_denied();
 		}
+
+		size_t const rm_quota = _chunks*RM_RAM_PER_CHUNK;
+		if (rm_ram < rm_quota)
+			warning(label, ": session quota lacks ", rm_quota - rm_ram,
+			        " bytes for region metadata");
+
+		_rm.upgrade_ram(rm_quota);
+
+		_map.fault_handler(_fault_handler);
+		_env.ep().manage(*this);
+
+		log(label, ": ", _chunks, " chunks verified on demand");
 	}
-}
+
+	~Merkle_rom() { _env.ep().dissolve(*this); }
+
+
+	/***************************
+	 ** ROM session interface **
+	 ***************************/
+
+	Rom_dataspace_capability dataspace() override {
+		return static_cap_cast<Rom_dataspace>(_map.dataspace()); }
+
+	/* the content is static, updates are not supported */
+	void sigh(Signal_context_capability) override { }
+};
+
+
+/**
+ * ROM whose content is verified against a hash
+ *
+ * The client's requests are forwarded to the ROM session at the parent.
+ * Each dataspace obtained from the parent is hashed before it is handed
+ * out, unless the cache holds a verification of the same dataspace. The
+ * proxy installs its own signal handler at the parent's session. A change
+ * of the ROM invalidates the cache entries of the current dataspace and
+ * is forwarded to the client. Updates in place are not supported, so the
+ * client always obtains a new dataspace, which is verified again.
+ */
+struct Rom_hash::Verified_rom : Rpc_object<Rom_session>
+{
+	Env   &_env;
+	Cache &_cache;
+
+	Session_label const _label;
+	Algorithm     const _algorithm;
+	Digest        const _digest;
+
+	Rom_session_client _rom;
+
+	/* verified dataspace, invalid after a change of the ROM */
+	Dataspace_capability _ds { };
+
+	Signal_context_capability _client_sigh { };
+
+	void _handle_changed()
+	{
+		if (_ds.valid())
+			_cache.invalidate(_ds);
+
+		_ds = Dataspace_capability();
+
+		if (_client_sigh.valid())
+			Signal_transmitter(_client_sigh).submit();
+	}
+
+	Signal_handler<Verified_rom> _changed_handler {
+		_env.ep(), *this, &Verified_rom::_handle_changed };
+
+	template <typename FN>
+	void _with_hash(FN const &fn)
+	{
+		if (_algorithm == "sha3") {
+			CryptoPP::SHA3 hash((_digest.length() - 1)/2);
+			fn(hash);
+		} else if (_algorithm == "sha512") {
+			CryptoPP::SHA512 hash;
+			fn(hash);
+		} else if (_algorithm == "sha256") {
+			CryptoPP::SHA256 hash;
+			fn(hash);
+		} else {
+			CryptoPP::SHA1 hash;
+			fn(hash);
+		}
+	}
+
+	bool _verify(Dataspace_capability ds_cap)
+	{
+		using namespace CryptoPP;
+
+		if (_cache.verified(ds_cap, _algorithm, _digest))
+			return true;
+
+		std::string const bin_target =
+			decode_hex(_digest.string(), _digest.length() - 1);
+
+		bool match = false;
+
+		_with_hash([&] (HashTransformation &hash) {
+
+			unsigned const digest_size = hash.DigestSize();
+			uint8_t digest[digest_size];
+
+			{
+				Attached_dataspace ds(_env.rm(), ds_cap);
+				size_t const size = ds.size();
+
+				/*
+				 * Large chunks let the hash use its multi-block
+				 * implementation with as few calls as possible.
+				 */
+				byte const *data = ds.local_addr<const byte>();
+				for (size_t off = 0; off < size; off += HASH_CHUNK_SIZE)
+					hash.Update(data + off, min((size_t)HASH_CHUNK_SIZE, size - off));
+
+				hash.Final(digest);
+			}
+
+			match = bin_target.size() == digest_size;
+			for (unsigned i = 0; match && i < digest_size; ++i) {
+				if ((uint8_t)digest[i] != (uint8_t)bin_target[i]) {
+					Genode::log("mismatch at index ", i);
+					match = false;
+				}
+			}
+
+			if (!match) {
+				std::string encoded;
+				HexEncoder encoder;
+				encoder.Put((byte*)digest, digest_size);
+				encoded.resize(encoder.MaxRetrievable());
+				encoder.Get((byte*)encoded.data(), encoded.size());
+
+				error(_label, " ", encoded.c_str());
+			}
+		});
+
+		if (!match)
+			return false;
+
+		_cache.insert(ds_cap, _algorithm, _digest);
+		log(_label, " ", _digest);
+		return true;
+	}
+
+	Verified_rom(Env &env, Cache &cache, Session_label const &label,
+	             Algorithm const &algorithm, Digest const &digest,
+	             Capability<Rom_session> rom)
+	:
+		_env(env), _cache(cache), _label(label), _algorithm(algorithm),
+		_digest(digest), _rom(rom)
+	{
+		_rom.sigh(_changed_handler);
+		_env.ep().manage(*this);
+	}
+
+	~Verified_rom() { _env.ep().dissolve(*this); }
+
+	/**
+	 * Obtain and verify the current dataspace of the ROM
+	 *
+	 * \return false if the content does not match the digest
+	 */
+	bool fetch()
+	{
+		if (_ds.valid())
+			return true;
+
+		Dataspace_capability const ds = _rom.dataspace();
+		if (!ds.valid() || !_verify(ds))
+			return false;
+
+		_ds = ds;
+		return true;
+	}
+
+
+	/***************************
+	 ** ROM session interface **
+	 ***************************/
+
+	Rom_dataspace_capability dataspace() override
+	{
+		if (!fetch())
+			return Rom_dataspace_capability();
+
+		return static_cap_cast<Rom_dataspace>(_ds);
+	}
+
+	void sigh(Signal_context_capability sigh) override { _client_sigh = sigh; }
+};
+
+
+struct Rom_hash::Session :
+	Genode::Parent::Server,
+	Genode::Connection<Rom_session>
+{
+	Parent::Client parent_client;
+
+	Id_space<Parent::Client>::Element client_id;
+	Id_space<Parent::Server>::Element server_id;
+
+	Constructible<Merkle_rom>   merkle   { };
+	Constructible<Verified_rom> verified { };
+
+	/**
+	 * Arguments of the ROM session at the parent
+	 *
+	 * For a Merkle-verified ROM, only a fixed amount of the client's
+	 * donation is passed on, the remainder is kept for the region metadata.
+	 */
+	static Args _parent_args(Session_policy const &policy, Args const &args)
+	{
+		if (!policy.has_attribute("merkle"))
+			return args;
+
+		char buf[Args::capacity()];
+		copy_cstring(buf, args.string(), sizeof(buf));
+		Arg_string::set_arg(buf, sizeof(buf), "ram_quota",
+		                    (int)MERKLE_ROM_SESSION_RAM);
+		return Args(Cstring(buf));
+	}
+
+	/**
+	 * Capability handed out to the client
+	 */
+	Capability<Rom_session> rom_cap() {
+		return merkle.constructed() ? merkle->cap() : verified->cap(); }
+
+	Session(Id_space<Parent::Client> &client_space,
+	        Id_space<Parent::Server> &server_space,
+	        Parent::Server::Id server_id,
+	        Genode::Env &env,
+	        Cache &cache,
+	        Session_label  const &label,
+	        Session_policy const &policy,
+	        Args           const &args);
+};
 
 
 Rom_hash::Session::Session(Id_space<Parent::Client> &client_space,
                            Id_space<Parent::Server> &server_space,
                            Parent::Server::Id server_id,
                            Genode::Env &env,
+                           Cache &cache,
                            Session_label  const &label,
                            Session_policy const &policy,
                            Args           const &args)
 :
-	Connection<Rom_session>(env, session(env.parent(), args.string())),
+	Connection<Rom_session>(env, session(env.parent(),
+	                                     _parent_args(policy, args).string())),
 	client_id(parent_client, client_space),
 	server_id(*this, server_space, server_id)
 {
 	try {
-		Xml_attribute attr = policy.attribute("sha3");
-		CryptoPP::SHA3 hash(attr.value_size()/2);
-		verify(label, hash, attr);
-		return;
-	} catch (Xml_node::Nonexistent_attribute) { }
+		Xml_attribute attr = policy.attribute("merkle");
 
-	try {
-		Xml_attribute attr = policy.attribute("sha512");
-		CryptoPP::SHA512 hash;
-		verify(label, hash, attr);
-		return;
-	} catch (Xml_node::Nonexistent_attribute) { }
+		size_t const ram_quota =
+			Arg_string::find_arg(args.string(), "ram_quota").ulong_value(0);
+		size_t const rm_ram = ram_quota > MERKLE_ROM_SESSION_RAM
+		                    ? ram_quota - MERKLE_ROM_SESSION_RAM : 0;
 
-	try {
-		Xml_attribute attr = policy.attribute("sha256");
-		CryptoPP::SHA256 hash;
-		verify(label, hash, attr);
+		merkle.construct(env, label, Rom_session_client(cap()).dataspace(),
+		                 attr, policy, rm_ram);
 		return;
 	} catch (Xml_node::Nonexistent_attribute) { }
 
-	try {
-		Xml_attribute attr = policy.attribute("sha1");
-		CryptoPP::SHA1 hash;
-		verify(label, hash, attr);
+	static char const *algorithms[] = { "sha3", "sha512", "sha256", "sha1" };
+
+	for (char const *algorithm : algorithms) {
+		if (!policy.has_attribute(algorithm))
+			continue;
+
+		verified.construct(env, cache, label, Algorithm(algorithm),
+		                   policy.attribute_value(algorithm, Digest()), cap());
+
+		if (!verified->fetch())
+			throw Service_denied();
+
 		return;
-	} catch (Xml_node::Nonexistent_attribute) { }
+	}
 
 	error("no hash policy found");
 	throw Service_denied();
@@ -162,6 +649,10 @@ struct Rom_hash::Main
 
 	Sliced_heap alloc { env.ram(), env.rm() };
 
+	Heap heap { env.ram(), env.rm() };
+
+	Cache cache { heap };
+
 	bool config_stale = false;
 
 	void handle_config() {
@@ -223,9 +714,10 @@ void Rom_hash::Main::handle_session_request(Xml_node request)
 			Session_policy const policy(label, config_rom.xml());
 
 			Session *session = new (alloc)
-				Session(env.id_space(), server_id_space, server_id, env, label, policy, args);
+				Session(env.id_space(), server_id_space, server_id, env, cache,
+				        label, policy, args);
 			if (session) {
-				env.parent().deliver_session_cap(server_id, session->cap());
+				env.parent().deliver_session_cap(server_id, session->rom_cap());
 				return;
 			}
 			return;
@@ -12,11 +12,15 @@
  */
 
 #include <base/log.h>
+#include <base/allocator.h>
 #include <util/xml_node.h>
+#include <util/string.h>
 
 #include <net/udp.h>
 #include <nic/packet_allocator.h>
 #include <nic_session/connection.h>
+#include <timer_session/connection.h>
+#include <udp_log/protocol.h>
 
 using namespace Net;
 
@@ -24,36 +28,146 @@ namespace Udp_log {
 	using Genode::size_t;
 	using Genode::Xml_node;
 	using Nic::Packet_stream_source;
+	using Nic::Packet_stream_sink;
 	using Nic::Packet_descriptor;
 
-	class Payload;
+	struct Destination;
+	struct Stream;
+	class  Datagram;
 	template <typename MSG, typename PREFIX> class Logger;
 };
 
-class Udp_log::Payload
+
+struct Udp_log::Destination
+{
+	Ipv4_address ip   { };
+	Port         port { 0 };
+	Mac_address  mac  { };
+
+	bool operator == (Destination const &other) const {
+		return ip == other.ip && port == other.port && mac == other.mac; }
+};
+
+
+/**
+ * Sequence-numbered stream of log lines, e.g., of one LOG session
+ */
+struct Udp_log::Stream
+{
+	Genode::uint16_t const id;
+	Genode::uint32_t       seq { 0 };
+
+	Stream(Genode::uint16_t id) : id(id) { }
+};
+
+
+/**
+ * UDP payload of coalesced log lines
+ *
+ * In the 'stream' format, the payload starts with a 'Datagram_header'
+ * and each line is preceded by a 'Line_header' that carries its session,
+ * sequence number, and timestamp. In the 'plain' format, each line is
+ * merely terminated by a '\0' character, which lets simple receivers such
+ * as netcat split the datagram into lines again.
+ */
+class Udp_log::Datagram
 {
+	public:
+
+		enum { MAX_PAYLOAD = 1500 - sizeof(Ipv4_packet) - sizeof(Udp_packet) };
+
 	private:
-		char             _data[0];
+
+		Destination _dst      { };
+		bool        _stream   { false };
+		size_t      _capacity { 0 };
+		size_t      _length   { 0 };
+		unsigned    _lines    { 0 };
+		char        _data[MAX_PAYLOAD];
+
+		Protocol::Datagram_header &_header() {
+			return *(Protocol::Datagram_header *)_data; }
+
+		size_t _line_overhead() const {
+			return _stream ? sizeof(Protocol::Line_header) : 1; }
 
 	public:
 
-		void set(char const *p, size_t plen, char const *s, size_t len, Size_guard &size_guard)
+		Datagram() { }
+
+		void reset(Destination const &dst, size_t capacity, bool stream)
 		{
-			/* write prefix */
-			size_guard.consume_head(plen);
-			Genode::memcpy(_data, p, plen);
+			_dst      = dst;
+			_stream   = stream;
+			_capacity = Genode::min(capacity, (size_t)MAX_PAYLOAD);
+			_length   = stream ? sizeof(Protocol::Datagram_header) : 0;
+			_lines    = 0;
+		}
+
+		bool   empty()  const { return _lines == 0; }
+		bool   stream() const { return _stream; }
+		size_t length() const { return _length; }
+		unsigned lines() const { return _lines; }
+		char const *data() const { return _data; }
+		Destination const &dst() const { return _dst; }
+
+		Genode::uint32_t seq() const {
+			return ((Protocol::Datagram_header const *)_data)->seq(); }
 
-			/* write string */
-			size_guard.consume_head(len);
-			Genode::memcpy(&_data[plen], s, len);
+		bool fits(size_t len) const {
+			return _length + _line_overhead() + len <= _capacity; }
 
-			/* zero-out unconsumed data */
-			size_t const unconsumed = size_guard.unconsumed();
-			size_guard.consume_head(unconsumed);
-			Genode::memset(&_data[plen+len], 0, unconsumed);
+		/**
+		 * Append line composed of 'prefix' and 'string'
+		 *
+		 * Lines that exceed an empty datagram are truncated.
+		 */
+		void append(Stream &stream, Genode::uint32_t time_ms,
+		            char const *prefix, size_t plen, char const *s, size_t len)
+		{
+			Protocol::Line_header *line = nullptr;
+			if (_stream) {
+				line = (Protocol::Line_header *)&_data[_length];
+				_length += sizeof(Protocol::Line_header);
+			}
+
+			size_t const avail = _capacity - _length - (_stream ? 0 : 1);
+
+			plen = Genode::min(plen, avail);
+			Genode::memcpy(&_data[_length], prefix, plen);
+			_length += plen;
+
+			len = Genode::min(len, avail - plen);
+			Genode::memcpy(&_data[_length], s, len);
+			_length += len;
+
+			if (line)
+				line->init(stream.id, stream.seq, time_ms,
+				           (Genode::uint16_t)(plen + len));
+			else
+				_data[_length++] = 0;
+
+			stream.seq++;
+			_lines++;
+		}
+
+		/**
+		 * Write datagram header, called once the datagram is complete
+		 */
+		void seal(Genode::uint32_t seq)
+		{
+			if (_stream)
+				_header().init(seq, 0);
+		}
+
+		void mark_retransmit()
+		{
+			if (_stream)
+				_header().flags(Protocol::Datagram_header::RETRANSMIT);
 		}
 };
 
+
 template <typename MSG, typename PREFIX>
 class Udp_log::Logger
 {
@@ -63,6 +177,11 @@ class Udp_log::Logger
 			BUF_SIZE = Nic::Session::QUEUE_SIZE * PACKET_SIZE
 		};
 
+		enum { MAX_DESTINATIONS = 4 };
+
+		/* smallest MTU that leaves room for the stream headers and a line */
+		enum { MIN_MTU = 128 };
+
 		Ipv4_address const _default_ip_address  { (Genode::uint8_t)0x00 };
 
 		Nic::Packet_allocator _tx_block_alloc;
@@ -75,8 +194,70 @@ class Udp_log::Logger
 		bool         _verbose { false };
 		bool         _chksum_offload { false };
 
+		/* send sequence-numbered 'stream' format instead of 'plain' lines */
+		bool const   _stream_format;
+
+		/* stream of notices generated by the logger itself */
+		Stream       _own_stream { 0 };
+
+		/* payload capacity of a datagram, derived from the MTU */
+		size_t const _payload_size;
+
+		/* time a message may wait for being coalesced with others */
+		Genode::uint64_t const _flush_us;
+
+		Timer::Connection _timer;
+		bool              _flush_armed { false };
+
+		/* datagrams collecting messages, one per destination */
+		Datagram _open[MAX_DESTINATIONS];
+
+		/*
+		 * Datagram sequence numbers, counted per destination
+		 *
+		 * The sequence of a destination survives the eviction of its
+		 * open datagram. Only if more destinations are in use than the
+		 * table holds, the least recently used one is forgotten and
+		 * starts anew at 0.
+		 */
+		enum { MAX_SEQUENCES = 32 };
+
+		struct Sequence
+		{
+			Destination      dst  { };
+			Genode::uint32_t next { 0 };
+			Genode::uint64_t used { 0 };  /* 0 if slot was never used */
+		};
+
+		Sequence         _sequences[MAX_SEQUENCES] { };
+		Genode::uint64_t _sequence_clock { 0 };
+
+		/*
+		 * Completed datagrams that could not be submitted yet because
+		 * the submit queue was full
+		 */
+		unsigned const  _backlog_size;
+		Datagram       *_backlog;
+		unsigned        _backlog_head  { 0 };
+		unsigned        _backlog_count { 0 };
+
+		/* lines dropped because the backlog was full */
+		Genode::uint64_t _dropped          { 0 };
+		Genode::uint64_t _dropped_reported { 0 };
+
+		/*
+		 * Copies of the most recently submitted datagrams, kept for
+		 * answering retransmission requests of the receiver
+		 */
+		unsigned const  _window_size;
+		Datagram       *_window;
+		unsigned        _window_head  { 0 };
+		unsigned        _window_count { 0 };
+
 		Genode::Signal_handler<Logger> _source_ack;
 		Genode::Signal_handler<Logger> _source_submit;
+		Genode::Signal_handler<Logger> _sink_submit;
+		Genode::Signal_handler<Logger> _flush_handler;
 
 		/**
 		 * acknowledgement queue not empty anymore
@@ -86,60 +267,109 @@ class Udp_log::Logger
 			/* check for acknowledgements */
 			while (source()->ack_avail())
 				source()->release_packet(source()->get_acked_packet());
+
+			_drain_backlog();
 		}
 
 		/**
 		 * submit queue not full anymore
-		 *
-		 * by now, packets are dropped if submit queue is full
 		 */
-		void _packet_avail() { }
+		void _packet_avail() { _drain_backlog(); }
+
+		/**
+		 * packets received, which are retransmission requests or ignored
+		 */
+		void _ready_to_submit()
+		{
+			while (sink()->packet_avail() && sink()->ready_to_ack()) {
+				Packet_descriptor const packet = sink()->get_packet();
+				if (packet.size())
+					_handle_ethernet(sink()->packet_content(packet), packet.size());
+				sink()->acknowledge_packet(packet);
+			}
+		}
 
 		Packet_stream_source< ::Nic::Session::Policy> * source() {
 			return _nic.tx(); }
 
-	public:
-		Logger(Genode::Env &env, Genode::Allocator &alloc, Xml_node config)
-			:
-			 _tx_block_alloc(&alloc),
-			 _nic(env, &_tx_block_alloc, BUF_SIZE, BUF_SIZE),
-			 _src_ip (config.attribute_value("src_ip",  _default_ip_address)),
-			 _verbose(config.attribute_value("verbose", _verbose)),
-			 _chksum_offload(config.attribute_value("chksum_offload", _chksum_offload)),
-			 _source_ack(env.ep(), *this, &Logger::_ready_to_ack),
-			 _source_submit(env.ep(), *this, &Logger::_packet_avail)
+		Packet_stream_sink< ::Nic::Session::Policy> * sink() {
+			return _nic.rx(); }
+
+		void _handle_ethernet(void *src, size_t size)
 		{
-			_nic.tx_channel()->sigh_ack_avail(_source_ack);
-			_nic.tx_channel()->sigh_ready_to_submit(_source_submit);
+			if (!_window_size)
+				return;
+
+			try {
+				Size_guard size_guard(size);
+				Ethernet_frame &eth = Ethernet_frame::cast_from(src, size_guard);
+				if (eth.type() != Ethernet_frame::Type::IPV4)
+					return;
+
+				Ipv4_packet &ip = eth.data<Ipv4_packet>(size_guard);
+				if (ip.protocol() != Ipv4_packet::Protocol::UDP)
+					return;
+
+				Udp_packet &udp = ip.data<Udp_packet>(size_guard);
+				if (!(udp.dst_port() == _src_port))
+					return;
+
+				Protocol::Nack const &nack = udp.data<Protocol::Nack>(size_guard);
+				if (nack.valid())
+					_retransmit(ip.src(), udp.src_port(), nack.first(), nack.count());
+
+			} catch (Size_guard::Exceeded) { }
 		}
 
-		size_t write(PREFIX const &prefix, MSG const &string,
-		             Ipv4_address const &ipaddr,
-		             Port         const &port,
-		             Mac_address  const &mac)
+		/**
+		 * Resubmit the requested datagrams that are still in the window
+		 */
+		void _retransmit(Ipv4_address const &ip, Port const &port,
+		                 Genode::uint32_t first, unsigned count)
 		{
-			if (!_nic.link_state()) {
-				return 0;
+			for (unsigned i = 0; i < _window_count; i++) {
+				Datagram &dgram =
+					_window[(_window_head + _window_size - 1 - i) % _window_size];
+
+				if (!(dgram.dst().ip == ip) || !(dgram.dst().port == port))
+					continue;
+
+				if (dgram.seq() - first >= count)
+					continue;
+
+				dgram.mark_retransmit();
+				if (!_submit(dgram))
+					return;
 			}
+		}
 
+		/**
+		 * Build frame around datagram and submit it
+		 *
+		 * \return false if the packet could not be submitted
+		 */
+		bool _submit(Datagram const &dgram)
+		{
 			enum {
 				HDR_SZ      = sizeof(Ethernet_frame) + sizeof(Ipv4_packet) + sizeof(Udp_packet),
 				MIN_DATA_SZ = Ethernet_frame::MIN_SIZE - HDR_SZ,
 			};
 
-			size_t const packet_size = HDR_SZ + Genode::max((size_t)MIN_DATA_SZ,
-			                                                string.size() + prefix.length());
+			if (!source()->ready_to_submit())
+				return false;
+
+			size_t const data_size   = Genode::max((size_t)MIN_DATA_SZ, dgram.length());
+			size_t const packet_size = HDR_SZ + data_size;
 
 			try {
 
-				/* copy and submit packet */
 				Packet_descriptor packet  = source()->alloc_packet(packet_size);
 				Size_guard        size_guard(packet_size);
 				void             *base    = source()->packet_content(packet);
 
 				/* create ETH header */
 				Ethernet_frame &eth = Ethernet_frame::construct_at(base, size_guard);
-				eth.dst(mac);
+				eth.dst(dgram.dst().mac);
 				eth.src(_src_mac);
 				eth.type(Ethernet_frame::Type::IPV4);
 
@@ -152,18 +382,19 @@ class Udp_log::Logger
 				ip.time_to_live(IPV4_TIME_TO_LIVE);
 				ip.protocol(Ipv4_packet::Protocol::UDP);
 				ip.src(_src_ip);
-				ip.dst(ipaddr);
+				ip.dst(dgram.dst().ip);
 
 				/* create UDP header */
 				size_t const udp_off = size_guard.head_size();
 				Udp_packet &udp = ip.construct_at_data<Udp_packet>(size_guard);
 				udp.src_port(_src_port);
-				udp.dst_port(port);
+				udp.dst_port(dgram.dst().port);
 
-				/* write payload */
-				Payload &payload = udp.construct_at_data<Payload>(size_guard);
-				payload.set(prefix.string(), prefix.length()-1,
-				            string.string(), string.size(), size_guard);
+				/* write payload and zero-out padding */
+				char *data = &udp.data<char>(size_guard);
+				size_guard.consume_head(data_size - 1);
+				Genode::memcpy(data, dgram.data(), dgram.length());
+				Genode::memset(data + dgram.length(), 0, data_size - dgram.length());
 
 				/* fill in header values that need the packet to be complete already */
 				udp.length(size_guard.head_size() - udp_off);
@@ -174,14 +405,202 @@ class Udp_log::Logger
 
 				source()->submit_packet(packet);
 			} catch(Packet_stream_source<Nic::Session::Policy>::Packet_alloc_failed) {
-				Genode::warning("Packet dropped");
+				return false;
+			}
+
+			return true;
+		}
+
+		/**
+		 * Submit datagram and remember it for retransmission
+		 */
+		bool _transmit(Datagram const &dgram)
+		{
+			if (!_submit(dgram))
+				return false;
+
+			if (_window_size && dgram.stream()) {
+				_window[_window_head] = dgram;
+				_window_head  = (_window_head + 1) % _window_size;
+				_window_count = Genode::min(_window_count + 1, _window_size);
+			}
+			return true;
+		}
+
+		/**
+		 * Submit backlogged datagrams in order
+		 */
+		void _drain_backlog()
+		{
+			while (_backlog_count) {
+				unsigned const tail =
+					(_backlog_head + _backlog_size - _backlog_count) % _backlog_size;
+
+				if (!_transmit(_backlog[tail]))
+					return;
+
+				_backlog_count--;
+			}
+		}
+
+		Genode::uint32_t _next_seq(Destination const &dst)
+		{
+			Sequence *lru = &_sequences[0];
+			for (Sequence &sequence : _sequences) {
+				if (sequence.used && sequence.dst == dst) {
+					sequence.used = ++_sequence_clock;
+					return sequence.next++;
+				}
+				if (sequence.used < lru->used)
+					lru = &sequence;
+			}
+
+			*lru = Sequence { dst, 0, ++_sequence_clock };
+			return lru->next++;
+		}
+
+		/**
+		 * Hand completed datagram to the NIC or the backlog
+		 */
+		void _flush(Datagram &dgram)
+		{
+			if (dgram.empty())
+				return;
+
+			dgram.seal(_next_seq(dgram.dst()));
+
+			_drain_backlog();
+
+			if (_backlog_count || !_transmit(dgram)) {
+
+				if (_backlog_count == _backlog_size) {
+					if (!_dropped)
+						Genode::warning("backlog full, dropping log lines");
+					_dropped += dgram.lines();
+				} else {
+					_backlog[_backlog_head] = dgram;
+					_backlog_head = (_backlog_head + 1) % _backlog_size;
+					_backlog_count++;
+				}
+			}
+
+			dgram.reset(dgram.dst(), _payload_size, _stream_format);
+		}
+
+		void _flush_all()
+		{
+			_flush_armed = false;
+			for (Datagram &dgram : _open)
+				_flush(dgram);
+		}
+
+		/**
+		 * Return datagram collecting messages for 'dst'
+		 */
+		Datagram &_datagram(Destination const &dst)
+		{
+			Datagram *unused = nullptr;
+			for (Datagram &dgram : _open) {
+				if (dgram.dst() == dst)
+					return dgram;
+				if (!unused && dgram.empty())
+					unused = &dgram;
+			}
+
+			/* evict a datagram of another destination if necessary */
+			if (!unused) {
+				unused = &_open[0];
+				_flush(*unused);
+			}
+
+			unused->reset(dst, _payload_size, _stream_format);
+			return *unused;
+		}
+
+		void _append(Destination const &dst, Stream &stream,
+		             char const *prefix, size_t plen, char const *s, size_t len)
+		{
+			Datagram &dgram = _datagram(dst);
+
+			if (!dgram.fits(plen + len))
+				_flush(dgram);
+
+			dgram.append(stream, (Genode::uint32_t)_timer.elapsed_ms(),
+			             prefix, plen, s, len);
+
+			if (!_flush_armed) {
+				_flush_armed = true;
+				_timer.trigger_once(_flush_us);
 			}
+		}
+
+		void _report_drops(Destination const &dst)
+		{
+			if (_dropped == _dropped_reported)
+				return;
+
+			Genode::String<64> const notice(_dropped - _dropped_reported,
+			                                " log lines dropped\n");
+			_dropped_reported = _dropped;
+
+			char const prefix[] = "[udp_log] ";
+			_append(dst, _own_stream, prefix, sizeof(prefix) - 1,
+			        notice.string(), notice.length() - 1);
+		}
+
+	public:
+		Logger(Genode::Env &env, Genode::Allocator &alloc, Xml_node config)
+			:
+			 _tx_block_alloc(&alloc),
+			 _nic(env, &_tx_block_alloc, BUF_SIZE, BUF_SIZE),
+			 _src_ip (config.attribute_value("src_ip",  _default_ip_address)),
+			 _verbose(config.attribute_value("verbose", _verbose)),
+			 _chksum_offload(config.attribute_value("chksum_offload", _chksum_offload)),
+			 _stream_format(config.attribute_value("format", Genode::String<8>("stream"))
+			                != "plain"),
+			 _payload_size(Genode::min((size_t)Datagram::MAX_PAYLOAD,
+			                           Genode::max(config.attribute_value("mtu", (size_t)1500),
+			                                       (size_t)MIN_MTU)
+			                           - sizeof(Ipv4_packet) - sizeof(Udp_packet))),
+			 _flush_us(config.attribute_value("flush_ms", 50UL) * 1000),
+			 _timer(env),
+			 _backlog_size(Genode::max(1U, config.attribute_value("backlog", 64U))),
+			 _backlog(new (alloc) Datagram[_backlog_size]),
+			 _window_size(_stream_format ? config.attribute_value("retransmit", 0U) : 0),
+			 _window(_window_size ? new (alloc) Datagram[_window_size] : nullptr),
+			 _source_ack(env.ep(), *this, &Logger::_ready_to_ack),
+			 _source_submit(env.ep(), *this, &Logger::_packet_avail),
+			 _sink_submit(env.ep(), *this, &Logger::_ready_to_submit),
+			 _flush_handler(env.ep(), *this, &Logger::_flush_all)
+		{
+			_nic.tx_channel()->sigh_ack_avail(_source_ack);
+			_nic.tx_channel()->sigh_ready_to_submit(_source_submit);
+			_nic.rx_channel()->sigh_packet_avail(_sink_submit);
+			_nic.rx_channel()->sigh_ready_to_ack(_sink_submit);
+			_timer.sigh(_flush_handler);
+		}
+
+		size_t write(PREFIX const &prefix, MSG const &string,
+		             Stream             &stream,
+		             Ipv4_address const &ipaddr,
+		             Port         const &port,
+		             Mac_address  const &mac)
+		{
+			if (!_nic.link_state()) {
+				return 0;
+			}
+
+			Destination const dst { ipaddr, port, mac };
+
+			_report_drops(dst);
+
+			/* the message is stored without its terminating '\0' */
+			_append(dst, stream, prefix.string(), prefix.length()-1,
+			        string.string(), Genode::strlen(string.string()));
 
 			if (_verbose)
 				Genode::log(prefix, Genode::Cstring(string.string(), string.size()-2));
 
 			return string.size();
 		}
-
-		
 };
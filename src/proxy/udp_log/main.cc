@@ -51,6 +51,7 @@ class Udp_log::Session_component : public Genode::Rpc_object<Log_session>
 		Logger<String,Prefix> &_logger;
 
 		Prefix _prefix;
+		Stream _stream;
 
 		Mac_address  const _default_mac_address { (Genode::uint8_t)0xff };
 		Ipv4_address const _default_ip_address  { (Genode::uint8_t)0x00 };
@@ -64,9 +65,10 @@ class Udp_log::Session_component : public Genode::Rpc_object<Log_session>
 
 		Session_component(Genode::Env &env, Logger<String,Prefix> &logger,
 		                  Genode::Session_label const &label,
-		                  Xml_node policy)
+		                  Xml_node policy, Genode::uint16_t id)
 		:
 			_env(env), _logger(logger), _prefix("[", label.string(), "] "),
+			_stream(id),
 			_dst_mac (policy.attribute_value("mac",  _default_mac_address)),
 			_dst_ip  (policy.attribute_value("ip",   _default_ip_address)),
 			_dst_port(policy.attribute_value("port", _default_port))
@@ -87,7 +89,8 @@ class Udp_log::Session_component : public Genode::Rpc_object<Log_session>
 			 *       - a session component stores uses the broadcast MAC until the address is resolved
 			 */
 
-			return _logger.write(_prefix, string, _dst_ip, _dst_port, _dst_mac);
+			return _logger.write(_prefix, string, _stream,
+			                     _dst_ip, _dst_port, _dst_mac);
 		}
 		
 };
@@ -104,6 +107,9 @@ class Udp_log::Root : public Genode::Root_component<Session_component>
 		       Session_component::Prefix>
 		                            _logger = { _env, _alloc, _config.xml() };
 
+		/* stream IDs of sessions, 0 is used by the logger itself */
+		Genode::uint16_t            _next_stream_id { 1 };
+
 	protected:
 
 		Session_component *_create_session(const char *args) override
@@ -114,8 +120,12 @@ class Udp_log::Root : public Genode::Root_component<Session_component>
 				Session_label const label = label_from_args(args);
 				Session_policy policy(label, _config.xml());
 				
+				Genode::uint16_t const id = _next_stream_id++;
+				if (!_next_stream_id)
+					_next_stream_id = 1;
+
 				return new (Root::md_alloc())
-				            Session_component(_env, _logger, label, policy);
+				            Session_component(_env, _logger, label, policy, id);
 			}
 			catch (Session_policy::No_policy_defined) {
 				Genode::warning("Missing policy.");
@@ -15,6 +15,7 @@
 #include <flif_enc.h>
 
 /* Libc includes */
+#include <stdio.h>
 #include <time.h>
 
 /* Genode includes */
@@ -23,8 +24,9 @@
 #include <input_session/connection.h>
 #include <input/component.h>
 #include <base/attached_dataspace.h>
+#include <base/attached_ram_dataspace.h>
+#include <base/attached_rom_dataspace.h>
 #include <os/static_root.h>
-#include <os/pixel_rgb888.h>
 
 namespace Flif_capture {
 	using namespace Genode;
@@ -35,26 +37,148 @@ namespace Flif_capture {
 
 	using Framebuffer::Mode;
 
-	/**
-	 * Endian work-around struct
-	 */
-	struct RGBA
-	{
-		uint8_t r,g,b,a;
-	} __attribute__((packed));
+	using Area = Surface_base::Area;
 }
 
 
 class Flif_capture::Encoder
 {
+	public:
+
+		enum { DEFAULT_QUEUE_SIZE = 4, MAX_QUEUE_SIZE = 16 };
+
 	private:
 
 		Genode::Env &_env;
 
-		// TODO: reuse FLIF_IMAGE, do not reallocate
-		FLIF_IMAGE  *_image = nullptr;
-		Semaphore    _semaphore { };
-		Mutex        _mutex { };
+		/**
+		 * Captured frame, converted to RGBA and waiting for encoding
+		 */
+		struct Frame
+		{
+			Constructible<Attached_ram_dataspace> buffer { };
+
+			Area     area  { };
+			unsigned index { 0 };
+		};
+
+		Frame    _frames[MAX_QUEUE_SIZE];
+		unsigned _queue_size;
+
+		/*
+		 * The ring is filled at '_head' by the service entrypoint and
+		 * drained at '_tail' by the initial thread. Slots outside the
+		 * '_count' queued frames are owned by the service entrypoint.
+		 */
+		unsigned  _head  = 0;
+		unsigned  _tail  = 0;
+		unsigned  _count = 0;
+		Semaphore _semaphore { };
+		Mutex     _mutex { };
+
+		unsigned _captured = 0;
+		unsigned _dropped  = 0;
+
+		/* framebuffer stays attached until the client obtains a new one */
+		Dataspace_capability              _fb_cap { };
+		Constructible<Attached_dataspace> _fb_ds  { };
+		Mode                              _mode   { };
+
+		/* image reused for all frames of the same size */
+		FLIF_IMAGE *_image = nullptr;
+		Area        _image_area { };
+
+		void _alloc_buffer(Frame &frame, Area area)
+		{
+			size_t const size = area.count() * sizeof(uint32_t);
+
+			if (frame.buffer.constructed() && frame.buffer->size() >= size)
+				return;
+
+			frame.buffer.construct(_env.ram(), _env.rm(), size);
+		}
+
+		/**
+		 * Convert RGB888 pixels to RGBA in memory order
+		 *
+		 * Pixels are processed as whole words without per-channel
+		 * accessors, which allows the compiler to vectorize the loop.
+		 */
+		static void _convert(uint32_t *dst, uint32_t const *src, size_t count)
+		{
+			static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+			              "RGBA conversion assumes little endian");
+
+			for (size_t i = 0; i < count; i++) {
+				uint32_t const px = src[i];
+				dst[i] = 0xff000000
+				       | ((px >> 16) & 0xff)
+				       |  (px & 0xff00)
+				       | ((px & 0xff) << 16);
+			}
+		}
+
+		FLIF_IMAGE *_image_for(Area area)
+		{
+			if (_image && _image_area.w() == area.w() && _image_area.h() == area.h())
+				return _image;
+
+			if (_image)
+				flif_destroy_image(_image);
+
+			_image      = flif_create_image(area.w(), area.h());
+			_image_area = _image ? area : Area();
+			return _image;
+		}
+
+		void _encode(Frame const &frame)
+		{
+			FLIF_IMAGE *image = _image_for(frame.area);
+			if (!image) {
+				Genode::error("failed to create image buffer");
+				return;
+			}
+
+			uint32_t const *pixels = frame.buffer->local_addr<uint32_t const>();
+			size_t   const  row    = frame.area.w();
+
+			for (unsigned y = 0; y < frame.area.h(); y++)
+				flif_image_write_row_RGBA8(image, y, pixels + y*row,
+				                           row*sizeof(uint32_t));
+
+			/*
+			 * An encoder accumulates the frames of one file, so it
+			 * cannot be reused once 'encode_file' was called.
+			 */
+			FLIF_ENCODER* encoder = flif_create_encoder();
+			if (!encoder) {
+				Genode::error("failed to create FLIF encoder");
+				return;
+			}
+			flif_encoder_set_lookback(encoder, 0);
+			flif_encoder_add_image(encoder, image);
+
+			char filename[32] { '\0' };
+
+			Libc::with_libc([&] () {
+				/* calculate Sumerian time, hopefully */
+				time_t now = time(NULL);
+				struct tm more_now { };
+				localtime_r(&now, &more_now);
+				size_t n = strftime(filename, sizeof(filename), "%T", &more_now);
+
+				/* the sequence number keeps captures of the same second apart */
+				snprintf(filename + n, sizeof(filename) - n, "-%u.flif", frame.index);
+			});
+
+			Genode::log("capture to ", (char const *)filename);
+			Libc::with_libc([&] () {
+				if (!flif_encoder_encode_file(encoder, filename))
+					Genode::error("file encoding failed");
+			});
+
+			flif_destroy_encoder(encoder);
+		}
 
 	public:
 
@@ -64,92 +188,104 @@ class Flif_capture::Encoder
 		Encoder(Encoder const &);
 		Encoder &operator = (Encoder const &);
 
-		Encoder(Genode::Env &env) : _env(env) { }
+		Encoder(Genode::Env &env, unsigned queue_size)
+		:
+			_env(env),
+			_queue_size(max(1U, min(queue_size, (unsigned)MAX_QUEUE_SIZE)))
+		{ }
 
 		/**
 		 * Encode loop called from initial thread
 		 */
 		void entry()
 		{
-			_mutex.acquire();
-
 			for (;;) {
-				while (_image == nullptr) {
-					_mutex.release();
-					_semaphore.down();
-					_mutex.acquire();
-				}
+				_semaphore.down();
 
-				char filename[32] { '\0' };
-
-				Libc::with_libc([&] () {
-					/* calculate Sumerian time, hopefully */
-					time_t now = time(NULL);
-					struct tm more_now { };
-					localtime_r(&now, &more_now);
-					strftime(filename, sizeof(filename), "%T.flif", &more_now);
-				});
-
-				FLIF_ENCODER* encoder = flif_create_encoder();
-				flif_encoder_set_lookback(encoder, 0);
-				if (!encoder) {
-					Genode::error("failed to create FLIF encoder");
-					continue;
-				}
-
-				flif_encoder_add_image(encoder, _image);
+				Frame const &frame = _frames[_tail];
 
-				Genode::log("capture to ", (char const *)filename);
-				Libc::with_libc([&] () {
-					if (!flif_encoder_encode_file(encoder, filename))
-						Genode::error("file encoding failed");
-				});
+				_encode(frame);
 
-				flif_destroy_encoder(encoder);
-				flif_destroy_image(_image);
-				_image = nullptr;
+				Mutex::Guard guard(_mutex);
+				_tail = (_tail + 1) % _queue_size;
+				_count--;
 			}
 		}
 
 		/**
-		 * Cross-thread copy called by service entrypoint
+		 * Attach framebuffer dataspace, called by service entrypoint
+		 *
+		 * Buffers of all idle queue slots are sized for the new mode up
+		 * front so that captures do not allocate.
 		 */
-		void queue(Dataspace_capability fb_cap, Mode const mode)
+		void framebuffer(Dataspace_capability fb_cap, Mode const mode)
 		{
+			_mode = mode;
 
-			/* drop this frame if there is encoding in progress */
-			if (_image != nullptr)
-				return;
+			if (!(fb_cap == _fb_cap)) {
+				_fb_ds.destruct();
+				_fb_cap = fb_cap;
+				if (fb_cap.valid())
+					_fb_ds.construct(_env.rm(), fb_cap);
+			}
+
+			unsigned free = 0;
+			{
+				Mutex::Guard guard(_mutex);
+				free = _queue_size - _count;
+			}
 
-			Mutex::Guard guard(_mutex);
+			try {
+				for (unsigned i = 0; i < free; i++)
+					_alloc_buffer(_frames[(_head + i) % _queue_size], mode.area);
+			} catch (Out_of_ram) {
+				Genode::warning("insufficient RAM to preallocate capture queue");
+			}
+		}
 
-			/* TODO: attach/detach each capture? */
-			Genode::Attached_dataspace fb_ds(_env.rm(), fb_cap);
-			if (fb_ds.size() < mode.area.count() * mode.bytes_per_pixel()) {
+		/**
+		 * Cross-thread copy called by service entrypoint
+		 */
+		void queue()
+		{
+			if (!_fb_ds.constructed()
+			 || _fb_ds->size() < _mode.area.count() * _mode.bytes_per_pixel()) {
 				Genode::error("invalid framebuffer for capture");
 				return;
 			}
 
-			RGBA row[mode.area.w()];
+			{
+				Mutex::Guard guard(_mutex);
 
-			_image = flif_create_image(mode.area.w(), mode.area.h());
-			if (!_image) {
-				Genode::error("failed to create image buffer");
+				/* drop this frame if all slots wait for encoding */
+				if (_count == _queue_size) {
+					_dropped++;
+					Genode::warning("capture queue full, ",
+					                _dropped, " frames dropped");
+					return;
+				}
+			}
+
+			Frame &frame = _frames[_head];
+
+			try { _alloc_buffer(frame, _mode.area); }
+			catch (Out_of_ram) {
+				_dropped++;
+				Genode::error("insufficient RAM for capture buffer");
 				return;
 			}
 
-			using Pixel = Pixel_rgb888;
-			Pixel const *pixels = fb_ds.local_addr<Pixel const>();
+			_convert(frame.buffer->local_addr<uint32_t>(),
+			         _fb_ds->local_addr<uint32_t const>(),
+			         _mode.area.count());
 
-			for (unsigned y = 0; y < mode.area.h(); y++) {
-				for (unsigned x = 0; x < mode.area.w(); x++) {
-					Pixel const px = pixels[y*mode.area.w()+x];
-					row[x] = RGBA { (uint8_t)px.r(),
-					                (uint8_t)px.g(),
-					                (uint8_t)px.b(),
-					                255 };
-				}
-				flif_image_write_row_RGBA8(_image, y, row, sizeof(row));
+			frame.area  = _mode.area;
+			frame.index = _captured++;
+
+			{
+				Mutex::Guard guard(_mutex);
+				_head = (_head + 1) % _queue_size;
+				_count++;
 			}
 
 			capture_pending = false;
@@ -190,6 +326,7 @@ class Flif_capture::Framebuffer_session_component
 		{
 			_mode = _parent.mode();
 			_dataspace = _parent.dataspace();
+			_encoder.framebuffer(_dataspace, _mode);
 			return _dataspace;
 		}
 
@@ -207,7 +344,7 @@ class Flif_capture::Framebuffer_session_component
 		{
 			_parent.refresh(x, y, w, h);
 			if (_encoder.capture_pending)
-				_encoder.queue(_dataspace, _mode);
+				_encoder.queue();
 		}
 
 		void sync_sigh(Genode::Signal_context_capability sigh) override
@@ -238,7 +375,11 @@ class Flif_capture::Main
 			_env.cpu().affinity_space().location_of_index(1)
 		};
 
-		Flif_capture::Encoder   _encoder      { _env };
+		Attached_rom_dataspace _config { _env, "config" };
+
+		Flif_capture::Encoder   _encoder      { _env,
+			_config.xml().attribute_value("queue",
+				(unsigned)Encoder::DEFAULT_QUEUE_SIZE) };
 		Framebuffer::Connection _parent_fb    { _env, Mode { } };
 		Input::Connection       _parent_input { _env };
 
@@ -2,3 +2,4 @@ TARGET   = flif_capture
 SRC_CC   = main.cc
 LIBS     = libflif libc blit base
 INC_DIR += $(PRG_DIR)
+CC_OPT  += -ftree-vectorize
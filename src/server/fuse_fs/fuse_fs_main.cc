@@ -25,8 +25,10 @@
 
 /* local includes */
 #include <directory.h>
+#include <op_lock.h>
 #include <open_node.h>
 #include <util.h>
+#include <worker_pool.h>
 
 
 namespace Fuse_fs {
@@ -47,28 +49,236 @@ class Fuse_fs::Session_component : public Session_rpc_object
 
 		typedef File_system::Open_node<Node> Open_node;
 
+		/**
+		 * Packet operation executed by the worker pool
+		 *
+		 * The packets of a session are processed one after another, so
+		 * each session has at most one job in flight. Packets of different
+		 * sessions are processed concurrently.
+		 */
+		struct Packet_job : Job
+		{
+			Session_component &session;
+
+			Packet_descriptor  packet     { };
+			Open_node         *open_node  { nullptr };
+			void              *content    { nullptr };
+			size_t             res_length { 0 };
+			bool               succeeded  { false };
+			bool               ack        { true };
+
+			Completion         completion { };
+
+			Packet_job(Session_component &session) : session(session) { }
+
+			void execute() override { session._execute(*this); }
+		};
+
+		/**
+		 * FUSE operation of an RPC function executed by the worker pool
+		 *
+		 * The entrypoint never takes the 'Op_lock' itself, which may be held
+		 * by a worker that depends on the entrypoint for its I/O. Exceptions
+		 * are caught by the worker and re-thrown in the entrypoint.
+		 */
+		template <typename FN>
+		struct Fuse_call : Job
+		{
+			enum Error { NONE, LOOKUP_FAILED, PERMISSION_DENIED,
+			             NODE_ALREADY_EXISTS, INVALID_NAME, NAME_TOO_LONG,
+			             NO_SPACE, OUT_OF_RAM, OUT_OF_CAPS, UNAVAILABLE };
+
+			Op_lock    &op_lock;
+			char const *path;
+			FN   const &fn;
+
+			Error      error      { NONE };
+			Completion completion { };
+
+			Fuse_call(Op_lock &op_lock, char const *path, FN const &fn)
+			: op_lock(op_lock), path(path), fn(fn) { }
+
+			void execute() override
+			{
+				Error e = NONE;
+
+				try { op_lock.apply(path, fn); }
+				catch (Lookup_failed)       { e = LOOKUP_FAILED; }
+				catch (Permission_denied)   { e = PERMISSION_DENIED; }
+				catch (Node_already_exists) { e = NODE_ALREADY_EXISTS; }
+				catch (Invalid_name)        { e = INVALID_NAME; }
+				catch (Name_too_long)       { e = NAME_TOO_LONG; }
+				catch (No_space)            { e = NO_SPACE; }
+				catch (Out_of_ram)          { e = OUT_OF_RAM; }
+				catch (Out_of_caps)         { e = OUT_OF_CAPS; }
+				catch (...) {
+					Genode::error("unexpected exception in FUSE operation");
+					e = UNAVAILABLE;
+				}
+
+				completion.complete([&] () { error = e; });
+			}
+
+			void throw_error() const
+			{
+				switch (error) {
+				case NONE:                break;
+				case LOOKUP_FAILED:       throw Lookup_failed();
+				case PERMISSION_DENIED:   throw Permission_denied();
+				case NODE_ALREADY_EXISTS: throw Node_already_exists();
+				case INVALID_NAME:        throw Invalid_name();
+				case NAME_TOO_LONG:       throw Name_too_long();
+				case NO_SPACE:            throw No_space();
+				case OUT_OF_RAM:          throw Out_of_ram();
+				case OUT_OF_CAPS:         throw Out_of_caps();
+				case UNAVAILABLE:         throw Unavailable();
+				}
+			}
+		};
+
 		Genode::Env                 &_env;
 		Allocator                   &_md_alloc;
+		Op_lock                     &_op_lock;
+		Worker_pool                 &_workers;
 		Directory                   &_root;
 		Id_space<File_system::Node>  _open_node_registry;
 		bool                         _writeable;
 
 		Signal_handler<Session_component> _process_packet_handler;
 
+		Packet_job        _job          { *this };
+		bool              _job_pending  { false };
+
+		/**
+		 * Execute FUSE operation 'fn' on the node at 'path'
+		 *
+		 * If there are workers, the operation is executed by one of them
+		 * while the entrypoint waits within the libc kernel.
+		 */
+		template <typename FN>
+		void _fuse(char const *path, FN const &fn)
+		{
+			Fuse_call<FN> call { _op_lock, path, fn };
+
+			if (_workers.count()) {
+				call.completion.reset();
+				_workers.submit(call);
+				call.completion.wait();
+			} else {
+				call.execute();
+			}
+
+			call.throw_error();
+		}
+
 
 		/******************************
 		 ** Packet-stream processing **
 		 ******************************/
 
+		/**
+		 * Execute FUSE part of packet operation, called by a worker
+		 */
+		void _execute(Packet_job &job)
+		{
+			Node         &node    = job.open_node->node();
+			size_t const  length  = job.packet.length();
+
+			switch (job.packet.operation()) {
+
+			case Packet_descriptor::READ:
+				job.res_length = _op_lock.apply(node.name(), [&] () {
+					return node.read((char *)job.content, length,
+					                 job.packet.position()); });
+
+				job.succeeded = job.res_length > 0;
+				break;
+
+			case Packet_descriptor::WRITE:
+				job.res_length = _op_lock.apply(node.name(), [&] () {
+					return node.write((char const *)job.content, length,
+					                  job.packet.position()); });
+
+				/* File system session can't handle partial writes */
+				if (job.res_length != length) {
+					Genode::error("partial write detected ",
+					              job.res_length, " vs ", length);
+					/* don't acknowledge */
+					job.ack = false;
+					break;
+				}
+				job.succeeded = true;
+				break;
+
+			case Packet_descriptor::SYNC:
+				_op_lock.apply(nullptr, [&] () { Fuse::sync_fs(); });
+				job.succeeded = true;
+				break;
+
+			default:
+				break;
+			}
+
+			/*
+			 * Let the entrypoint acknowledge the packet. The signal is
+			 * submitted while the job is still in flight because the
+			 * session may be destructed as soon as the job is completed.
+			 */
+			job.completion.complete([&] () {
+				Signal_transmitter(_process_packet_handler).submit(); });
+		}
+
+		/**
+		 * Wait until the job in flight is completed
+		 *
+		 * Called before open nodes or the session vanish. The wait does
+		 * not block the I/O signal handling of the entrypoint.
+		 */
+		void _wait_for_job()
+		{
+			if (_job_pending)
+				_job.completion.wait();
+		}
+
+		void _dispatch_job(Packet_descriptor packet, Open_node &open_node,
+		                   void *content)
+		{
+			_job.packet     = packet;
+			_job.open_node  = &open_node;
+			_job.content    = content;
+			_job.res_length = 0;
+			_job.succeeded  = false;
+			_job.ack        = true;
+			_job_pending    = true;
+
+			_job.completion.reset();
+
+			if (_workers.count())
+				_workers.submit(_job);
+			else
+				_execute(_job);
+		}
+
+		void _acknowledge_job()
+		{
+			_job_pending = false;
+
+			if (!_job.ack)
+				return;
+
+			_job.packet.length(_job.res_length);
+			_job.packet.succeeded(_job.succeeded);
+			tx_sink()->acknowledge_packet(_job.packet);
+		}
+
 		/**
 		 * Perform packet operation
 		 *
-		 * \return true on success, false on failure
+		 * \return true if the operation was handed to the worker pool
 		 */
-		void _process_packet_op(Packet_descriptor &packet, Open_node &open_node)
+		bool _process_packet_op(Packet_descriptor &packet, Open_node &open_node)
 		{
 			void     * const content = tx_sink()->packet_content(packet);
-			size_t     const length  = packet.length();
 
 			/* resulting length */
 			size_t res_length = 0;
@@ -77,26 +287,10 @@ class Fuse_fs::Session_component : public Session_rpc_object
 			switch (packet.operation()) {
 
 			case Packet_descriptor::READ:
-				if (content && (packet.length() <= packet.size())) {
-					res_length = open_node.node().read((char *)content, length,
-					                                   packet.position());
-
-					succeeded = res_length > 0;
-				}
-				break;
-
 			case Packet_descriptor::WRITE:
 				if (content && (packet.length() <= packet.size())) {
-					res_length = open_node.node().write((char const *)content, length, packet.position());
-
-					/* File system session can't handle partial writes */
-					if (res_length != length) {
-						Genode::error("partial write detected ",
-						              res_length, " vs ", length);
-						/* don't acknowledge */
-						return;
-					}
-					succeeded = true;
+					_dispatch_job(packet, open_node, content);
+					return true;
 				}
 				break;
 
@@ -105,7 +299,7 @@ class Fuse_fs::Session_component : public Session_rpc_object
 				/* notify_listeners may bounce the packet back*/
 				open_node.node().notify_listeners();
 				/* otherwise defer acknowledgement of this packet */
-				return;
+				return false;
 
 			case Packet_descriptor::READ_READY:
 				succeeded = true;
@@ -113,17 +307,20 @@ class Fuse_fs::Session_component : public Session_rpc_object
 				break;
 
 			case Packet_descriptor::SYNC:
-				Fuse::sync_fs();
-				succeeded = true;
-				break;
+				_dispatch_job(packet, open_node, content);
+				return true;
 			}
 
 			packet.length(res_length);
 			packet.succeeded(succeeded);
 			tx_sink()->acknowledge_packet(packet);
+			return false;
 		}
 
-		void _process_packet()
+		/**
+		 * \return true if the packet was handed to the worker pool
+		 */
+		bool _process_packet()
 		{
 			Packet_descriptor packet = tx_sink()->get_packet();
 
@@ -131,15 +328,16 @@ class Fuse_fs::Session_component : public Session_rpc_object
 			packet.succeeded(false);
 
 			auto process_packet_fn = [&] (Open_node &open_node) {
-				_process_packet_op(packet, open_node);
+				return _process_packet_op(packet, open_node);
 			};
 
 			try {
-				_open_node_registry.apply<Open_node>(packet.handle(), process_packet_fn);
+				return _open_node_registry.apply<Open_node>(packet.handle(), process_packet_fn);
 			} catch (Id_space<File_system::Node>::Unknown_id const &) {
 				Genode::error("Invalid_handle");
 				tx_sink()->acknowledge_packet(packet);
 			}
+			return false;
 		}
 
 		/**
@@ -148,6 +346,14 @@ class Fuse_fs::Session_component : public Session_rpc_object
 		 */
 		void _process_packets()
 		{
+			/* acknowledge the completed job before taking the next packet */
+			if (_job_pending) {
+				if (!_job.completion.done() || !tx_sink()->ready_to_ack())
+					return;
+
+				_acknowledge_job();
+			}
+
 			while (tx_sink()->packet_avail()) {
 
 				/*
@@ -165,7 +371,9 @@ class Fuse_fs::Session_component : public Session_rpc_object
 				if (!tx_sink()->ready_to_ack())
 					return;
 
-				_process_packet();
+				/* the worker signals the completion of the job */
+				if (_process_packet())
+					return;
 			}
 		}
 
@@ -180,21 +388,33 @@ class Fuse_fs::Session_component : public Session_rpc_object
 			}
 		}
 
+		Directory &_open_root(char const *root_dir)
+		{
+			Directory *root = nullptr;
+			_fuse(root_dir, [&] () {
+				root = new (&_md_alloc) Directory(_md_alloc, root_dir, false); });
+			return *root;
+		}
+
 	public:
 
 		/**
 		 * Constructor
 		 */
-		Session_component(size_t      tx_buf_size,
+		Session_component(size_t       tx_buf_size,
 		                  Genode::Env &env,
-		                  char const *root_dir,
-		                  bool        writeable,
-		                  Allocator  &md_alloc)
+		                  char const  *root_dir,
+		                  bool         writeable,
+		                  Allocator   &md_alloc,
+		                  Op_lock     &op_lock,
+		                  Worker_pool &workers)
 		:
 			Session_rpc_object(env.ram().alloc(tx_buf_size), env.rm(), env.ep().rpc_ep()),
 			_env(env),
 			_md_alloc(md_alloc),
-			_root(*new (&_md_alloc) Directory(_md_alloc, root_dir, false)),
+			_op_lock(op_lock),
+			_workers(workers),
+			_root(_open_root(root_dir)),
 			_writeable(writeable),
 			_process_packet_handler(_env.ep(), *this, &Session_component::_process_packets)
 		{
@@ -207,11 +427,13 @@ class Fuse_fs::Session_component : public Session_rpc_object
 		 */
 		~Session_component()
 		{
-			Fuse::sync_fs();
+			_wait_for_job();
+
+			_fuse(nullptr, [&] () { Fuse::sync_fs(); });
 
 			Dataspace_capability ds = tx_sink()->dataspace();
 			_env.ram().free(static_cap_cast<Ram_dataspace>(ds));
-			destroy(&_md_alloc, &_root);
+			_fuse(_root.name(), [&] () { destroy(&_md_alloc, &_root); });
 		}
 
 
@@ -231,7 +453,9 @@ class Fuse_fs::Session_component : public Session_rpc_object
 				if (create && !_writeable)
 					throw Permission_denied();
 
-				File *file = new (&_md_alloc) File(&dir, name.string(), mode, create);
+				File *file = nullptr;
+				_fuse(dir.name(), [&] () {
+					file = new (&_md_alloc) File(&dir, name.string(), mode, create); });
 
 				Open_node *open_file =
 					new (_md_alloc) Open_node(*file, _open_node_registry);
@@ -265,7 +489,9 @@ class Fuse_fs::Session_component : public Session_rpc_object
 				if (create && !_writeable)
 						throw Permission_denied();
 
-				Symlink *symlink = new (&_md_alloc) Symlink(&dir, name.string(), create);
+				Symlink *symlink = nullptr;
+				_fuse(dir.name(), [&] () {
+					symlink = new (&_md_alloc) Symlink(&dir, name.string(), create); });
 
 				Open_node *open_symlink =
 					new (_md_alloc) Open_node(*symlink, _open_node_registry);
@@ -292,7 +518,9 @@ class Fuse_fs::Session_component : public Session_rpc_object
 			if (!path.valid_string())
 				throw Name_too_long();
 
-			Directory *dir_node = new (&_md_alloc) Directory(_md_alloc, path_str, create);
+			Directory *dir_node = nullptr;
+			_fuse(path_str, [&] () {
+				dir_node = new (&_md_alloc) Directory(_md_alloc, path_str, create); });
 
 			Open_node *open_dir =
 				new (_md_alloc) Open_node(*dir_node, _open_node_registry);
@@ -310,7 +538,8 @@ class Fuse_fs::Session_component : public Session_rpc_object
 			 * FIXME this leads to '/' as parent and 'the rest' as name,
 			 * which fortunatly is in this case not a problem.
 			 */
-			Node *node = _root.node(path_str + 1);
+			Node *node = nullptr;
+			_fuse(path_str, [&] () { node = _root.node(path_str + 1); });
 
 			Open_node *open_node =
 				new (_md_alloc) Open_node(*node, _open_node_registry);
@@ -320,10 +549,13 @@ class Fuse_fs::Session_component : public Session_rpc_object
 
 		void close(Node_handle handle)
 		{
+			/* the job in flight may refer to the node */
+			_wait_for_job();
+
 			auto close_fn = [&] (Open_node &open_node) {
 				Node &node = open_node.node();
 				destroy(_md_alloc, &open_node);
-				destroy(_md_alloc, &node);
+				_fuse(node.name(), [&] () { destroy(_md_alloc, &node); });
 			};
 
 			try {
@@ -336,7 +568,10 @@ class Fuse_fs::Session_component : public Session_rpc_object
 		Status status(Node_handle node_handle)
 		{
 			auto status_fn = [&] (Open_node &open_node) {
-				return open_node.node().status();
+				Node &node = open_node.node();
+				Status status { };
+				_fuse(node.name(), [&] () { status = node.status(); });
+				return status;
 			};
 
 			try {
@@ -371,7 +606,9 @@ class Fuse_fs::Session_component : public Session_rpc_object
 				}
 
 				/* XXX remove direct use of FUSE operations */
-				int res = Fuse::fuse()->op.unlink(absolute_path.base());
+				int res = 0;
+				_fuse(dir.name(), [&] () {
+					res = Fuse::fuse()->op.unlink(absolute_path.base()); });
 
 				if (res != 0) {
 					Genode::error("fuse()->op.unlink() returned unexpected error code: ", res);
@@ -392,7 +629,8 @@ class Fuse_fs::Session_component : public Session_rpc_object
 				throw Permission_denied();
 
 			auto truncate_fn = [&] (Open_node &open_node) {
-				open_node.node().truncate(size);
+				Node &node = open_node.node();
+				_fuse(node.name(), [&] () { node.truncate(size); });
 			};
 
 			try {
@@ -430,8 +668,10 @@ class Fuse_fs::Session_component : public Session_rpc_object
 					}
 
 					/* XXX remove direct use of FUSE operations */
-					int res = Fuse::fuse()->op.rename(absolute_to_path.base(),
-			                                  	  	  absolute_from_path.base());
+					int res = 0;
+					_fuse(nullptr, [&] () {
+						res = Fuse::fuse()->op.rename(absolute_to_path.base(),
+						                              absolute_from_path.base()); });
 
 					if (res != 0) {
 						Genode::error("fuse()->op.rename() returned unexpected error code: ", res);
@@ -462,6 +702,9 @@ class Fuse_fs::Root : public Root_component<Session_component>
 		Genode::Env                   &_env;
 		Genode::Attached_rom_dataspace _config { _env, "config" };
 
+		Op_lock     _op_lock { Fuse::support_concurrent_ops() };
+		Worker_pool _workers { _config.xml().attribute_value("workers", 4u) };
+
 	protected:
 
 		Session_component *_create_session(const char *args)
@@ -542,7 +785,8 @@ class Fuse_fs::Root : public Root_component<Session_component>
 				throw Insufficient_ram_quota();
 			}
 			return new (md_alloc())
-				Session_component(tx_buf_size, _env, root_dir, writeable, *md_alloc());
+				Session_component(tx_buf_size, _env, root_dir, writeable, *md_alloc(),
+				                  _op_lock, _workers);
 		}
 
 	public:
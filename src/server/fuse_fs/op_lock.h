@@ -0,0 +1,73 @@
+/*
+ * \brief  Serialization of FUSE operations
+ * \date   2026-10-19
+ */
+
+/*
+ * Copyright (C) 2026 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU Affero General Public License version 3.
+ */
+
+#ifndef _OP_LOCK_H_
+#define _OP_LOCK_H_
+
+/* Genode includes */
+#include <base/mutex.h>
+#include <util/string.h>
+
+namespace Fuse_fs { class Op_lock; }
+
+
+/**
+ * Lock taken around each FUSE operation
+ *
+ * File systems that cannot execute FUSE operations concurrently share one
+ * global mutex. Otherwise, operations are serialized per node only, using
+ * one of a fixed set of mutexes selected by the node's path.
+ */
+class Fuse_fs::Op_lock
+{
+	private:
+
+		enum { NODE_MUTEXES = 64 };
+
+		bool const     _concurrent;
+		Genode::Mutex  _global { };
+		Genode::Mutex  _node[NODE_MUTEXES];
+
+		Genode::Mutex &_mutex(char const *path)
+		{
+			if (!_concurrent || !path)
+				return _global;
+
+			/* FNV-1a hash of the path */
+			unsigned hash = 2166136261u;
+			for (char const *c = path; *c; c++)
+				hash = (hash ^ (unsigned char)*c) * 16777619u;
+
+			return _node[hash % NODE_MUTEXES];
+		}
+
+	public:
+
+		Op_lock(bool concurrent) : _concurrent(concurrent) { }
+
+		bool concurrent() const { return _concurrent; }
+
+		/**
+		 * Execute FUSE operation 'fn' on the node at 'path'
+		 *
+		 * Operations that modify the namespace pass the path of the parent
+		 * directory.
+		 */
+		template <typename FN>
+		auto apply(char const *path, FN const &fn) -> decltype(fn())
+		{
+			Genode::Mutex::Guard guard(_mutex(path));
+			return fn();
+		}
+};
+
+#endif /* _OP_LOCK_H_ */
@@ -0,0 +1,205 @@
+/*
+ * \brief  Pool of threads executing FUSE operations of packets
+ * \date   2026-10-19
+ */
+
+/*
+ * Copyright (C) 2026 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU Affero General Public License version 3.
+ */
+
+#ifndef _WORKER_POOL_H_
+#define _WORKER_POOL_H_
+
+/* Genode includes */
+#include <base/log.h>
+#include <base/mutex.h>
+#include <base/semaphore.h>
+#include <util/fifo.h>
+#include <libc/component.h>
+
+/* libc includes */
+#include <pthread.h>
+
+namespace Fuse_fs {
+	class Completion;
+	struct Job;
+	class Worker_pool;
+}
+
+
+/**
+ * Completion state of a job
+ *
+ * Workers perform libc I/O, which relies on the entrypoint to dispatch
+ * the I/O signals, e.g., of the block session. The entrypoint must
+ * therefore never wait on a Genode mutex or semaphore for a worker.
+ * Waiting on a pthread condition from within the libc context instead
+ * suspends the entrypoint in the libc kernel, which keeps dispatching I/O
+ * signals and thereby lets the worker make progress.
+ */
+class Fuse_fs::Completion
+{
+	private:
+
+		/*
+		 * Noncopyable
+		 */
+		Completion(Completion const &);
+		Completion &operator = (Completion const &);
+
+		pthread_mutex_t _mutex;
+		pthread_cond_t  _cond;
+		bool            _done { true };
+
+	public:
+
+		Completion()
+		{
+			pthread_mutex_init(&_mutex, nullptr);
+			pthread_cond_init(&_cond, nullptr);
+		}
+
+		~Completion()
+		{
+			pthread_cond_destroy(&_cond);
+			pthread_mutex_destroy(&_mutex);
+		}
+
+		/**
+		 * Mark job as in flight, called before submitting it
+		 */
+		void reset()
+		{
+			pthread_mutex_lock(&_mutex);
+			_done = false;
+			pthread_mutex_unlock(&_mutex);
+		}
+
+		bool done()
+		{
+			pthread_mutex_lock(&_mutex);
+			bool const done = _done;
+			pthread_mutex_unlock(&_mutex);
+			return done;
+		}
+
+		/**
+		 * Mark job as completed
+		 *
+		 * The function 'fn' is called while the job is still in flight. It
+		 * is the last point where the worker may touch state owned by the
+		 * submitter, which may vanish as soon as the job is completed.
+		 */
+		template <typename FN>
+		void complete(FN const &fn)
+		{
+			pthread_mutex_lock(&_mutex);
+			fn();
+			_done = true;
+			pthread_cond_broadcast(&_cond);
+			pthread_mutex_unlock(&_mutex);
+		}
+
+		/**
+		 * Wait for the completion, may be called by the entrypoint
+		 */
+		void wait()
+		{
+			Libc::with_libc([&] () {
+				pthread_mutex_lock(&_mutex);
+				while (!_done)
+					pthread_cond_wait(&_cond, &_mutex);
+				pthread_mutex_unlock(&_mutex);
+			});
+		}
+};
+
+
+/**
+ * Operation handed to the worker pool
+ */
+struct Fuse_fs::Job : Genode::Fifo<Job>::Element
+{
+	/**
+	 * Execute the operation in the context of a worker
+	 */
+	virtual void execute() = 0;
+
+	virtual ~Job() { }
+};
+
+
+/**
+ * Worker threads executing jobs in the order of submission
+ *
+ * The FUSE operations use the libc, so the workers are pthreads.
+ */
+class Fuse_fs::Worker_pool
+{
+	private:
+
+		/*
+		 * Noncopyable
+		 */
+		Worker_pool(Worker_pool const &);
+		Worker_pool &operator = (Worker_pool const &);
+
+		enum { MAX_WORKERS = 16 };
+
+		Genode::Mutex     _mutex { };
+		Genode::Semaphore _avail { 0 };
+		Genode::Fifo<Job> _jobs  { };
+		unsigned          _count { 0 };
+
+		static void *_entry(void *arg)
+		{
+			Worker_pool &pool = *(Worker_pool *)arg;
+
+			for (;;) {
+				pool._avail.down();
+
+				Job *job = nullptr;
+				{
+					Genode::Mutex::Guard guard(pool._mutex);
+					pool._jobs.dequeue([&] (Job &j) { job = &j; });
+				}
+
+				if (job)
+					job->execute();
+			}
+			return nullptr;
+		}
+
+	public:
+
+		Worker_pool(unsigned workers)
+		{
+			if (workers > MAX_WORKERS)
+				workers = MAX_WORKERS;
+
+			for (unsigned i = 0; i < workers; i++) {
+				pthread_t thread;
+				if (pthread_create(&thread, nullptr, _entry, this)) {
+					Genode::error("fuse_fs: could not create worker thread");
+					break;
+				}
+				_count++;
+			}
+		}
+
+		unsigned count() const { return _count; }
+
+		void submit(Job &job)
+		{
+			{
+				Genode::Mutex::Guard guard(_mutex);
+				_jobs.enqueue(job);
+			}
+			_avail.up();
+		}
+};
+
+#endif /* _WORKER_POOL_H_ */
@@ -15,9 +15,12 @@
 #include "session_requests.h"
 
 #include <terminal_session/connection.h>
+#include <timer_session/connection.h>
 #include <base/attached_ram_dataspace.h>
+#include <base/attached_rom_dataspace.h>
 #include <base/heap.h>
 #include <base/component.h>
+#include <util/reconstructible.h>
 
 #include <world/rdrand.h>
 
@@ -34,6 +37,7 @@ namespace Jitter_sponge {
 	using namespace Genode;
 
 	struct Generator;
+	struct Reseed_policy;
 	class  Session_component;
 	struct Main;
 
@@ -73,7 +77,7 @@ struct Jitter_sponge::Generator
 
 	void mix()
 	{
-		/* mix at entry and exit of 'read', so 32 bytes are mixed between reads */
+		/* mix fresh entropy before output is used to seed a session */
 
 		if (Genode::Rdrand::supported()) {
 			enum { RDRAND_COUNT = 4 };
@@ -98,6 +102,49 @@ struct Jitter_sponge::Generator
 		if (KeccakWidth1600_SpongePRG_Fetch(&sponge, buf, n))
 			die("failed to fetch from sponge");
 	}
+
+	/**
+	 * Seed a session sponge from freshly mixed output of this generator
+	 */
+	void seed(KeccakWidth1600_SpongePRG_Instance &other)
+	{
+		enum { SEED_BYTES = 64 };
+		unsigned char buf[SEED_BYTES];
+
+		mix();
+		fetch(buf, sizeof(buf));
+
+		bool const failed =
+			KeccakWidth1600_SpongePRG_Feed(&other, buf, sizeof(buf))
+		 || KeccakWidth1600_SpongePRG_Forget(&other);
+
+		Genode::memset(buf, 0, sizeof(buf));
+
+		if (failed)
+			die("failed to seed session sponge");
+	}
+};
+
+
+/**
+ * Policy for reseeding session sponges from the jitter generator
+ *
+ * A session sponge is reseeded once 'bytes' were fetched from it or 'ms'
+ * milliseconds passed since the last seeding, whatever comes first. A value
+ * of zero disables the respective criterion. With both disabled, a sponge
+ * is reseeded at each read.
+ */
+struct Jitter_sponge::Reseed_policy
+{
+	size_t        bytes;
+	unsigned long ms;
+
+	static Reseed_policy from_xml(Xml_node const &config)
+	{
+		return Reseed_policy {
+			.bytes = config.attribute_value("reseed_bytes", (size_t)0x1000),
+			.ms    = config.attribute_value("reseed_ms",    0UL) };
+	}
 };
 
 
@@ -114,27 +161,78 @@ class Jitter_sponge::Session_component final : public Genode::Rpc_object<Termina
 
 		Generator &_generator;
 
+		/* state forked from '_generator', private to this session */
+		KeccakWidth1600_SpongePRG_Instance _sponge { };
+
+		Reseed_policy const  _policy;
+		Timer::Connection   *_timer;
+
+		size_t        _fetched   = 0;
+		unsigned long _seeded_ms = 0;
+
+		void _reseed()
+		{
+			_generator.seed(_sponge);
+			_fetched = 0;
+			if (_timer)
+				_seeded_ms = _timer->elapsed_ms();
+		}
+
+		bool _reseed_due()
+		{
+			if (!_policy.bytes && !_policy.ms)
+				return true;
+
+			if (_policy.bytes && _fetched >= _policy.bytes)
+				return true;
+
+			return _policy.ms && _timer
+			    && _timer->elapsed_ms() - _seeded_ms >= _policy.ms;
+		}
+
 	public:
 
+		/**
+		 * Constructor
+		 *
+		 * \param timer  timer for time-based reseeding, may be nullptr
+		 */
 		Session_component(Genode::Env &env,
 		                  Session_space &space,
 		                  Session_space::Id id,
-		                  Generator &generator)
+		                  Generator &generator,
+		                  size_t buffer_size,
+		                  Reseed_policy policy,
+		                  Timer::Connection *timer)
 		:
 			_sessions_elem(*this, space, id),
-			_io_buffer(env.pd(), env.rm(), 0x1000),
-			_generator(generator)
-		{ }
+			_io_buffer(env.pd(), env.rm(), buffer_size),
+			_generator(generator),
+			_policy(policy), _timer(timer)
+		{
+			if (KeccakWidth1600_SpongePRG_Initialize(&_sponge, 254))
+				_generator.die("failed to initialize session sponge");
+
+			_reseed();
+		}
+
+		~Session_component() {
+			KeccakWidth1600_SpongePRG_Forget(&_sponge); }
 
 		Genode::Dataspace_capability _dataspace() {
 			return _io_buffer.cap(); }
 
 		Genode::size_t _read(Genode::size_t n)
 		{
-			_generator.mix();
+			if (_reseed_due())
+				_reseed();
+
 			n = min(n, _io_buffer.size());
-			_generator.fetch(_io_buffer.local_addr<unsigned char>(), n);
-			_generator.mix();
+			if (KeccakWidth1600_SpongePRG_Fetch(
+				&_sponge, _io_buffer.local_addr<unsigned char>(), n))
+				_generator.die("failed to fetch from session sponge");
+
+			_fetched += n;
 			return n;
 		}
 
@@ -165,25 +263,48 @@ struct Jitter_sponge::Main : Session_request_handler
 	Generator     _generator    { _entropy_heap };
 	Session_space _sessions     { };
 
+	Attached_rom_dataspace _config { _env, "config" };
+
+	Reseed_policy const _reseed_policy =
+		Reseed_policy::from_xml(_config.xml());
+
+	/* maximum size of the I/O buffer of each session */
+	size_t const _buffer_size =
+		_config.xml().attribute_value("buffer", (size_t)0x10000);
+
+	/* a timer is only needed for time-based reseeding */
+	Constructible<Timer::Connection> _timer { };
+
 	void handle_session_create(Session_state::Name const &,
 	                           Parent::Server::Id pid,
 	                           Session_state::Args const &args) override
 	{
 		size_t ram_quota =
 			Arg_string::find_arg(args.string(), "ram_quota").ulong_value(0);
-		size_t session_size =
-			max((size_t)4096, sizeof(Session_component));
 
-		if (ram_quota < session_size)
-			throw Insufficient_ram_quota();
+		/*
+		 * The I/O buffer is sized to the quota donated by the client
+		 * that remains after the session object, but never smaller than
+		 * one page so that plain Terminal connections are served
+		 */
+		enum { MIN_BUFFER_SIZE = 4096 };
+
+		size_t const object_size = max((size_t)4096, sizeof(Session_component));
+		size_t const spare       = ram_quota > object_size
+		                         ? (ram_quota - object_size) & ~(size_t)0xfff : 0;
+
+		size_t const buffer_size =
+			max((size_t)MIN_BUFFER_SIZE,
+			    min(align_addr(_buffer_size, 12), spare));
 
 		Session_space::Id id { pid.value };
 
 		Session_component *session = new (_session_heap)
-			Session_component(_env, _sessions, id, _generator);
+			Session_component(_env, _sessions, id, _generator, buffer_size,
+			                  _reseed_policy,
+			                  _timer.constructed() ? &*_timer : nullptr);
 
 		_env.parent().deliver_session_cap(pid, _env.ep().manage(*session));
-		_generator.mix();
 	}
 
 	void handle_session_upgrade(Parent::Server::Id,
@@ -205,6 +326,9 @@ struct Jitter_sponge::Main : Session_request_handler
 
 	Main(Genode::Env &env) : _env(env)
 	{
+		if (_reseed_policy.ms)
+			_timer.construct(env);
+
 		env.parent().announce("Terminal");
 
 		/* process any requests that have already queued */
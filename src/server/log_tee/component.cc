@@ -16,51 +16,392 @@
 #include <root/component.h>
 #include <base/component.h>
 #include <base/session_label.h>
+#include <base/semaphore.h>
+#include <base/mutex.h>
+#include <base/thread.h>
 #include <base/heap.h>
 #include <base/log.h>
+#include <util/arg_string.h>
+#include <util/construct_at.h>
 #include <util/list.h>
 
 namespace Log_tee {
 
 	using namespace Genode;
 	class Session_component;
+	class Drainer;
 	class Root_component;
 
+	/* craft our own connection to get a label in */
+	struct Log_connection : Connection<Log_session>, Log_session_client
+	{
+		Log_connection(Env &env, char const *args)
+		:
+			Connection<Log_session>(env, session(env.parent(), args)),
+			Log_session_client(cap())
+		{ }
+	};
+
+	/**
+	 * Buffer that collects consecutive lines for a single LOG write
+	 */
+	struct Batch
+	{
+		enum { CAPACITY = Log_session::MAX_STRING_LEN };
+
+		char   data[CAPACITY];
+		size_t length { 0 };
+
+		bool fits(size_t len) const { return length + len < CAPACITY; }
+
+		void append(char const *s, size_t len)
+		{
+			len = min(len, CAPACITY - 1 - length);
+			memcpy(&data[length], s, len);
+			length += len;
+		}
+
+		void flush(Log_session &log)
+		{
+			if (!length)
+				return;
+
+			data[length] = 0;
+			log.write(Log_session::String(data, length + 1));
+			length = 0;
+		}
+	};
 }
 
 
-class Log_tee::Session_component : public Rpc_object<Log_session>
+class Log_tee::Session_component : public Rpc_object<Log_session>,
+                                   public List<Session_component>::Element
 {
+	public:
+
+		/* bounds of the per-session line buffer */
+		enum { MIN_LINES = 4, MAX_LINES = 64 };
+
+		typedef Genode::String<Session_label::capacity()+3> Prefix;
+
+		struct Line
+		{
+			size_t length { 0 };
+			char   text[Log_session::MAX_STRING_LEN];
+		};
+
+		static size_t ring_size(unsigned lines) { return lines*sizeof(Line); }
+
 	private:
 
-		/* craft our own connection to get a label in */
-		struct Log_connection : Connection<Log_session>, Log_session_client
+		/*
+		 * Noncopyable
+		 */
+		Session_component(Session_component const &);
+		Session_component &operator = (Session_component const &);
+
+		Allocator &_alloc;
+		Drainer   &_drainer;
+
+		Log_connection _log;
+
+		Prefix const _prefix;
+
+		/*
+		 * Lines written by the client but not yet passed to the sinks,
+		 * accessed by the entrypoint and the drainer thread
+		 */
+		Mutex          _mutex    { };
+		unsigned const _capacity;
+		Line          *_lines    { (Line *)_alloc.alloc(ring_size(_capacity)) };
+		unsigned       _head     { 0 };
+		unsigned       _count    { 0 };
+
+		/* lines dropped because the buffer was full */
+		unsigned long _dropped          { 0 };
+		unsigned long _dropped_reported { 0 };
+
+		void _wakeup_drainer();
+
+		/**
+		 * Append line with terminating newline to 'batch'
+		 *
+		 * \return false if the batch must be flushed first
+		 */
+		static bool _append(Batch &batch, char const *prefix, size_t plen,
+		                    char const *text, size_t len)
 		{
-			Log_connection(Env &env, char const *args)
-			:
-				Connection<Log_session>(env, session(env.parent(), args)),
-				Log_session_client(cap())
-			{ }
-		} _log;
+			bool const newline = !len || text[len - 1] != '\n';
+			if (batch.length && !batch.fits(plen + len + newline))
+				return false;
 
-		Genode::String<Session_label::capacity()+3> _prefix;
+			batch.append(prefix, plen);
+			batch.append(text, len);
+			if (newline)
+				batch.append("\n", 1);
+			return true;
+		}
 
 	public:
 
-		Session_component(Env &env, Session_label const &label, char const *args)
-		: _log(env, args), _prefix("[", label.string(), "] ") { }
+		/**
+		 * Constructor
+		 *
+		 * \param alloc  allocator of the line buffer, which is paid by the
+		 *               client
+		 */
+		Session_component(Env &env, Allocator &alloc, Drainer &drainer,
+		                  Session_label const &label, char const *args,
+		                  unsigned lines);
+
+		~Session_component();
+
+		/**
+		 * Return true if lines or a drop notice wait for being drained
+		 */
+		bool pending()
+		{
+			Mutex::Guard guard(_mutex);
+			return _count || _dropped != _dropped_reported;
+		}
 
 		void write(Log_session::String const &msg) override
 		{
-			/* write to the dedicated client log session */
-			_log.write(msg);
+			if (!msg.valid_string())
+				return;
+
+			size_t const len = strlen(msg.string());
+			if (!len)
+				return;
+
+			bool wakeup = false;
+			{
+				Mutex::Guard guard(_mutex);
 
-			/* write to our own log session */
-			log(_prefix, msg.string());
+				if (_count == _capacity) {
+					_dropped++;
+					return;
+				}
+
+				Line &line = _lines[(_head + _count) % _capacity];
+				line.length = min(len, sizeof(line.text));
+				memcpy(line.text, msg.string(), line.length);
+
+				wakeup = (_count++ == 0);
+			}
+
+			if (wakeup)
+				_wakeup_drainer();
+		}
+
+		/**
+		 * Pass buffered lines to the dedicated and the own log
+		 *
+		 * Consecutive lines are batched into as few writes as possible.
+		 * The buffer is not locked while writing to the sinks, so that the
+		 * client is never blocked by a slow backend.
+		 */
+		void drain(Log_session &own_log, Batch &own, Batch &dedicated)
+		{
+			auto pass = [&] (char const *text, size_t len)
+			{
+				if (!_append(dedicated, "", 0, text, len)) {
+					dedicated.flush(_log);
+					_append(dedicated, "", 0, text, len);
+				}
+
+				size_t const plen = _prefix.length() - 1;
+				if (!_append(own, _prefix.string(), plen, text, len)) {
+					own.flush(own_log);
+					_append(own, _prefix.string(), plen, text, len);
+				}
+			};
+
+			for (;;) {
+				Line line { };
+				unsigned long dropped = 0;
+				{
+					Mutex::Guard guard(_mutex);
+
+					/* report dropped lines after the lines preceding them */
+					if (_count) {
+						line   = _lines[_head];
+						_head  = (_head + 1) % _capacity;
+						_count--;
+					} else {
+						dropped = _dropped - _dropped_reported;
+						_dropped_reported = _dropped;
+
+						if (!dropped)
+							break;
+					}
+				}
+
+				if (dropped) {
+					String<64> const notice("[log_tee] ", dropped, " lines dropped");
+					pass(notice.string(), notice.length() - 1);
+				} else {
+					pass(line.text, line.length);
+				}
+			}
+
+			dedicated.flush(_log);
+			own.flush(own_log);
 		}
 };
 
 
+/**
+ * Thread that passes the buffered lines of all sessions to the sinks
+ *
+ * The session list is not locked while the drainer writes to the backends.
+ * Instead, the session being drained is marked as busy. Closing that
+ * session waits until the drainer is done with it, closing any other
+ * session does not wait at all.
+ */
+class Log_tee::Drainer : Thread
+{
+	private:
+
+		enum { STACK_SIZE = 4*1024*sizeof(addr_t) };
+
+		/*
+		 * Noncopyable
+		 */
+		Drainer(Drainer const &);
+		Drainer &operator = (Drainer const &);
+
+		Genode::Log_connection _own_log;
+
+		Mutex                   _mutex    { };
+		List<Session_component> _sessions { };
+
+		/* session currently drained, and whether its removal waits */
+		Session_component *_busy            { nullptr };
+		bool               _remove_waiting  { false };
+		Semaphore          _busy_done       { };
+
+		Semaphore _wakeup  { };
+		Mutex     _pending_mutex { };
+		bool      _pending { false };
+
+		Batch _own       { };
+		Batch _dedicated { };
+
+		/**
+		 * Finish draining the busy session and pick the next one
+		 */
+		Session_component *_next_busy()
+		{
+			Mutex::Guard guard(_mutex);
+
+			_busy = nullptr;
+			if (_remove_waiting) {
+				_remove_waiting = false;
+				_busy_done.up();
+			}
+
+			for (Session_component *s = _sessions.first(); s; s = s->next())
+				if (s->pending())
+					return _busy = s;
+
+			return nullptr;
+		}
+
+		void entry() override
+		{
+			for (;;) {
+				_wakeup.down();
+
+				{
+					Mutex::Guard guard(_pending_mutex);
+					_pending = false;
+				}
+
+				while (Session_component *s = _next_busy())
+					s->drain(_own_log, _own, _dedicated);
+			}
+		}
+
+	public:
+
+		Drainer(Env &env)
+		:
+			Thread(env, "drainer", STACK_SIZE),
+			_own_log(env)
+		{
+			start();
+		}
+
+		void wakeup()
+		{
+			{
+				Mutex::Guard guard(_pending_mutex);
+				if (_pending)
+					return;
+				_pending = true;
+			}
+			_wakeup.up();
+		}
+
+		void insert(Session_component &s)
+		{
+			Mutex::Guard guard(_mutex);
+			_sessions.insert(&s);
+		}
+
+		/**
+		 * Remove session and pass its remaining lines to the sinks
+		 *
+		 * Called by the entrypoint, which drains the session itself once
+		 * the drainer thread is not busy with it.
+		 */
+		void remove(Session_component &s)
+		{
+			bool wait = false;
+			{
+				Mutex::Guard guard(_mutex);
+				_sessions.remove(&s);
+
+				if (_busy == &s)
+					wait = _remove_waiting = true;
+			}
+
+			if (wait)
+				_busy_done.down();
+
+			Batch own { }, dedicated { };
+			s.drain(_own_log, own, dedicated);
+		}
+};
+
+
+Log_tee::Session_component::Session_component(Env &env, Allocator &alloc,
+                                              Drainer &drainer,
+                                              Session_label const &label,
+                                              char const *args,
+                                              unsigned lines)
+:
+	_alloc(alloc), _drainer(drainer), _log(env, args),
+	_prefix("[", label.string(), "] "), _capacity(lines)
+{
+	for (unsigned i = 0; i < _capacity; i++)
+		construct_at<Line>(&_lines[i]);
+
+	_drainer.insert(*this);
+}
+
+
+Log_tee::Session_component::~Session_component()
+{
+	_drainer.remove(*this);
+	_alloc.free(_lines, ring_size(_capacity));
+}
+
+
+void Log_tee::Session_component::_wakeup_drainer() { _drainer.wakeup(); }
+
+
 class Log_tee::Root_component :
 	public Genode::Root_component<Log_tee::Session_component>
 {
@@ -68,12 +409,41 @@ class Log_tee::Root_component :
 
 		Env &_env;
 
+		Drainer _drainer { _env };
+
 	protected:
 
 		Log_tee::Session_component *_create_session(char const *args) override
 		{
 			Session_label const label = label_from_args(args);
-			return new (md_alloc()) Session_component(_env, label, args);
+
+			/*
+			 * The line buffer is sized from the half of the client's
+			 * donation that the backend session can spare. The minimum
+			 * buffer of a small donation is paid by log_tee itself.
+			 */
+			using Line = Session_component::Line;
+
+			size_t const ram_quota =
+				Arg_string::find_arg(args, "ram_quota").ulong_value(0);
+			size_t const spare = ram_quota/2;
+
+			unsigned const lines = (unsigned)
+				max((size_t)Session_component::MIN_LINES,
+				    min((size_t)Session_component::MAX_LINES, spare/sizeof(Line)));
+
+			size_t const ring_size = Session_component::ring_size(lines);
+			size_t const charged   = min(spare, ring_size + md_alloc()->overhead(ring_size));
+
+			enum { MAX_ARGS_LEN = 256 };
+			char backend_args[MAX_ARGS_LEN];
+			copy_cstring(backend_args, args, sizeof(backend_args));
+			Arg_string::set_arg(backend_args, sizeof(backend_args), "ram_quota",
+			                    String<32>(ram_quota - charged).string());
+
+			return new (md_alloc())
+				Session_component(_env, *md_alloc(), _drainer, label,
+				                  backend_args, lines);
 		}
 
 	public:
@@ -93,8 +463,8 @@ void Component::construct(Genode::Env &env)
 	/*
 	 * Client sessions are not allocated on seperate dataspaces,
 	 * they are allocated on a heap against the component's own
-	 * RAM quota. The session RAM donation is passed verbatim to
-	 * the backend session.
+	 * RAM quota. The part of the session RAM donation that is not
+	 * spent on the line buffer is passed to the backend session.
 	 */
 
 	static Genode::Heap heap(env.ram(), env.rm());
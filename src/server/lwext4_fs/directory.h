@@ -14,6 +14,9 @@
 #ifndef _DIRECTORY_H_
 #define _DIRECTORY_H_
 
+/* Genode includes */
+#include <base/allocator.h>
+
 /* lwext4 includes */
 #include <ext4.h>
 
@@ -30,8 +33,132 @@ class Lwext4_fs::Directory : public Node
 {
 	private:
 
-		ext4_dir _dir { };
-		int64_t  _prev_index { -1 };
+		/*
+		 * Noncopyable
+		 */
+		Directory(Directory const &);
+		Directory &operator = (Directory const &);
+
+		/*
+		 * Index of directory entries
+		 *
+		 * For every STRIDE-th entry, the index records the offset within the
+		 * directory file, at which 'ext4_dir_entry_next' continues with this
+		 * entry. Random-access reads start at the nearest recorded offset
+		 * and walk at most STRIDE - 1 entries. The index is filled while
+		 * reading and dropped whenever any directory was modified.
+		 */
+		enum { STRIDE = 16 };
+
+		Allocator &_alloc;
+
+		ext4_dir  _dir { };
+		uint64_t  _next_index { 0 };   /* index of entry returned next */
+
+		uint64_t *_offsets      { nullptr };
+		size_t    _offsets_num  { 0 };
+		size_t    _offsets_max  { 0 };
+		bool      _count_valid  { false };
+		uint64_t  _count        { 0 };
+		unsigned  _generation   { 0 };
+
+		static unsigned &_modifications()
+		{
+			static unsigned count = 0;
+			return count;
+		}
+
+		void _drop_index()
+		{
+			if (_offsets)
+				_alloc.free(_offsets, _offsets_max*sizeof(uint64_t));
+
+			_offsets     = nullptr;
+			_offsets_num = 0;
+			_offsets_max = 0;
+			_count_valid = false;
+			_generation  = _modifications();
+
+			/* force repositioning at the next read */
+			_next_index  = ~0ULL;
+		}
+
+		void _record_offset()
+		{
+			if (_offsets_num == _offsets_max) {
+				size_t const max = _offsets_max ? 2*_offsets_max : 64;
+
+				uint64_t *offsets = nullptr;
+				try { offsets = (uint64_t *)_alloc.alloc(max*sizeof(uint64_t)); }
+				catch (...) { return; /* not indexing is slow but correct */ }
+
+				if (_offsets) {
+					memcpy(offsets, _offsets, _offsets_num*sizeof(uint64_t));
+					_alloc.free(_offsets, _offsets_max*sizeof(uint64_t));
+				}
+				_offsets     = offsets;
+				_offsets_max = max;
+			}
+			_offsets[_offsets_num++] = _dir.next_off;
+		}
+
+		/**
+		 * Return next valid entry and record its offset if needed
+		 */
+		ext4_direntry const *_next_entry()
+		{
+			if (_next_index % STRIDE == 0 && _next_index / STRIDE == _offsets_num)
+				_record_offset();
+
+			while (ext4_direntry const *dentry = ext4_dir_entry_next(&_dir)) {
+
+				/* ignore entries without proper inode */
+				if (!dentry->inode) {
+					warning("skip dentry with empty inode");
+					continue;
+				}
+
+				_next_index++;
+				return dentry;
+			}
+
+			_count       = _next_index;
+			_count_valid = true;
+			return nullptr;
+		}
+
+		/**
+		 * Position the directory stream in front of the entry 'index'
+		 *
+		 * \return false if the directory has fewer entries
+		 */
+		bool _seek(uint64_t const index)
+		{
+			if (_generation != _modifications())
+				_drop_index();
+
+			if (index == _next_index)
+				return true;
+
+			if (_count_valid && index >= _count)
+				return false;
+
+			/* continue from the nearest recorded entry */
+			if (_offsets_num) {
+				uint64_t const slot = min(index / STRIDE, (uint64_t)_offsets_num - 1);
+				_dir.next_off = _offsets[slot];
+				_next_index   = slot * STRIDE;
+			} else {
+				_dir.next_off = 0;
+				_next_index   = 0;
+			}
+
+			while (_next_index < index)
+				if (!_next_entry())
+					return false;
+
+			return true;
+		}
 
 		void _open(char const *path, bool create)
 		{
@@ -61,9 +188,44 @@ class Lwext4_fs::Directory : public Node
 
 	public:
 
-		Directory(char const *name, bool create = false) : Node(name, create)
+		Directory(Allocator &alloc, char const *name, bool create = false)
+		:
+			Node(name, create), _alloc(alloc)
 		{
 			_open(name, create);
+			_generation = _modifications();
+		}
+
+		~Directory() { _drop_index(); }
+
+		/**
+		 * Invalidate the entry indices of all open directories
+		 *
+		 * Must be called whenever a directory entry is added or removed.
+		 */
+		static void modified() { _modifications()++; }
+
+		/**
+		 * Number of directory entries
+		 */
+		uint64_t count()
+		{
+			if (_generation != _modifications())
+				_drop_index();
+
+			if (!_count_valid) {
+				/* walk to the end, starting at the last recorded entry */
+				_seek(_offsets_num ? (_offsets_num - 1) * STRIDE : 0);
+				while (_next_entry());
+			}
+			return _count;
+		}
+
+		Status status() override
+		{
+			Status status = Node::status();
+			status.size = count() * sizeof(Directory_entry);
+			return status;
 		}
 
 		size_t read(char *dest, size_t len, seek_off_t seek_offset)
@@ -80,38 +242,22 @@ class Lwext4_fs::Directory : public Node
 
 			Directory_entry * const e = (Directory_entry *)(dest);
 
-			int64_t const index = seek_offset / sizeof(Directory_entry);
+			uint64_t const index = seek_offset / sizeof(Directory_entry);
 
 			/*
 			 * Manipulate ext4_dir struct directly which AFAICT is
 			 * okay and let lwext4 deal with it to safe CPU time.
 			 */
-			if (index != (_prev_index + 1)) {
-				_dir.next_off = index > 0 ? index : 0;
-			}
-
-			ext4_direntry const *dentry = nullptr;
-			while (true) {
-				dentry = ext4_dir_entry_next(&_dir);
-				if (!dentry) { break; }
-
-				/* ignore entries without proper inode */
-				if (!dentry->inode) {
-					warning("skip dentry with empty inode");
-					continue;
-				}
-
-				size_t const len = (size_t)(dentry->name_length + 1) > sizeof(e->name)
-				                 ? sizeof(e->name) : dentry->name_length + 1;
-				copy_cstring(e->name.buf, reinterpret_cast<char const*>(dentry->name), len);
-
-				e->inode = dentry->inode;
-				break;
-			}
+			if (!_seek(index)) { throw Node::Eof(); }
 
+			ext4_direntry const *dentry = _next_entry();
 			if (!dentry) { throw Node::Eof(); }
 
-			_prev_index = index;
+			size_t const len = (size_t)(dentry->name_length + 1) > sizeof(e->name)
+			                 ? sizeof(e->name) : dentry->name_length + 1;
+			copy_cstring(e->name.buf, reinterpret_cast<char const*>(dentry->name), len);
+
+			e->inode = dentry->inode;
 
 			switch (dentry->inode_type) {
 			case EXT4_DE_DIR:     e->type = Node_type::DIRECTORY;       break;
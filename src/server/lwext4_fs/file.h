@@ -14,11 +14,18 @@
 #ifndef _FILE_H_
 #define _FILE_H_
 
+/* Genode includes */
+#include <base/allocator.h>
+
 /* local includes */
+#include <file_system.h>
 #include <node.h>
 
 /* lwext4 includes */
 #include <ext4.h>
+#include <ext4_blockdev.h>
+#include <ext4_super.h>
+#include <ext4_types.h>
 
 namespace Lwext4_fs {
 	using namespace Genode;
@@ -29,11 +36,236 @@ class Lwext4_fs::File : public Node
 {
 	private:
 
+		/*
+		 * Noncopyable
+		 */
+		File(File const &);
+		File &operator = (File const &);
+
 		ext4_file _file;
 
+		/*
+		 * Mapping of the file's extents
+		 *
+		 * Reads of whole blocks are served by looking up the physical
+		 * blocks in the mapping and reading each contiguous run with one
+		 * device request, bypassing the block cache as 'ext4_fread' does
+		 * for whole blocks. The mapping is built once from the extent tree
+		 * and dropped whenever any file is written or truncated. Holes,
+		 * unwritten extents, and partial blocks take the regular path.
+		 */
+		struct Extent
+		{
+			uint32_t lblk;
+			uint32_t count;
+			uint64_t pblk;
+		};
+
+		enum {
+			MAX_EXTENTS     = 16*1024,
+			MAX_EXTENT_LEN  = 1u << 15, /* longer extents are unwritten */
+			EXTENT_MAGIC    = 0xf30a,
+			MAX_TREE_DEPTH  = 5,
+		};
+
+		Allocator &_alloc;
+
+		bool      _mapped       { false };
+		bool      _mappable     { true };
+		unsigned  _generation   { 0 };
+		uint32_t  _block_size   { 0 };
+		Extent   *_extents      { nullptr };
+		size_t    _extents_num  { 0 };
+		size_t    _extents_max  { 0 };
+
+		static unsigned &_modifications()
+		{
+			static unsigned count = 0;
+			return count;
+		}
+
+		void _drop_mapping()
+		{
+			if (_extents)
+				_alloc.free(_extents, _extents_max*sizeof(Extent));
+
+			_extents     = nullptr;
+			_extents_num = 0;
+			_extents_max = 0;
+			_mapped      = false;
+		}
+
+		bool _add_extent(Extent const &extent)
+		{
+			if (_extents_num == _extents_max) {
+				size_t const max = _extents_max ? 2*_extents_max : 16;
+				if (max > MAX_EXTENTS)
+					return false;
+
+				Extent *extents = nullptr;
+				try { extents = (Extent *)_alloc.alloc(max*sizeof(Extent)); }
+				catch (...) { return false; }
+
+				if (_extents) {
+					memcpy(extents, _extents, _extents_num*sizeof(Extent));
+					_alloc.free(_extents, _extents_max*sizeof(Extent));
+				}
+				_extents     = extents;
+				_extents_max = max;
+			}
+			_extents[_extents_num++] = extent;
+			return true;
+		}
+
+		/**
+		 * Collect extents of the (sub-)tree at 'header'
+		 */
+		bool _collect(ext4_extent_header const *header, unsigned level)
+		{
+			if (to_le16(header->magic) != EXTENT_MAGIC || level > MAX_TREE_DEPTH)
+				return false;
+
+			unsigned const entries = to_le16(header->entries_count);
+
+			if (to_le16(header->depth) == 0) {
+				ext4_extent const *e = (ext4_extent const *)(header + 1);
+				for (unsigned i = 0; i < entries; i++, e++) {
+
+					unsigned const len = to_le16(e->block_count);
+					if (len > MAX_EXTENT_LEN)
+						continue;
+
+					Extent const extent {
+						to_le32(e->first_block), len,
+						((uint64_t)to_le16(e->start_hi) << 32) | to_le32(e->start_lo) };
+
+					if (!_add_extent(extent))
+						return false;
+				}
+				return true;
+			}
+
+			ext4_extent_index const *idx = (ext4_extent_index const *)(header + 1);
+			for (unsigned i = 0; i < entries; i++, idx++) {
+
+				uint64_t const leaf = ((uint64_t)to_le16(idx->leaf_hi) << 32)
+				                    | to_le32(idx->leaf_lo);
+
+				/* index blocks are meta data, read them via the block cache */
+				ext4_blockdev * const bdev = File_system::block_device();
+				ext4_block block { };
+				if (ext4_block_get(bdev, &block, leaf) != EOK)
+					return false;
+
+				bool const ok = _collect((ext4_extent_header const *)block.data,
+				                         level + 1);
+				ext4_block_set(bdev, &block);
+				if (!ok)
+					return false;
+			}
+			return true;
+		}
+
+		bool _map()
+		{
+			if (_generation != _modifications()) {
+				_drop_mapping();
+				_generation = _modifications();
+			}
+
+			if (_mapped)
+				return true;
+
+			if (!_mappable || !File_system::block_device())
+				return false;
+
+			struct ext4_inode inode;
+			unsigned int      ino;
+			if (ext4_raw_inode_fill(name(), &ino, &inode)
+			 || !ext4_inode_has_flag(&inode, EXT4_INODE_FLAG_EXTENTS)) {
+				_mappable = false;
+				return false;
+			}
+
+			if (!_collect((ext4_extent_header const *)inode.blocks, 0)) {
+				warning("could not map extents of '", name(), "'");
+				_drop_mapping();
+				_mappable = false;
+				return false;
+			}
+
+			_mapped = true;
+			return true;
+		}
+
+		/**
+		 * Look up the physical run of logical block 'lblk'
+		 *
+		 * \param count  maximum number of blocks, reduced to the
+		 *               contiguous part of the run
+		 */
+		bool _lookup(uint32_t lblk, uint64_t &pblk, uint32_t &count) const
+		{
+			size_t lo = 0, hi = _extents_num;
+			while (lo < hi) {
+				size_t const mid = (lo + hi) / 2;
+				Extent const &e = _extents[mid];
+
+				if (lblk < e.lblk) { hi = mid; continue; }
+				if (lblk >= e.lblk + e.count) { lo = mid + 1; continue; }
+
+				uint32_t const skip = lblk - e.lblk;
+				pblk  = e.pblk + skip;
+				count = min(count, e.count - skip);
+				return true;
+			}
+			return false;
+		}
+
+		size_t _read(char *dest, size_t len, seek_off_t seek_offset)
+		{
+			int err = ext4_fseek(&_file, seek_offset, SEEK_SET);
+			if (err) {
+				error(__func__, ": invalid seek offset");
+				return 0;
+			}
+
+			Genode::size_t bytes = 0;
+			err = ext4_fread(&_file, dest, len, &bytes);
+			if (err) {
+				error(__func__, ": error: ", err);
+				return 0;
+			}
+			return bytes;
+		}
+
+		/**
+		 * Read whole blocks directly from the device
+		 *
+		 * \return number of bytes read, which may be zero if the first
+		 *         block is not covered by the mapping
+		 */
+		size_t _read_blocks(char *dest, size_t len, seek_off_t seek_offset)
+		{
+			uint32_t const lblk  = seek_offset / _block_size;
+			uint32_t       count = len / _block_size;
+			uint64_t       pblk  = 0;
+
+			if (!_lookup(lblk, pblk, count))
+				return 0;
+
+			if (ext4_blocks_get_direct(File_system::block_device(), dest,
+			                           pblk, count) != EOK)
+				return 0;
+
+			return count * _block_size;
+		}
+
 	public:
 
-		File(const char *name, Mode mode, bool create) : Node(name, create)
+		File(Allocator &alloc, const char *name, Mode mode, bool create)
+		:
+			Node(name, create), _alloc(alloc)
 		{
 			int flags = 0;
 			if (create) { flags |= O_CREAT; }
@@ -58,10 +290,15 @@ class Lwext4_fs::File : public Node
 					throw Permission_denied();
 				}
 			}
+
+			struct ext4_sblock *sb = nullptr;
+			if (ext4_get_sblock(name, &sb) == EOK)
+				_block_size = ext4_sb_get_block_size(sb);
 		}
 
 		~File()
 		{
+			_drop_mapping();
 			ext4_fclose(&_file);
 		}
 
@@ -69,6 +306,47 @@ class Lwext4_fs::File : public Node
 		{
 			bool const to_end = seek_offset == (seek_off_t)(~0);
 
+			/* large reads use the extent mapping for whole blocks */
+			if (!to_end && _block_size && len >= 2*_block_size && _map()) {
+
+				uint64_t const size = ext4_fsize(&_file);
+				if (seek_offset >= size)
+					throw Node::Eof();
+
+				len = (size_t)min((uint64_t)len, size - seek_offset);
+
+				size_t done = 0;
+
+				/* partial first block */
+				if (seek_offset % _block_size) {
+					size_t const n = min(len, (size_t)(_block_size - seek_offset % _block_size));
+					size_t const bytes = _read(dest, n, seek_offset);
+					if (bytes != n)
+						return bytes;
+					done = n;
+				}
+
+				while (len - done >= _block_size) {
+					size_t bytes = _read_blocks(dest + done, len - done,
+					                            seek_offset + done);
+
+					/* holes and unwritten extents */
+					if (!bytes)
+						bytes = _read(dest + done, _block_size, seek_offset + done);
+
+					if (!bytes)
+						return done;
+
+					done += bytes;
+				}
+
+				/* partial last block */
+				if (done < len)
+					done += _read(dest + done, len - done, seek_offset + done);
+
+				return done;
+			}
+
 			int err = ext4_fseek(&_file, to_end ? 0 : seek_offset,
 			                             to_end ? SEEK_END : SEEK_SET);
 			if (err) {
@@ -99,6 +377,9 @@ class Lwext4_fs::File : public Node
 				return 0;
 			}
 
+			/* the write may allocate blocks or change the extent tree */
+			_modifications()++;
+
 			Genode::size_t bytes = 0;
 			err = ext4_fwrite(&_file, src, len, &bytes);
 			if (err) {
@@ -111,6 +392,8 @@ class Lwext4_fs::File : public Node
 
 		void truncate(file_size_t size) override
 		{
+			_modifications()++;
+
 			int const err = ext4_ftruncate(&_file, size);
 			if (err) { error(__func__, ": error: ", err); }
 		}
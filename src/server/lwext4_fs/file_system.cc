@@ -25,15 +25,21 @@
 static char const *_fs_name = "ext4";
 static char const *_fs_mp   = "/";
 static bool        _cache_write_back = false;
+static ext4_blockdev *_block_device = nullptr;
 
 
 void File_system::init(ext4_blockdev *bd)
 {
 	int err = ext4_device_register(bd, _fs_name);
 	if (err) { throw Init_failed(); }
+
+	_block_device = bd;
 }
 
 
+ext4_blockdev *File_system::block_device() { return _block_device; }
+
+
 void File_system::mount_fs(Genode::Xml_node config)
 {
 	int err = ext4_mount(_fs_name, _fs_mp, false);
@@ -29,6 +29,11 @@ namespace File_system {
 	struct Sync_failed    : Genode::Exception { };
 
 	void init(ext4_blockdev*);
+
+	/**
+	 * Block device registered by 'init'
+	 */
+	ext4_blockdev *block_device();
 	void mount_fs(Genode::Xml_node);
 	void unmount_fs();
 	void sync();
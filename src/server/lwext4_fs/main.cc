@@ -190,7 +190,7 @@ class Lwext4_fs::Session_component : public File_system::Session_rpc_object
 			Session_rpc_object(env.ram().alloc(tx_buf_size), env.rm(), env.ep().rpc_ep()),
 			_env(env),
 			_md_alloc(md_alloc),
-			_root(*new (&_md_alloc) Directory(root_dir, false)),
+			_root(*new (&_md_alloc) Directory(_md_alloc, root_dir, false)),
 			_writable(writeable),
 			_process_packet_handler(env.ep(), *this, &Session_component::_process_packets)
 		{
@@ -239,9 +239,12 @@ class Lwext4_fs::Session_component : public File_system::Session_rpc_object
 					throw Invalid_name();
 				}
 
-				File *file = new (&_md_alloc) File(absolute_path.base(),
+				File *file = new (&_md_alloc) File(_md_alloc, absolute_path.base(),
 				                                   mode, create);
 
+				if (create)
+					Directory::modified();
+
 				Open_node *open_file =
 					new (&_md_alloc) Open_node(*file, _open_node_registry);
 
@@ -279,6 +282,9 @@ class Lwext4_fs::Session_component : public File_system::Session_rpc_object
 
 				Symlink *link = new (&_md_alloc) Symlink(absolute_path.base(), create);
 
+				if (create)
+					Directory::modified();
+
 				Open_node *open_file =
 					new (&_md_alloc) Open_node(*link, _open_node_registry);
 
@@ -317,7 +323,10 @@ class Lwext4_fs::Session_component : public File_system::Session_rpc_object
 				throw Name_too_long();
 			}
 
-			Directory *dir = new (&_md_alloc) Directory(absolute_path.base(), create);
+			Directory *dir = new (&_md_alloc) Directory(_md_alloc, absolute_path.base(), create);
+
+			if (create)
+				Directory::modified();
 
 			Open_node *open_dir =
 				new (_md_alloc) Open_node(*dir, _open_node_registry);
@@ -427,6 +436,8 @@ class Lwext4_fs::Session_component : public File_system::Session_rpc_object
 						Genode::error("unlink: error: ", err);
 						throw Invalid_name();
 					}
+
+					Directory::modified();
 				}
 			};
 
@@ -494,6 +505,8 @@ class Lwext4_fs::Session_component : public File_system::Session_rpc_object
 						Genode::error("move: error: ", err);
 						throw Permission_denied();
 					}
+
+					Directory::modified();
 				};
 
 				try {
@@ -0,0 +1,161 @@
+/*
+ * \brief  Throughput and latency metrics of the SSH server
+ * \date   2026-10-19
+ */
+
+/*
+ * Copyright (C) 2026 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU Affero General Public License version 3.
+ */
+
+#ifndef _SSH_TERMINAL_METRICS_H_
+#define _SSH_TERMINAL_METRICS_H_
+
+/* Genode includes */
+#include <util/xml_generator.h>
+
+
+namespace Ssh {
+
+	struct Counter;
+	struct Latency_histogram;
+	struct Metrics;
+	struct Session_metrics;
+}
+
+
+/**
+ * Statistics counter updated by event loops and SFTP workers
+ *
+ * Counters are only read for reporting, relaxed atomics suffice.
+ */
+struct Ssh::Counter
+{
+	unsigned long _value { 0 };
+
+	void add(unsigned long n) { __atomic_fetch_add(&_value, n, __ATOMIC_RELAXED); }
+
+	unsigned long value() const { return __atomic_load_n(&_value, __ATOMIC_RELAXED); }
+};
+
+
+struct Ssh::Latency_histogram
+{
+	enum { NUM_BUCKETS = 8 };
+
+	/* upper bounds of the buckets in microseconds, the last is unbounded */
+	static unsigned long limit_us(unsigned i)
+	{
+		static unsigned long const limits[NUM_BUCKETS - 1] = {
+			100, 1000, 10*1000, 50*1000, 100*1000, 500*1000, 1000*1000 };
+
+		return i < NUM_BUCKETS - 1 ? limits[i] : ~0UL;
+	}
+
+	Counter _buckets[NUM_BUCKETS] { };
+	Counter _count  { };
+	Counter _sum_us { };
+
+	void record(unsigned long us)
+	{
+		unsigned i = 0;
+		while (us > limit_us(i)) i++;
+
+		_buckets[i].add(1);
+		_count.add(1);
+		_sum_us.add(us);
+	}
+
+	void generate(Genode::Xml_generator &xml, char const *type) const
+	{
+		xml.node("latency", [&] () {
+			unsigned long const count = _count.value();
+
+			xml.attribute("type",    type);
+			xml.attribute("count",   count);
+			xml.attribute("avg_us",  count ? _sum_us.value() / count : 0);
+
+			for (unsigned i = 0; i < NUM_BUCKETS; i++) {
+				xml.node("bucket", [&] () {
+					if (i < NUM_BUCKETS - 1)
+						xml.attribute("le_us", limit_us(i));
+					xml.attribute("count", _buckets[i].value());
+				});
+			}
+		});
+	}
+};
+
+
+/**
+ * Server-wide metrics
+ *
+ * The traffic counters hold the totals of closed sessions only. Live
+ * sessions keep their own counters, which are added up when reporting.
+ */
+struct Ssh::Metrics
+{
+	Counter accepted      { };
+	Counter closed        { };
+	Counter auth_failures { };
+	Counter bytes_in      { };
+	Counter bytes_out     { };
+	Counter window_stalls { };
+	Counter sftp_ops      { };
+
+	Latency_histogram handshake { };
+	Latency_histogram sftp_op   { };
+};
+
+
+struct Ssh::Session_metrics
+{
+	Metrics &global;
+
+	unsigned long const accepted_us;
+	unsigned long       handshake_us { 0 };
+
+	Counter bytes_in      { };
+	Counter bytes_out     { };
+	Counter window_stalls { };
+	Counter sftp_ops      { };
+
+	Session_metrics(Metrics &global, unsigned long accepted_us)
+	: global(global), accepted_us(accepted_us) { }
+
+	/**
+	 * Account data written to the channel
+	 *
+	 * A write that was cut short indicates an exhausted channel window.
+	 */
+	void sent(int num_bytes, unsigned long requested)
+	{
+		if (num_bytes > 0)
+			bytes_out.add(num_bytes);
+
+		if (num_bytes >= 0 && (unsigned long)num_bytes < requested)
+			window_stalls.add(1);
+	}
+
+	void sftp_op(unsigned long us)
+	{
+		sftp_ops.add(1);
+		global.sftp_op.record(us);
+	}
+
+	/**
+	 * Add counters of closing session to global totals
+	 */
+	void retire()
+	{
+		global.closed       .add(1);
+		global.bytes_in     .add(bytes_in.value());
+		global.bytes_out    .add(bytes_out.value());
+		global.window_stalls.add(window_stalls.value());
+		global.sftp_ops     .add(sftp_ops.value());
+	}
+};
+
+#endif /* _SSH_TERMINAL_METRICS_H_ */
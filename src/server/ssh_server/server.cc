@@ -45,34 +45,60 @@ extern ssh_channel session_channel_open_request_cb(ssh_session, void *);
 static int write_avail_cb(socket_t fd, int revents, void *userdata);
 
 
-Ssh::Terminal_session::Terminal_session(Genode::Registry<Terminal_session> &reg,
-                                        Ssh::Terminal &conn,
-                                        ssh_event event_loop)
+Ssh::Event_loop::Event_loop(Server &server, unsigned index)
 :
-	Element(reg, *this), conn(conn), _event_loop(event_loop)
+	server(server), index(index), event(ssh_event_new())
 {
-	if (pipe(_fds)) {
+	if (!event) {
+		Genode::error("could not create event loop ", index);
+		throw Server::Init_failed();
+	}
+
+	server._initialize_session_callbacks(*this);
+	server._initialize_channel_callbacks(*this);
+
+	/* add pipe to wake up loop on late connecting terminal */
+	if (pipe(wake_fds) ||
+		ssh_event_add_fd(event,
+		                 wake_fds[0],
+		                 POLLIN,
+		                 write_avail_cb,
+		                 this) != SSH_OK ) {
 		Genode::error("Failed to create wakeup pipe");
-		throw -1;
+		throw Server::Init_failed();
 	}
-	conn.write_avail_fd = _fds[1];
+}
+
 
-	_state = PIPE_INITIALIZED;
+Ssh::Event_loop::~Event_loop()
+{
+	close(wake_fds[0]);
+	close(wake_fds[1]);
 }
 
-void Ssh::Terminal_session::initialize_ssh_event_fds()
+
+void Ssh::Event_loop::start()
 {
-	if (_state != PIPE_INITIALIZED ||
-	    ssh_event_add_fd(_event_loop,
-	                     _fds[0],
-	                     POLLIN,
-	                     write_avail_cb,
-	                     this) != SSH_OK) {
-		Genode::error("Failed to initialize ssh event file descriptors");
-		throw -1;
+	if (pthread_create(&thread, nullptr, entry, this)) {
+		Genode::error("could not create event thread");
+		throw Server::Init_failed();
 	}
+}
 
-	_state = SSH_INITIALIZED;
+
+void *Ssh::Event_loop::entry(void *arg)
+{
+	Ssh::Event_loop *loop = reinterpret_cast<Ssh::Event_loop *>(arg);
+	loop->loop();
+	return nullptr;
+}
+
+
+void Ssh::Event_loop::wake()
+{
+	/* wake the event loop up */
+	char c = 1;
+	::write(wake_fds[1], &c, sizeof(c));
 }
 
 
@@ -101,8 +127,6 @@ Ssh::Server::Server(Genode::Env &env,
 		ssh_bind_options_set(_ssh_bind, SSH_BIND_OPTIONS_BINDPORT, &_port);
 
 		_initialize_bind_callbacks();
-		_initialize_session_callbacks();
-		_initialize_channel_callbacks();
 
 		/*
 		 * Always try to load all types of host key and error-out if
@@ -117,78 +141,73 @@ Ssh::Server::Server(Genode::Env &env,
 			throw Init_failed();
 		}
 
-		_event_loop = ssh_event_new();
-
 		if (ssh_bind_listen(_ssh_bind) < 0) {
 			Genode::error("could not listen on port ", _port, ": ",
 			              ssh_get_error(_ssh_bind));
 			throw Init_failed();
 		}
 
-		/* add AFTER(!) ssh_bind_listen call */
-		if (ssh_event_add_bind(_event_loop, _ssh_bind) < 0) {
+		for (unsigned i = 0; i < _num_loops; i++)
+			_loops[i] = new (&_heap) Event_loop(*this, i);
+
+		/*
+		 * Incoming connections are accepted by the first loop, add
+		 * AFTER(!) ssh_bind_listen call
+		 */
+		if (ssh_event_add_bind(_loops[0]->event, _ssh_bind) < 0) {
 			Genode::error("unable to add server to event loop: ",
 			              ssh_get_error(_ssh_bind));
 			throw Init_failed();
 		}
 
-		/* add pipe to wake up loop on late connecting terminal */
-		if (pipe(_server_fds) ||
-			ssh_event_add_fd(_event_loop,
-			                 _server_fds[0],
-			                 POLLIN,
-			                 write_avail_cb,
-			                 this) != SSH_OK ) {
-			Genode::error("Failed to create wakeup pipe");
-			throw -1;
-		}
+		_for_each_loop([&] (Event_loop &loop) { loop.start(); });
 
-		if (pthread_create(&_event_thread, nullptr, _server_loop, this)) {
-			Genode::error("could not create event thread");
-			throw Init_failed();
-		}
-
-		Genode::log("Listen on port: ", _port);
+		Genode::log("Listen on port: ", _port, " with ", _num_loops,
+		            " event loop", _num_loops > 1 ? "s" : "");
 	}); /* Libc::with_libc */
 }
 
 
 Ssh::Server::~Server()
 {
-	close(_server_fds[0]);
-	close(_server_fds[1]);
+	_for_each_loop([&] (Event_loop &loop) {
+		Genode::destroy(&_heap, &loop); });
 }
 
 
-void Ssh::Server::_initialize_channel_callbacks()
+void Ssh::Server::_initialize_channel_callbacks(Event_loop &loop)
 {
-	Genode::memset(&_channel_cb, 0, sizeof(_channel_cb));
+	ssh_channel_callbacks_struct &cb = loop.channel_cb;
+
+	Genode::memset(&cb, 0, sizeof(cb));
 
-	_channel_cb.userdata                           = this;
-	_channel_cb.channel_data_function              = channel_data_cb;
-	_channel_cb.channel_eof_function               = channel_eof_cb;
-	_channel_cb.channel_env_request_function       = channel_env_request_cb;
-	_channel_cb.channel_pty_request_function       = channel_pty_request_cb;
-	_channel_cb.channel_pty_window_change_function = channel_pty_window_change_cb;
-	_channel_cb.channel_shell_request_function     = channel_shell_request_cb;
-	_channel_cb.channel_exec_request_function      = channel_exec_request_cb;
-	_channel_cb.channel_subsystem_request_function = channel_subsystem_request_cb;
+	cb.userdata                           = &loop;
+	cb.channel_data_function              = channel_data_cb;
+	cb.channel_eof_function               = channel_eof_cb;
+	cb.channel_env_request_function       = channel_env_request_cb;
+	cb.channel_pty_request_function       = channel_pty_request_cb;
+	cb.channel_pty_window_change_function = channel_pty_window_change_cb;
+	cb.channel_shell_request_function     = channel_shell_request_cb;
+	cb.channel_exec_request_function      = channel_exec_request_cb;
+	cb.channel_subsystem_request_function = channel_subsystem_request_cb;
 
-	ssh_callbacks_init(&_channel_cb);
+	ssh_callbacks_init(&cb);
 }
 
 
-void Ssh::Server::_initialize_session_callbacks()
+void Ssh::Server::_initialize_session_callbacks(Event_loop &loop)
 {
-	Genode::memset(&_session_cb, 0, sizeof(_session_cb));
+	ssh_server_callbacks_struct &cb = loop.session_cb;
 
-	_session_cb.userdata                              = this;
-	_session_cb.auth_password_function                = session_auth_password_cb;
-	_session_cb.auth_pubkey_function                  = session_auth_pubkey_cb;
-	_session_cb.service_request_function              = session_service_request_cb;
-	_session_cb.channel_open_request_session_function = session_channel_open_request_cb;
+	Genode::memset(&cb, 0, sizeof(cb));
 
-	ssh_callbacks_init(&_session_cb);
+	cb.userdata                              = &loop;
+	cb.auth_password_function                = session_auth_password_cb;
+	cb.auth_pubkey_function                  = session_auth_pubkey_cb;
+	cb.service_request_function              = session_service_request_cb;
+	cb.channel_open_request_session_function = session_channel_open_request_cb;
+
+	ssh_callbacks_init(&cb);
 }
 
 
@@ -201,16 +220,16 @@ void Ssh::Server::_initialize_bind_callbacks()
 }
 
 
-void Ssh::Server::_cleanup_session(Session &s)
+void Ssh::Event_loop::cleanup_session(Session &s)
 {
 	if (s.auth_sucessful) {
-		_log_logout(s);
+		server._log_logout(s);
 	}
 
 	ssh_channel_free(s.channel);
 	s.channel = nullptr;
 
-	ssh_event_remove_session(_event_loop, s.session);
+	ssh_event_remove_session(event, s.session);
 	ssh_disconnect(s.session);
 	ssh_free(s.session);
 	s.session = nullptr;
@@ -221,7 +240,8 @@ void Ssh::Server::_cleanup_session(Session &s)
 
 	try {
 		if (s.terminal_requested) {
-			_request_terminal_reporter.generate([&] (Xml_generator& xml) {
+			Util::Pthread_mutex::Guard guard(server._request_terminal_reporter_mutex);
+			server._request_terminal_reporter.generate([&] (Xml_generator& xml) {
 				xml.attribute("user", s.user());
 				xml.attribute("exit", "now");
 			});
@@ -231,18 +251,20 @@ void Ssh::Server::_cleanup_session(Session &s)
 		Genode::warning("could not enable exit reporting");
 	}
 
-	Genode::destroy(&_heap, &s);
+	s.metrics.retire();
+
+	Genode::destroy(&server._heap, &s);
 }
 
 
-void Ssh::Server::_cleanup_sessions()
+void Ssh::Event_loop::cleanup_sessions()
 {
 	auto cleanup = [&] (Session &s) {
 		if (!ssh_is_connected(s.session)) {
-			_cleanup_session(s);
+			cleanup_session(s);
 		}
 	};
-	_sessions.for_each(cleanup);
+	sessions.for_each(cleanup);
 }
 
 
@@ -262,6 +284,8 @@ void Ssh::Server::_parse_config(Genode::Xml_node const &config)
 		_logins.for_each(print);
 	}
 
+	_configure_metrics(config);
+
 	if (_config_once) { return; }
 
 	_config_once = true;
@@ -279,6 +303,12 @@ void Ssh::Server::_parse_config(Genode::Xml_node const &config)
 		throw Invalid_config();
 	}
 
+	_num_loops = config.attribute_value("event_threads", 1u);
+	if (_num_loops < 1 || _num_loops > MAX_EVENT_LOOPS) {
+		error("event_threads must be between 1 and ", (unsigned)MAX_EVENT_LOOPS);
+		throw Invalid_config();
+	}
+
 	_rsa_key     = config.attribute_value("rsa_key",     Filename());
 	_ecdsa_key   = config.attribute_value("ecdsa_key",   Filename());
 	_ed25519_key = config.attribute_value("ed25519_key", Filename());
@@ -300,15 +330,7 @@ void Ssh::Server::_load_hostkey(Util::Filename const &file)
 }
 
 
-void *Ssh::Server::_server_loop(void *arg)
-{
-	Ssh::Server *server = reinterpret_cast<Ssh::Server *>(arg);
-	server->loop();
-	return nullptr;
-}
-
-
-bool Ssh::Server::_allow_multi_login(ssh_session s, Login const &login)
+bool Ssh::Server::_allow_multi_login(Login const &login)
 {
 	if (login.multi_login) { return true; }
 
@@ -316,16 +338,22 @@ bool Ssh::Server::_allow_multi_login(ssh_session s, Login const &login)
 	auto lookup = [&] (Session const &s) {
 		if (s.user() == login.user) { found = true; }
 	};
-	_sessions.for_each(lookup);
+	_for_each_loop([&] (Event_loop &loop) {
+		Util::Pthread_mutex::Guard guard(loop.mutex);
+		loop.sessions.for_each(lookup);
+	});
 	return !found;
 }
 
 
 void Ssh::Server::_log_failed(char const *user, Session const &s, bool pubkey)
 {
+	_metrics.auth_failures.add(1);
+
 	if (!_log_logins) { return; }
 
-	char const *date = Util::get_time();
+	char date_buf[32];
+	char const *date = Util::get_time(date_buf, sizeof(date_buf));
 	Genode::log(date, " failed user ", user, " (", s.id(), ") ",
 	            "with ", pubkey ? "public-key" : "password");
 }
@@ -335,7 +363,8 @@ void Ssh::Server::_log_logout(Session const &s)
 {
 	if (!_log_logins) { return; }
 
-	char const *date = Util::get_time();
+	char date_buf[32];
+	char const *date = Util::get_time(date_buf, sizeof(date_buf));
 	Genode::log(date, " logout user ", s.user(), " (", s.id(), ")");
 }
 
@@ -344,26 +373,179 @@ void Ssh::Server::_log_login(User const &user, Session const &s, bool pubkey)
 {
 	if (!_log_logins) { return; }
 
-	char const *date = Util::get_time();
+	char date_buf[32];
+	char const *date = Util::get_time(date_buf, sizeof(date_buf));
 	Genode::log(date, " login user ", user, " (", s.id(), ") ",
 	            "with ", pubkey ? "public-key" : "password");
 }
 
 
+void Ssh::Server::_handshake_done(Session &s)
+{
+	/* time from accepting the connection until successful login */
+	s.metrics.handshake_us = Util::now_us() - s.metrics.accepted_us;
+	_metrics.handshake.record(s.metrics.handshake_us);
+}
+
+
+void Ssh::Server::_configure_metrics(Genode::Xml_node const &config)
+{
+	enum { DEFAULT_INTERVAL_MS = 5000, MIN_INTERVAL_MS = 100 };
+
+	unsigned interval_ms = 0;
+	bool     sessions    = true;
+
+	config.with_sub_node("report", [&] (Genode::Xml_node const &report) {
+		if (!report.attribute_value("metrics", false))
+			return;
+
+		interval_ms = report.attribute_value("interval_ms",
+		                                     (unsigned)DEFAULT_INTERVAL_MS);
+		interval_ms = Genode::max(interval_ms, (unsigned)MIN_INTERVAL_MS);
+		sessions    = report.attribute_value("sessions", true);
+	});
+
+	_metrics_sessions = sessions;
+
+	if (interval_ms == _metrics_interval_ms)
+		return;
+
+	_metrics_interval_ms = interval_ms;
+
+	if (!interval_ms) {
+		_metrics_timer.destruct();
+		_metrics_reporter.destruct();
+		return;
+	}
+
+	if (!_metrics_reporter.constructed())
+		_metrics_reporter.construct(_env, "metrics", "metrics");
+
+	if (!_metrics_timer.constructed()) {
+		_metrics_timer.construct(_env);
+		_metrics_timer->sigh(_metrics_handler);
+	}
+	_metrics_timer->trigger_periodic(interval_ms*1000UL);
+
+	_last_report_us = Util::now_us();
+	_last_sftp_ops  = 0;
+}
+
+
+void Ssh::Server::_generate_metrics(Genode::Xml_generator &xml)
+{
+	/* add up the counters of live sessions and the totals of closed ones */
+	unsigned long active        = 0;
+	unsigned long bytes_in      = _metrics.bytes_in.value();
+	unsigned long bytes_out     = _metrics.bytes_out.value();
+	unsigned long window_stalls = _metrics.window_stalls.value();
+	unsigned long sftp_ops      = _metrics.sftp_ops.value();
+
+	_for_each_loop([&] (Event_loop &loop) {
+		Util::Pthread_mutex::Guard guard(loop.mutex);
+		loop.sessions.for_each([&] (Session const &s) {
+			active++;
+			bytes_in      += s.metrics.bytes_in.value();
+			bytes_out     += s.metrics.bytes_out.value();
+			window_stalls += s.metrics.window_stalls.value();
+			sftp_ops      += s.metrics.sftp_ops.value();
+		});
+	});
+
+	unsigned long const now_us     = Util::now_us();
+	unsigned long const elapsed_us = now_us - _last_report_us;
+	unsigned long const new_ops    = sftp_ops - Genode::min(sftp_ops, _last_sftp_ops);
+
+	xml.attribute("interval_ms", _metrics_interval_ms);
+
+	xml.node("sessions", [&] () {
+		xml.attribute("accepted",      _metrics.accepted.value());
+		xml.attribute("active",        active);
+		xml.attribute("closed",        _metrics.closed.value());
+		xml.attribute("auth_failures", _metrics.auth_failures.value());
+	});
+
+	xml.node("traffic", [&] () {
+		xml.attribute("bytes_in",      bytes_in);
+		xml.attribute("bytes_out",     bytes_out);
+		xml.attribute("window_stalls", window_stalls);
+	});
+
+	xml.node("sftp", [&] () {
+		xml.attribute("ops", sftp_ops);
+		xml.attribute("ops_per_sec",
+		              elapsed_us ? (unsigned long)(new_ops*1000000ULL / elapsed_us) : 0);
+	});
+
+	_metrics.handshake.generate(xml, "handshake");
+	_metrics.sftp_op  .generate(xml, "sftp_op");
+
+	_last_report_us = now_us;
+	_last_sftp_ops  = sftp_ops;
+
+	{
+		Util::Pthread_mutex::Guard guard(_terminals.mutex());
+		_terminals.for_each([&] (Terminal_session const &t) {
+			xml.node("terminal", [&] () {
+				xml.attribute("name",           t.conn.terminal_name());
+				xml.attribute("channels",       t.conn.attached_channels());
+				xml.attribute("write_buffered", t.conn.write_buffered());
+				xml.attribute("write_capacity", Ssh::Terminal::write_capacity());
+				xml.attribute("read_buffered",  t.conn.read_buf.read_avail());
+				xml.attribute("read_capacity",  Ssh::Terminal::read_capacity());
+			});
+		});
+	}
+
+	if (!_metrics_sessions)
+		return;
+
+	_for_each_loop([&] (Event_loop &loop) {
+		Util::Pthread_mutex::Guard guard(loop.mutex);
+		loop.sessions.for_each([&] (Session const &s) {
+			xml.node("session", [&] () {
+				xml.attribute("id",            s.id());
+				xml.attribute("user",          s.user());
+				xml.attribute("loop",          loop.index);
+				xml.attribute("type",          !s.sftp.uninitialized() ? "sftp"
+				                             : s.terminal ? "terminal" : "none");
+				xml.attribute("handshake_us",  s.metrics.handshake_us);
+				xml.attribute("bytes_in",      s.metrics.bytes_in.value());
+				xml.attribute("bytes_out",     s.metrics.bytes_out.value());
+				xml.attribute("window_stalls", s.metrics.window_stalls.value());
+				xml.attribute("sftp_ops",      s.metrics.sftp_ops.value());
+			});
+		});
+	});
+}
+
+
+void Ssh::Server::_handle_metrics()
+{
+	if (!_metrics_reporter.constructed())
+		return;
+
+	Libc::with_libc([&] {
+		_metrics_reporter->generate([&] (Genode::Xml_generator &xml) {
+			_generate_metrics(xml); });
+	});
+}
+
+
 void Ssh::Server::attach_terminal(Ssh::Terminal &conn)
 {
 	Util::Pthread_mutex::Guard guard(_terminals.mutex());
 
 	try {
-		new (&_heap) Terminal_session(_terminals,
-		                              conn, _event_loop);
+		new (&_heap) Terminal_session(_terminals, conn);
 	} catch (...) {
 		Genode::error("could not attach Terminal ", conn.terminal_name());
 		throw -1;
 	}
 
+	conn.wake_up_signaller = &_signaller;
+
 	/* there might be sessions already waiting on the terminal */
-	bool attached = false;
 	auto lookup = [&] (Session &s) {
 		Ssh::Login const *l = _logins.lookup(s.user().string());
 		if ((l != nullptr)
@@ -371,12 +553,14 @@ void Ssh::Server::attach_terminal(Ssh::Terminal &conn)
 		    && !s.terminal) {
 			s.terminal = &conn;
 			s.terminal->attach_channel();
-			attached = true;
 		}
 	};
-	_sessions.for_each(lookup);
+	_for_each_loop([&] (Event_loop &loop) {
+		Util::Pthread_mutex::Guard guard(loop.mutex);
+		loop.sessions.for_each(lookup);
+	});
 
-	_wake_loop();
+	_wake_loops();
 }
 
 
@@ -400,15 +584,24 @@ void Ssh::Server::detach_terminal(Ssh::Terminal &conn)
 
 	auto invalidate_terminal = [&] (Session &sess) {
 		if (sess.terminal != &conn) { return; }
-		sess.terminal_detached = true;
 
 		/* flush before destroying the terminal */
-		try { sess.terminal->send(sess.channel); }
-		catch (...) { }
+		if (!sess.terminal_detached) {
+			try { sess.terminal->send(sess.channel, sess.terminal_sent,
+			                          sess.metrics); }
+			catch (...) { }
+		}
+
+		sess.terminal_detached = true;
 	};
-	_sessions.for_each(invalidate_terminal);
+	_for_each_loop([&] (Event_loop &loop) {
+		Util::Pthread_mutex::Guard guard(loop.mutex);
+		loop.sessions.for_each(invalidate_terminal);
+	});
+
+	Genode::destroy(&_heap, p);
 
-	_wake_loop();
+	_wake_loops();
 }
 
 
@@ -435,23 +628,23 @@ Ssh::Terminal *Ssh::Server::lookup_terminal(Session &s)
 }
 
 
-Ssh::Session *Ssh::Server::lookup_session(ssh_session s)
+Ssh::Session *Ssh::Event_loop::lookup_session(ssh_session s)
 {
 	Session *p = nullptr;
 	auto lookup = [&] (Session &sess) {
 		if (sess.session == s) { p = &sess; }
 	};
-	_sessions.for_each(lookup);
+	sessions.for_each(lookup);
 	return p;
 }
 
 
-Ssh::Login const *Ssh::Server::lookup_login(ssh_session s)
+Ssh::Login const *Ssh::Event_loop::lookup_login(ssh_session s)
 {
 	Ssh::Session *p = lookup_session(s);
 	if (!p) return nullptr;
 
-	Ssh::Login const *l = _logins.lookup(p->user().string());
+	Ssh::Login const *l = server._logins.lookup(p->user().string());
 	return l;
 }
 
@@ -466,6 +659,7 @@ bool Ssh::Server::request_terminal(Session &session,
 	}
 
 	try {
+		Util::Pthread_mutex::Guard reporter_guard(_request_terminal_reporter_mutex);
 		_request_terminal_reporter.generate([&] (Xml_generator& xml) {
 			xml.attribute("user", session.user());
 			if (command) {
@@ -480,7 +674,8 @@ bool Ssh::Server::request_terminal(Session &session,
 	session.terminal_requested = true;
 
 	if (_log_logins) {
-		char const *date = Util::get_time();
+		char date_buf[32];
+		char const *date = Util::get_time(date_buf, sizeof(date_buf));
 		Genode::log(date, " request Terminal for user ", session.user(),
 		            " (", session.session, ")");
 	}
@@ -501,6 +696,10 @@ void Ssh::Server::incoming_connection(ssh_session s)
 		throw -1;
 	}
 
+	/* distribute the sessions round-robin across the event loops */
+	Event_loop &loop = *_loops[_next_loop];
+	_next_loop = (_next_loop + 1) % _num_loops;
+
 	/*
 	 * Queue up new ssh_session to be enabled later in pthread ssh loop.
 	 * We can't directly add the new Session object to the _session registry,
@@ -509,20 +708,19 @@ void Ssh::Server::incoming_connection(ssh_session s)
 	 * is taken during _session.for_each(...) and during a 'new' here,
 	 * which would lead to a deadlock.
 	 */
-	new (&_heap) Session(_env, _heap, _new_sessions, _signaller, s,
-	                     &_channel_cb, ++_session_id);
+	new (&_heap) Session(_env, _heap, loop.new_sessions, loop.signaller, s,
+	                     &loop.channel_cb, ++_session_id,
+	                     _metrics, Util::now_us());
+
+	_metrics.accepted.add(1);
+
+	if (&loop != _loops[0])
+		loop.wake();
 }
 
 
-bool Ssh::Server::auth_password(ssh_session s, char const *u, char const *pass)
+bool Ssh::Server::auth_password(Session &session, char const *u, char const *pass)
 {
-	Session *p = lookup_session(s);
-	if (!p || p->session != s) {
-		Genode::warning("session not found");
-		return false;
-	}
-	Session &session = *p;
-
 	/*
 	 * Even if there is no valid login for the user, let
 	 * the client try anyway and check multi login afterwards.
@@ -530,10 +728,11 @@ bool Ssh::Server::auth_password(ssh_session s, char const *u, char const *pass)
 	Util::Pthread_mutex::Guard guard(_logins.mutex());
 	Login const *l = _logins.lookup(u);
 	if (l && l->user == u && l->password == pass) {
-		if (_allow_multi_login(s, *l)) {
+		if (_allow_multi_login(*l)) {
 			session.bad_auth_attempts = 0;
 			session.auth_sucessful = true;
 			session.adopt(l->user);
+			_handshake_done(session);
 			_log_login(l->user, session, false);
 			return true;
 		} else {
@@ -543,12 +742,13 @@ bool Ssh::Server::auth_password(ssh_session s, char const *u, char const *pass)
 		}
 	}
 
-	_log_failed(u, *p, false);
+	_log_failed(u, session, false);
 
 	int &i = session.bad_auth_attempts;
 	if (++i >= _max_auth_attempts) {
 		if (_log_logins) {
-			char const *date = Util::get_time();
+			char date_buf[32];
+			char const *date = Util::get_time(date_buf, sizeof(date_buf));
 			Genode::log(date, " disconnect user ", u, " (", session.id(),
 			            ") after ", i, " failed authentication attempts"
 			            " with password");
@@ -559,17 +759,10 @@ bool Ssh::Server::auth_password(ssh_session s, char const *u, char const *pass)
 }
 
 
-bool Ssh::Server::auth_pubkey(ssh_session s, char const *u,
+bool Ssh::Server::auth_pubkey(Session &session, char const *u,
                               struct ssh_key_struct *pubkey,
                               char signature_state)
 {
-	Session *p = lookup_session(s);
-	if (!p || p->session != s) {
-		Genode::warning("session not found");
-		return false;
-	}
-	Session &session = *p;
-
 	/*
 	 * In this first state the given pubkey is solely probed.
 	 * Ideally we would check here if the given pubkey is in fact to the
@@ -592,9 +785,10 @@ bool Ssh::Server::auth_pubkey(ssh_session s, char const *u,
 		Login const *l = _logins.lookup(u);
 		if (l && !ssh_key_cmp(pubkey, l->pub_key,
 		                      SSH_KEY_CMP_PUBLIC)) {
-			if (_allow_multi_login(s, *l)) {
+			if (_allow_multi_login(*l)) {
 				session.auth_sucessful = true;
 				session.adopt(l->user);
+				_handshake_done(session);
 				_log_login(l->user, session, true);
 				return true;
 			}
@@ -606,51 +800,65 @@ bool Ssh::Server::auth_pubkey(ssh_session s, char const *u,
 }
 
 
-void Ssh::Server::loop()
+void Ssh::Event_loop::activate_session(Session &inactive_session)
+{
+	/* re-queue session object */
+	new (&server._heap) Session(server._env,
+	                            server._heap,
+	                            sessions,
+	                            signaller,
+	                            inactive_session.session,
+	                            inactive_session.channel_cb,
+	                            inactive_session.id(),
+	                            inactive_session.metrics.global,
+	                            inactive_session.metrics.accepted_us);
+
+	ssh_session s = inactive_session.session;
+
+	/* remove temporary object */
+	Genode::destroy(&server._heap, &inactive_session);
+
+	/* activate session */
+	ssh_set_server_callbacks(s, &session_cb);
+
+	int auth_methods = SSH_AUTH_METHOD_UNKNOWN;
+	auth_methods += server._allow_password  ? SSH_AUTH_METHOD_PASSWORD  : 0;
+	auth_methods += server._allow_publickey ? SSH_AUTH_METHOD_PUBLICKEY : 0;
+	ssh_set_auth_methods(s, auth_methods);
+
+	int key_exchange_result = ssh_handle_key_exchange(s);
+
+	if ((SSH_OK != key_exchange_result) &&
+	    (SSH_AGAIN != key_exchange_result)) {
+		Genode::warning("key exchange returned ", key_exchange_result);
+	}
+
+	ssh_event_add_session(event, s);
+}
+
+
+void Ssh::Event_loop::loop()
 {
 	while (true) {
 
-		ssh_event_set_dopoll_immediate(_event_loop, 0);
-		int const events = ssh_event_dopoll(_event_loop, -1);
-		ssh_event_set_dopoll_immediate(_event_loop, 1);
+		ssh_event_set_dopoll_immediate(event, 0);
+		int const events = ssh_event_dopoll(event, -1);
+		ssh_event_set_dopoll_immediate(event, 1);
 
 		if (events == SSH_ERROR) {
-			_cleanup_sessions();
+			Util::Pthread_mutex::Guard guard(mutex);
+			cleanup_sessions();
 		}
 
 		{
-			Util::Pthread_mutex::Guard guard(_terminals.mutex());
-
-			/* finish pending initialization of terminal sessions */
-			auto initialize = [&] (Terminal_session &t) {
-				try {
-					if (t._state == Terminal_session::PIPE_INITIALIZED) {
-						t.initialize_ssh_event_fds();
-					}
-				} catch (...) {
-					/* Not sure what to do here - terminal is "almost" attached.
-					   Previously service was denied in that case but as
-					   descriptor handling must be performed in ssh loop thread
-					   it is too late for that. */
-				}
-			};
-			_terminals.for_each(initialize);
+			Util::Pthread_mutex::Guard guard(mutex);
 
 			/* remove all stale sessions */
 			auto cleanup = [&] (Session &s) {
-				if (s.terminal_detached) {
-					Terminal_session *p = nullptr;
-					auto lookup = [&] (Terminal_session &t) {
-						if (&t.conn == s.terminal) {
-							p = &t;
-							s.terminal = nullptr;
-						}
-					};
-					_terminals.for_each(lookup);
-
-					if (p)
-						Genode::destroy(&_heap, p);
-				}
+
+				/* the Terminal session was destroyed by the EP */
+				if (s.terminal_detached)
+					s.terminal = nullptr;
 
 				if ((s.sftp._state == Sftp::WORKER_FINISHED) ||
 				    (s.sftp._state == Sftp::CREATE_ERROR) ||
@@ -666,92 +874,50 @@ void Ssh::Server::loop()
 				/* perform check using ssh_blocking_flush with 0 timeout */
 				if (ssh_blocking_flush(s.session, 0) == SSH_AGAIN) { return; }
 
-				_cleanup_session(s);
+				cleanup_session(s);
 			};
-			_sessions.for_each(cleanup);
-
-			/* second reset all active terminals */
-			auto reset_pending = [&] (Terminal_session &t) {
-				if (!t.conn.attached_channels()) { return; }
-				t.conn.reset_pending();
-			};
-			_terminals.for_each(reset_pending);
+			sessions.for_each(cleanup);
 
 			/*
-			 * third send data on all sessions being attached
+			 * second send data on all sessions being attached
 			 * to a terminal.
 			 */
 			auto send = [&] (Session &s) {
 				if (!s.terminal) { return; }
 
-				try { s.terminal->send(s.channel); }
-				catch (...) { _cleanup_session(s); }
+				try { s.terminal->send(s.channel, s.terminal_sent, s.metrics); }
+				catch (...) { cleanup_session(s); }
 			};
-			_sessions.for_each(send);
+			sessions.for_each(send);
 
 			/*
-			 * fourth send pending sftp data on sessions with enabled sftp
+			 * third send pending sftp data on sessions with enabled sftp
 			 * subsystem
 			 */
 			auto send_sftp = [&] (Session &s) {
 				if (s.sftp.uninitialized()) { return; }
 
 				try { s.sftp.send_queued_packets(s.channel); }
-				catch (...) { _cleanup_session(s); }
+				catch (...) { cleanup_session(s); }
 			};
-			_sessions.for_each(send_sftp);
+			sessions.for_each(send_sftp);
 
-			/* fifth flush ssh sessions data */
+			/* fourth flush ssh sessions data */
 			auto flush_output = [&] (Session &s) {
 				ssh_blocking_flush(s.session, 0);
 			};
-			_sessions.for_each(flush_output);
+			sessions.for_each(flush_output);
 		}
 
 		/* enable all new sessions that got added by ssh callbacks */
-		auto activate = [&] (Session &inactive_session) {
-			/* re-queue session object */
-			new (&_heap) Session(_env,
-			                     _heap,
-			                     _sessions,
-			                     _signaller,
-			                     inactive_session.session,
-			                     inactive_session.channel_cb,
-			                     inactive_session.id());
-
-			ssh_session s = inactive_session.session;
-
-			/* remove temporary object */
-			Genode::destroy(&_heap, &inactive_session);
-
-			/* activate session */
-			ssh_set_server_callbacks(s, &_session_cb);
-
-			int auth_methods = SSH_AUTH_METHOD_UNKNOWN;
-			auth_methods += _allow_password  ? SSH_AUTH_METHOD_PASSWORD  : 0;
-			auth_methods += _allow_publickey ? SSH_AUTH_METHOD_PUBLICKEY : 0;
-			ssh_set_auth_methods(s, auth_methods);
-
-			int key_exchange_result = ssh_handle_key_exchange(s);
-
-			if ((SSH_OK != key_exchange_result) &&
-			    (SSH_AGAIN != key_exchange_result)) {
-				Genode::warning("key exchange returned ", key_exchange_result);
-			}
-
-			ssh_event_add_session(_event_loop, s);
-		};
-		_new_sessions.for_each(activate);
-
+		new_sessions.for_each([&] (Session &s) { activate_session(s); });
 	}
 }
 
 
-void Ssh::Server::_wake_loop()
+void Ssh::Server::_wake_loops()
 {
-	/* wake the event loop up */
-	char c = 1;
-	::write(_server_fds[1], &c, sizeof(c));
+	_for_each_loop([&] (Event_loop &loop) { loop.wake(); });
 }
 
 
@@ -21,6 +21,8 @@
 #include <base/log.h>
 #include <base/registry.h>
 #include <os/reporter.h>
+#include <timer_session/connection.h>
+#include <util/reconstructible.h>
 
 /* libc includes */
 #include <poll.h>
@@ -33,6 +35,7 @@
 
 /* local includes */
 #include "login.h"
+#include "metrics.h"
 #include "sftp.h"
 #include "terminal.h"
 #include "wake_up_signaller.h"
@@ -44,6 +47,7 @@ namespace Ssh {
 
 	struct Server;
 	struct Session;
+	struct Event_loop;
 	struct Terminal_session;
 	struct Terminal_registry;
 }
@@ -66,6 +70,11 @@ struct Ssh::Session : Genode::Registry<Session>::Element
 	bool           terminal_detached { false };
 	bool           terminal_requested{ false };
 
+	/* generation of terminal output already sent to the channel */
+	unsigned long  terminal_sent     { 0 };
+
+	Session_metrics metrics;
+
 	Ssh::Sftp      sftp;
 
 	Session(Genode::Env &env,
@@ -74,9 +83,12 @@ struct Ssh::Session : Genode::Registry<Session>::Element
 	        Wake_up_signaller &wake_up_signaller,
 	        ssh_session s,
 	        ssh_channel_callbacks ccb,
-	        uint32_t id)
+	        uint32_t id,
+	        Metrics &global_metrics,
+	        unsigned long accepted_us)
 	: Element(reg, *this), _heap(heap), _id(id), session(s), channel_cb(ccb),
-	  sftp(heap, wake_up_signaller)
+	  metrics(global_metrics, accepted_us),
+	  sftp(heap, wake_up_signaller, metrics)
 	{
 		ssh_set_blocking(s, false);
 	}
@@ -103,34 +115,9 @@ struct Ssh::Terminal_session : Genode::Registry<Terminal_session>::Element
 {
 	Ssh::Terminal &conn;
 
-	ssh_event _event_loop;
-
-	int _fds[2] { -1, -1 };
-
-	enum State { UNINITIALIZED,
-	             PIPE_INITIALIZED,
-	             SSH_INITIALIZED } _state = UNINITIALIZED;
-
 	Terminal_session(Genode::Registry<Terminal_session> &reg,
-	                 Ssh::Terminal &conn,
-	                 ssh_event event_loop);
-
-	~Terminal_session()
-	{
-		switch (_state) {
-		case SSH_INITIALIZED:
-			ssh_event_remove_fd(_event_loop, _fds[0]);
-			[[fallthrough]];
-		case PIPE_INITIALIZED:
-			close(_fds[0]);
-			close(_fds[1]);
-			[[fallthrough]];
-		case UNINITIALIZED:
-			break;
-		}
-	}
-
-	void initialize_ssh_event_fds();
+	                 Ssh::Terminal &conn)
+	: Element(reg, *this), conn(conn) { }
 };
 
 
@@ -141,6 +128,81 @@ struct Ssh::Terminal_registry : Genode::Registry<Terminal_session>
 };
 
 
+/**
+ * Event-loop thread processing a share of the SSH sessions
+ *
+ * Each event loop polls its own 'ssh_event' and owns the sessions
+ * assigned to it at accept time. Key exchange, cipher work, and channel
+ * I/O of different sessions are thereby executed in parallel.
+ */
+struct Ssh::Event_loop
+{
+	using Session_registry = Genode::Registry<Session>;
+
+	Server         &server;
+	unsigned const  index;
+
+	ssh_event       event;
+	int             wake_fds[2] { -1, -1 };
+	pthread_t       thread      { };
+
+	/*
+	 * Protects the sessions against concurrent access by the EP, e.g.,
+	 * when a Terminal session is attached or detached
+	 */
+	Util::Pthread_mutex mutex { };
+
+	Session_registry sessions     { };
+	Session_registry new_sessions { };
+
+	/*
+	 * Since we always pass the event loop as userdata pointer, the
+	 * callbacks of a session are executed in the context of its loop.
+	 */
+	ssh_channel_callbacks_struct channel_cb { };
+	ssh_server_callbacks_struct  session_cb { };
+
+	struct Signaller : public Wake_up_signaller
+	{
+		Event_loop &_loop;
+
+		Signaller(Event_loop &loop) : _loop(loop) { }
+
+		void signal_wake_up() override { _loop.wake(); }
+	};
+	Signaller signaller { *this };
+
+	Event_loop(Server &server, unsigned index);
+
+	~Event_loop();
+
+	/**
+	 * Start event-loop thread
+	 */
+	void start();
+
+	void wake();
+
+	void loop();
+
+	static void *entry(void *arg);
+
+	/**
+	 * Look up Session for SSH session
+	 */
+	Session *lookup_session(ssh_session s);
+
+	/**
+	 * Look up Login for SSH session
+	 */
+	Login const *lookup_login(ssh_session s);
+
+	void cleanup_session(Session &s);
+	void cleanup_sessions();
+	void activate_session(Session &s);
+};
+
+
 class Ssh::Server
 {
 	public:
@@ -150,7 +212,9 @@ class Ssh::Server
 
 	private:
 
-		using Session_registry = Genode::Registry<Session>;
+		friend struct Event_loop;
+
+		enum { MAX_EVENT_LOOPS = 16 };
 
 		Genode::Env   &_env;
 		Genode::Heap   _heap;
@@ -162,53 +226,70 @@ class Ssh::Server
 		int            _max_auth_attempts { 3 };
 		unsigned       _port              { 0u };
 		unsigned       _log_level         { 0u };
-		int            _server_fds[2]     { -1, -1 };
+		unsigned       _num_loops         { 1u };
 
 		bool           _config_once { false };
 
 		ssh_bind       _ssh_bind;
-		ssh_event      _event_loop;
+
+		Event_loop    *_loops[MAX_EVENT_LOOPS] { };
+		unsigned       _next_loop { 0 };
 
 		Util::Filename _rsa_key      { };
 		Util::Filename _ecdsa_key    { };
 		Util::Filename _ed25519_key  { };
 
-		Expanding_reporter _request_terminal_reporter { _env,
-		                                                "request_terminal",
-		                                                "request_terminal" };
+		/*
+		 * The reporter is used by all event loops, guard each
+		 * 'generate' by the reporter mutex
+		 */
+		Util::Pthread_mutex _request_terminal_reporter_mutex { };
+		Expanding_reporter  _request_terminal_reporter { _env,
+		                                                 "request_terminal",
+		                                                 "request_terminal" };
 
 		Terminal_registry   _terminals { };
 		Login_registry     &_logins;
-		pthread_t           _event_thread;
+
+		ssh_bind_callbacks_struct _bind_cb { };
+
+		uint32_t _session_id { 0 };
 
 		/*
-		 * Since we always pass ourself as userdata pointer, we may
-		 * safely use the same callback for all sessions and channels.
+		 * Optional periodic report of throughput and latency metrics
 		 */
-		ssh_channel_callbacks_struct _channel_cb { };
-		ssh_server_callbacks_struct  _session_cb { };
-		ssh_bind_callbacks_struct    _bind_cb    { };
+		Metrics _metrics { };
+
+		Genode::Constructible<Timer::Connection>  _metrics_timer    { };
+		Genode::Constructible<Expanding_reporter> _metrics_reporter { };
+
+		Genode::Signal_handler<Server> _metrics_handler {
+			_env.ep(), *this, &Server::_handle_metrics };
 
-		Session_registry _sessions     { };
-		Session_registry _new_sessions { };
-		uint32_t         _session_id   { 0 };
+		unsigned      _metrics_interval_ms { 0 };
+		bool          _metrics_sessions    { true };
+		unsigned long _last_sftp_ops       { 0 };
+		unsigned long _last_report_us      { 0 };
 
-		void _initialize_channel_callbacks();
-		void _initialize_session_callbacks();
+		void _configure_metrics(Genode::Xml_node const &config);
+		void _handle_metrics();
+		void _generate_metrics(Genode::Xml_generator &xml);
+
+		void _initialize_channel_callbacks(Event_loop &loop);
+		void _initialize_session_callbacks(Event_loop &loop);
 		void _initialize_bind_callbacks();
-		void _cleanup_session(Session &s);
 
-		void _cleanup_sessions();
 		void _parse_config(Genode::Xml_node const &config);
 		void _load_hostkey(Util::Filename const &file);
 
-		/*
-		 * Event execution
-		 */
-
-		static void *_server_loop(void *arg);
+		template <typename FN>
+		void _for_each_loop(FN const &fn)
+		{
+			for (unsigned i = 0; i < _num_loops; i++)
+				if (_loops[i]) fn(*_loops[i]);
+		}
 
-		bool _allow_multi_login(ssh_session s, Login const &login);
+		bool _allow_multi_login(Login const &login);
 
 		/********************
 		 ** Login messages **
@@ -218,7 +299,9 @@ class Ssh::Server
 		void _log_logout(Session const &s);
 		void _log_login(User const &user, Session const &s, bool pubkey);
 
-		void _wake_loop();
+		void _handshake_done(Session &s);
+
+		void _wake_loops();
 
 	public:
 
@@ -228,8 +311,6 @@ class Ssh::Server
 
 		virtual ~Server();
 
-		void loop();
-
 		/***************************************************************
 		 ** Methods below are only used by Terminal session front end **
 		 ***************************************************************/
@@ -258,16 +339,6 @@ class Ssh::Server
 		 */
 		Ssh::Terminal *lookup_terminal(Session &s);
 
-		/**
-		 * Look up Session for SSH session
-		 */
-		Session *lookup_session(ssh_session s);
-
-		/**
-		 * Look up Login for SSH session
-		 */
-		Login const *lookup_login(ssh_session s);
-
 		/**
 		 * Request Terminal
 		 */
@@ -281,12 +352,12 @@ class Ssh::Server
 		/**
 		 * Handle password authentication
 		 */
-		bool auth_password(ssh_session s, char const *u, char const *pass);
+		bool auth_password(Session &s, char const *u, char const *pass);
 
 		/**
 		 * Handle public-key authentication
 		 */
-		bool auth_pubkey(ssh_session s, char const *u,
+		bool auth_pubkey(Session &s, char const *u,
 		                 struct ssh_key_struct *pubkey,
                          char signature_state);
 
@@ -299,7 +370,7 @@ class Ssh::Server
 
 			void signal_wake_up() override
 			{
-				_server._wake_loop();
+				_server._wake_loops();
 			}
 		};
 		Signaller _signaller { *this };
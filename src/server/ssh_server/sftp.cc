@@ -28,6 +28,7 @@ extern "C" {
 
 /* local includes */
 #include "sftp.h"
+#include "util.h"
 
 template <class T>
 class Free_guard {
@@ -68,7 +69,9 @@ void * Ssh::Sftp::sftp_worker_loop(void *arg)
 		/* exit loop if empty message found */
 		if (msg == NULL) break;
 
+		unsigned long const start_us = Util::now_us();
 		server.process_message(msg);
+		server._metrics.sftp_op(Util::now_us() - start_us);
 	}
 
 	ssh_channel_request_send_exit_status(server._sftp_server->channel, 0);
@@ -443,6 +446,8 @@ void Ssh::Sftp::send_queued_packets(ssh_channel channel)
 		int const num_bytes = ssh_channel_write(channel, (char*) data + pos,
 		                                        len - pos);
 
+		_metrics.sent(num_bytes, len - pos);
+
 		if (num_bytes < 0) {
 			Genode::error("ERROR sending sftp data");
 			ssh_buffer_free(payload);
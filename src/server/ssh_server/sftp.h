@@ -37,6 +37,7 @@
 
 /* local includes */
 #include "login.h"
+#include "metrics.h"
 #include "wake_up_signaller.h"
 
 
@@ -55,6 +56,7 @@ class Ssh::Sftp
 	private:
 		Genode::Heap       &_heap;
 	  Wake_up_signaller  &_wake_up_signaller;
+		Session_metrics    &_metrics;
 		Ssh::User           _user               { };
 		sftp_session        _sftp_server        { nullptr };
 		pthread_t           _worker_thread      { 0 };
@@ -95,9 +97,10 @@ class Ssh::Sftp
 		             CREATE_ERROR,
 		             CLEAN } _state = UNINITIALIZED;
 
-		Sftp(Genode::Heap &heap, Wake_up_signaller &wake_up_signaller)
+		Sftp(Genode::Heap &heap, Wake_up_signaller &wake_up_signaller,
+		     Session_metrics &metrics)
 			: _heap(heap), _wake_up_signaller(wake_up_signaller),
-			  _output_payload(nullptr), _output_pos(0) {}
+			  _metrics(metrics), _output_payload(nullptr), _output_pos(0) {}
 		~Sftp();
 
 		void cleanup();
@@ -42,8 +42,8 @@ int channel_data_cb(ssh_session session, ssh_channel channel,
 		return 0;
 	}
 
-	Ssh::Server  &server = *reinterpret_cast<Ssh::Server*>(userdata);
-	Ssh::Session *p      = server.lookup_session(session);
+	Ssh::Event_loop &loop = *reinterpret_cast<Ssh::Event_loop*>(userdata);
+	Ssh::Session    *p    = loop.lookup_session(session);
 	if (!p) {
 		error("session not found");
 		return SSH_ERROR;
@@ -60,7 +60,9 @@ int channel_data_cb(ssh_session session, ssh_channel channel,
 	}
 
 	if (!p->sftp.uninitialized()) {
-		return p->sftp.incoming_sftp_data(data, len);
+		int const consumed = p->sftp.incoming_sftp_data(data, len);
+		if (consumed > 0) { p->metrics.bytes_in.add(consumed); }
+		return consumed;
 	}
 
 	Ssh::Terminal &conn              { *p->terminal };
@@ -83,6 +85,7 @@ int channel_data_cb(ssh_session session, ssh_channel channel,
 		num_bytes++;
 	}
 	conn.notify_read_avail();
+	p->metrics.bytes_in.add(num_bytes);
 	return num_bytes;
 }
 
@@ -94,8 +97,8 @@ void channel_eof_cb(ssh_session session, ssh_channel channel,
                     void *userdata)
 {
 	using namespace Genode;
-	Ssh::Server &server = *reinterpret_cast<Ssh::Server*>(userdata);
-	Ssh::Session *p = server.lookup_session(session);
+	Ssh::Event_loop &loop = *reinterpret_cast<Ssh::Event_loop*>(userdata);
+	Ssh::Session *p = loop.lookup_session(session);
 
 	if (!p) {
 		error("session not found");
@@ -142,11 +145,11 @@ int channel_pty_request_cb(ssh_session session, ssh_channel channel,
                            void *userdata)
 {
 	using namespace Genode;
-	Ssh::Server &server = *reinterpret_cast<Ssh::Server*>(userdata);
-	Ssh::Session *p = server.lookup_session(session);
+	Ssh::Event_loop &loop = *reinterpret_cast<Ssh::Event_loop*>(userdata);
+	Ssh::Session *p = loop.lookup_session(session);
 	if (!p || p->channel != channel) { return SSH_ERROR; }
 
-	Ssh::Login const *l = server.lookup_login(session);
+	Ssh::Login const *l = loop.lookup_login(session);
 	if (!l || !l->allow_terminal) {
 		p->terminal_detached = true;
 		return SSH_ERROR;
@@ -159,9 +162,9 @@ int channel_pty_request_cb(ssh_session session, ssh_channel channel,
 	 * and wait for a Terminal session to be established.
 	 */
 	if (!p->terminal) {
-		p->terminal = server.lookup_terminal(*p);
+		p->terminal = loop.server.lookup_terminal(*p);
 		if (!p->terminal) {
-			return server.request_terminal(*p) ? SSH_OK
+			return loop.server.request_terminal(*p) ? SSH_OK
 			                                   : SSH_ERROR;
 		}
 	}
@@ -189,8 +192,8 @@ int channel_pty_window_change_cb(ssh_session session, ssh_channel channel,
 	(void)pwheight;
 
 	using namespace Genode;
-	Ssh::Server &server = *reinterpret_cast<Ssh::Server*>(userdata);
-	Ssh::Session *p = server.lookup_session(session);
+	Ssh::Event_loop &loop = *reinterpret_cast<Ssh::Event_loop*>(userdata);
+	Ssh::Session *p = loop.lookup_session(session);
 	if (!p || p->channel != channel || !p->terminal) { return SSH_ERROR; }
 
 	Ssh::Terminal &conn = *p->terminal;
@@ -226,8 +229,8 @@ int channel_exec_request_cb(ssh_session session, ssh_channel channel,
 {
 	using namespace Genode;
 
-	Ssh::Server  &server = *reinterpret_cast<Ssh::Server*>(userdata);
-	Ssh::Session *p      = server.lookup_session(session);
+	Ssh::Event_loop &loop = *reinterpret_cast<Ssh::Event_loop*>(userdata);
+	Ssh::Session    *p    = loop.lookup_session(session);
 	if (!p || p->channel != channel) { return SSH_ERROR; }
 
 	/*
@@ -237,9 +240,9 @@ int channel_exec_request_cb(ssh_session session, ssh_channel channel,
 	 * and wait for a Terminal session to be established.
 	 */
 	if (!p->terminal) {
-		p->terminal = server.lookup_terminal(*p);
+		p->terminal = loop.server.lookup_terminal(*p);
 		if (!p->terminal) {
-			return server.request_terminal(*p, command) ? SSH_OK
+			return loop.server.request_terminal(*p, command) ? SSH_OK
 			                                            : SSH_ERROR;
 		}
 	}
@@ -252,13 +255,13 @@ int channel_subsystem_request_cb(ssh_session session, ssh_channel channel,
                                  const char *subsystem, void *userdata)
 {
 	using namespace Genode;
-	Ssh::Server &server = *reinterpret_cast<Ssh::Server*>(userdata);
-	Ssh::Session *p = server.lookup_session(session);
+	Ssh::Event_loop &loop = *reinterpret_cast<Ssh::Event_loop*>(userdata);
+	Ssh::Session *p = loop.lookup_session(session);
 	if (!p || p->channel != channel) { return SSH_ERROR; }
 
 	if (Genode::strcmp(subsystem, "sftp") != 0) { return SSH_ERROR; }
 
-	Ssh::Login const *l = server.lookup_login(session);
+	Ssh::Login const *l = loop.lookup_login(session);
 	if (!l || !l->allow_sftp) { return SSH_ERROR; }
 
 	if (!p->sftp.uninitialized()) {
@@ -295,8 +298,14 @@ int session_auth_password_cb(ssh_session session,
                              char const *user, char const *password,
                              void *userdata)
 {
-	Ssh::Server &server = *reinterpret_cast<Ssh::Server*>(userdata);
-	return server.auth_password(session, user, password) ? SSH_AUTH_SUCCESS
+	Ssh::Event_loop &loop = *reinterpret_cast<Ssh::Event_loop*>(userdata);
+	Ssh::Session    *p    = loop.lookup_session(session);
+	if (!p) {
+		Genode::warning("session not found");
+		return SSH_AUTH_DENIED;
+	}
+
+	return loop.server.auth_password(*p, user, password) ? SSH_AUTH_SUCCESS
 	                                                     : SSH_AUTH_DENIED;
 }
 
@@ -308,8 +317,14 @@ int session_auth_pubkey_cb(ssh_session session, char const *user,
                            struct ssh_key_struct *pubkey,
                            char state, void *userdata)
 {
-	Ssh::Server &server = *reinterpret_cast<Ssh::Server*>(userdata);
-	return server.auth_pubkey(session, user, pubkey, state) ? SSH_AUTH_SUCCESS
+	Ssh::Event_loop &loop = *reinterpret_cast<Ssh::Event_loop*>(userdata);
+	Ssh::Session    *p    = loop.lookup_session(session);
+	if (!p) {
+		Genode::warning("session not found");
+		return SSH_AUTH_DENIED;
+	}
+
+	return loop.server.auth_pubkey(*p, user, pubkey, state) ? SSH_AUTH_SUCCESS
 	                                                        : SSH_AUTH_DENIED;
 
 }
@@ -323,8 +338,8 @@ ssh_channel session_channel_open_request_cb(ssh_session session,
 {
 	using namespace Genode;
 
-	Ssh::Server  &server = *reinterpret_cast<Ssh::Server*>(userdata);
-	Ssh::Session *p      = server.lookup_session(session);
+	Ssh::Event_loop &loop = *reinterpret_cast<Ssh::Event_loop*>(userdata);
+	Ssh::Session    *p    = loop.lookup_session(session);
 	if (!p) {
 		error("could not look up session");
 		return nullptr;
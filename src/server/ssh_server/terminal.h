@@ -26,6 +26,8 @@
 
 /* local includes */
 #include "login.h"
+#include "metrics.h"
+#include "wake_up_signaller.h"
 
 
 namespace Ssh
@@ -40,7 +42,9 @@ class Ssh::Terminal
 {
 	private:
 
-		typedef Util::Buffer<4096u> Buffer;
+		enum { BUFFER_SIZE = 4096u };
+
+		typedef Util::Buffer<BUFFER_SIZE> Buffer;
 
 		Mutex   _write_buf_swap    { };
 
@@ -57,14 +61,24 @@ class Ssh::Terminal
 
 		Ssh::Terminal_name const _term_name { };
 
-		unsigned _attached_channels { 0u };
-		unsigned _pending_channels  { 0u };
+		/*
+		 * The sessions attached to the terminal may be handled by
+		 * different event loops, which serialize on '_send_mutex'. Each
+		 * session records the generation of the output it has sent, so
+		 * that the content of the pthread write buffer is sent once per
+		 * channel.
+		 */
+		Util::Pthread_mutex _send_mutex { };
+
+		unsigned      _attached_channels { 0u };
+		unsigned      _pending_channels  { 0u };
+		unsigned long _generation        { 1u };
 
 	public:
 
 		Buffer read_buf { };
 
-		int write_avail_fd { -1 };
+		Wake_up_signaller *wake_up_signaller { nullptr };
 
 		/**
 		 * Constructor
@@ -77,9 +91,35 @@ class Ssh::Terminal
 
 		unsigned attached_channels() const { return _attached_channels; }
 
-		void attach_channel() { ++_attached_channels; }
-		void detach_channel() { --_attached_channels; }
-		void reset_pending()  { _pending_channels = 0; }
+		/**
+		 * Return number of bytes buffered for sending to the SSH channels
+		 */
+		size_t write_buffered() const
+		{
+			return _write_buf_ep->read_avail() + _write_buf_pthread->read_avail();
+		}
+
+		static size_t write_capacity() { return 2*BUFFER_SIZE; }
+		static size_t read_capacity()  { return BUFFER_SIZE; }
+
+		void attach_channel()
+		{
+			Util::Pthread_mutex::Guard guard(_send_mutex);
+			++_attached_channels;
+		}
+
+		void detach_channel()
+		{
+			Util::Pthread_mutex::Guard guard(_send_mutex);
+			--_attached_channels;
+
+			/* the remaining channels might all have been served already */
+			if (_pending_channels && _pending_channels >= _attached_channels) {
+				_write_buf_pthread->reset();
+				_pending_channels = 0;
+				_generation++;
+			}
+		}
 
 		/*********************************
 		 ** Terminal::Session interface **
@@ -162,9 +202,15 @@ class Ssh::Terminal
 
 		/**
 		 * Send internal write buffer content to SSH channel
+		 *
+		 * \param sent     generation of the content sent to the channel
+		 * \param metrics  statistics of the session owning the channel
 		 */
-		void send(ssh_channel channel)
+		void send(ssh_channel channel, unsigned long &sent,
+		          Session_metrics &metrics)
 		{
+			Util::Pthread_mutex::Guard send_guard(_send_mutex);
+
 			{
 				/* swap write buffers if current is empty */
 				Mutex::Guard guard(_write_buf_swap);
@@ -181,20 +227,29 @@ class Ssh::Terminal
 
 			if (!write_buf.read_avail()) { return; }
 
-			/* ignore send request */
-			if (!channel || !ssh_channel_is_open(channel)) { return; }
+			/* content was already sent to this channel */
+			if (sent == _generation) { return; }
+			sent = _generation;
 
-			char const *src     = write_buf.content();
-			size_t const len    = write_buf.read_avail();
-			/* XXX we do not handle partial writes */
-			int const num_bytes = ssh_channel_write(channel, src, len);
+			/* ignore send request but count the channel as served */
+			int num_bytes = 0;
+			if (channel && ssh_channel_is_open(channel)) {
 
-			if (num_bytes && (size_t)num_bytes < len) {
-				warning("send on channel was truncated");
+				char const *src  = write_buf.content();
+				size_t const len = write_buf.read_avail();
+				/* XXX we do not handle partial writes */
+				num_bytes = ssh_channel_write(channel, src, len);
+				metrics.sent(num_bytes, len);
+
+				if (num_bytes && (size_t)num_bytes < len) {
+					warning("send on channel was truncated");
+				}
 			}
 
 			if (++_pending_channels >= _attached_channels) {
 				write_buf.reset();
+				_pending_channels = 0;
+				_generation++;
 			}
 
 			/* at this point the client might have disconnected */
@@ -255,11 +310,11 @@ class Ssh::Terminal
 				}
 			}
 
-			/* wake the event loop up */
-			Libc::with_libc([&] {
-				char c = 1;
-				::write(write_avail_fd, &c, sizeof(c));
-			});
+			/* wake the event loops up */
+			if (wake_up_signaller) {
+				Libc::with_libc([&] {
+					wake_up_signaller->signal_wake_up(); });
+			}
 
 			return num_bytes;
 		}
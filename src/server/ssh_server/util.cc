@@ -16,21 +16,33 @@
 /* local includes */
 #include "util.h"
 
-char const *Util::get_time()
+char const *Util::get_time(char *buffer, size_t size)
 {
-	static char buffer[32];
-
 	char const *p = "<invalid date>";
 	Libc::with_libc([&] {
 		struct timespec ts;
 		if (clock_gettime(0, &ts)) { return; }
 
-		struct tm *tm = localtime((time_t*)&ts.tv_sec);
-		if (!tm) { return; }
+		struct tm tm;
+		if (!localtime_r((time_t*)&ts.tv_sec, &tm)) { return; }
 
-		size_t const n = strftime(buffer, sizeof(buffer), "%F %H:%M:%S", tm);
-		if (n > 0 && n < sizeof(buffer)) { p = buffer; }
+		size_t const n = strftime(buffer, size, "%F %H:%M:%S", &tm);
+		if (n > 0 && n < size) { p = buffer; }
 	}); /* Libc::with_libc */
 
 	return p;
 }
+
+
+unsigned long Util::now_us()
+{
+	unsigned long us = 0;
+	Libc::with_libc([&] {
+		struct timespec ts;
+		if (clock_gettime(CLOCK_MONOTONIC, &ts)) { return; }
+
+		us = ts.tv_sec*1000000UL + ts.tv_nsec/1000;
+	}); /* Libc::with_libc */
+
+	return us;
+}
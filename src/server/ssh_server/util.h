@@ -34,9 +34,15 @@ namespace Util
 	struct Buffer;
 
 	/*
-	 * get the current time from the libc backend.
+	 * get the current time from the libc backend, formatted into
+	 * the caller-provided 'buffer'
 	 */
-	char const *get_time();
+	char const *get_time(char *buffer, size_t size);
+
+	/*
+	 * get the monotonic time in microseconds from the libc backend.
+	 */
+	unsigned long now_us();
 
 	struct Pthread_mutex;
 }
@@ -0,0 +1,122 @@
+/*
+ * \brief  Throughput and latency of file operations on a file system
+ * \date   2026-10-19
+ *
+ * The program writes a file in chunks, reads it back, and stats it
+ * repeatedly. Several instances running at the same time on one fuse_fs
+ * server show how well the server interleaves the requests of its clients.
+ *
+ * Usage: test-fuse_fs_bench <file> <size in KiB> <chunk size in KiB> <stats>
+ */
+
+/*
+ * Copyright (C) 2026 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU Affero General Public License version 3.
+ */
+
+/* libc includes */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+
+static unsigned long long now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec*1000*1000 + ts.tv_nsec/1000;
+}
+
+
+struct Latency
+{
+	unsigned long long total = 0, max = 0, count = 0;
+
+	template <typename FN>
+	bool measure(FN const &fn)
+	{
+		unsigned long long const start = now_us();
+		bool const ok = fn();
+		unsigned long long const us = now_us() - start;
+
+		total += us;
+		count++;
+		if (us > max) max = us;
+		return ok;
+	}
+
+	void print(char const *file, char const *op) const
+	{
+		printf("fuse_fs_bench: %s %s: %llu ops in %llu ms, avg %llu us, max %llu us\n",
+		       file, op, count, total/1000, count ? total/count : 0, max);
+	}
+};
+
+
+int main(int argc, char **argv)
+{
+	if (argc < 5) {
+		fprintf(stderr, "usage: %s <file> <KiB> <chunk KiB> <stats>\n", argv[0]);
+		return 1;
+	}
+
+	char const   *path  = argv[1];
+	size_t const  size  = strtoul(argv[2], nullptr, 0) * 1024;
+	size_t const  chunk = strtoul(argv[3], nullptr, 0) * 1024;
+	unsigned const stats = strtoul(argv[4], nullptr, 0);
+
+	char *buf = (char *)malloc(chunk);
+	if (!buf || !chunk) {
+		fprintf(stderr, "invalid chunk size\n");
+		return 1;
+	}
+	memset(buf, 0x55, chunk);
+
+	Latency write_lat, read_lat, stat_lat;
+
+	int fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "could not create %s\n", path);
+		return 1;
+	}
+
+	for (size_t off = 0; off < size; off += chunk)
+		if (!write_lat.measure([&] () {
+			return write(fd, buf, chunk) == (ssize_t)chunk; })) {
+			fprintf(stderr, "write failed at offset %zu\n", off);
+			return 1;
+		}
+
+	fsync(fd);
+	lseek(fd, 0, SEEK_SET);
+
+	for (size_t off = 0; off < size; off += chunk)
+		if (!read_lat.measure([&] () {
+			return read(fd, buf, chunk) == (ssize_t)chunk; })) {
+			fprintf(stderr, "read failed at offset %zu\n", off);
+			return 1;
+		}
+
+	close(fd);
+
+	for (unsigned i = 0; i < stats; i++) {
+		struct stat st;
+		stat_lat.measure([&] () { return stat(path, &st) == 0; });
+	}
+
+	write_lat.print(path, "write");
+	read_lat.print(path, "read");
+	stat_lat.print(path, "stat");
+
+	printf("fuse_fs_bench: %s done in %llu ms\n", path,
+	       (write_lat.total + read_lat.total + stat_lat.total)/1000);
+
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,3 @@
+TARGET = test-fuse_fs_bench
+SRC_CC = main.cc
+LIBS   = libc posix
@@ -0,0 +1,57 @@
+/*
+ * \brief  Throughput benchmark for Terminal entropy servers
+ * \date   2026-10-19
+ */
+
+/*
+ * Copyright (C) 2026 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU Affero General Public License version 3.
+ */
+
+#include <terminal_session/connection.h>
+#include <timer_session/connection.h>
+#include <base/attached_rom_dataspace.h>
+#include <base/component.h>
+#include <base/log.h>
+
+using namespace Genode;
+
+void Component::construct(Genode::Env &env)
+{
+	log("--- entropy throughput test started ---");
+
+	Attached_rom_dataspace config { env, "config" };
+	Terminal::Connection   entropy { env, "entropy" };
+	Timer::Connection      timer   { env };
+
+	uint64_t const total =
+		config.xml().attribute_value("bytes", (uint64_t)16 << 20);
+
+	static char buf[0x10000];
+
+	uint64_t count = 0;
+	unsigned reads = 0;
+
+	uint64_t const start_us = timer.elapsed_us();
+
+	while (count < total) {
+		size_t const n = entropy.read(buf, sizeof(buf));
+		if (n == 0) {
+			error("entropy server returned no data");
+			env.parent().exit(~0);
+			return;
+		}
+		count += n;
+		reads++;
+	}
+
+	uint64_t const duration_us = max(timer.elapsed_us() - start_us, (uint64_t)1);
+
+	log("read ", count, " bytes in ", reads, " reads within ",
+	    duration_us / 1000, " ms, ", count * 1000000 / duration_us, " bytes/s");
+
+	log("--- entropy throughput test finished ---");
+	env.parent().exit(0);
+}
@@ -0,0 +1,3 @@
+TARGET = test-jitter_sponge
+SRC_CC = main.cc
+LIBS   = base